@@ -9,10 +9,18 @@ expr
         | (ADD | SUB) expr  # UnaryOp
         | expr (MUL | DIV) expr  # BinaryOp
         | expr (ADD | SUB) expr  # BinaryOp
+        | FUNCTION '(' (arg (',' arg)*)? ')'  # Function
         | CELL  # Cell
+        | REF  # Ref
         | NUMBER  # Literal
         ;
 
+// диапазон допустим только как аргумент функции: MATCH(A1,B1:B10,0)
+arg
+        : CELL ':' CELL  # RangeArg
+        | expr  # ExprArg
+        ;
+
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
@@ -26,5 +34,11 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
-CELL: [A-Z]+[0-9]+ ;
+// ссылка на ячейку, возможно, другого листа книги: Sheet2!A1
+fragment SHEET: [A-Za-z_][A-Za-z0-9_]* ;
+CELL: (SHEET '!')? [A-Z]+[0-9]+ ;
+// имя функции; ссылка на ячейку длиннее и выигрывает у него
+FUNCTION: [A-Z]+ ;
+// ссылка на ячейки, удалённые вместе со строками или столбцами
+REF: '#REF!' ;
 WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
@@ -1,14 +1,22 @@
 #include "FormulaAST.h"
+#include "memory.h"
+#include "subexpressions.h"
+#include "trace.h"
 
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string>
+#include <vector>
 
 namespace ASTImpl {
 
@@ -72,6 +80,30 @@ namespace ASTImpl {
                          {PR_NONE,  PR_NONE,  PR_NONE,  PR_NONE,  PR_NONE, PR_NONE},
     };
 
+    // Соответствие элементов списков ссылок дерева элементам списков копии
+    class ReferenceCopies {
+    public:
+        void Add(const void* original, const void* copy) {
+            copies_.emplace_back(original, copy);
+        }
+
+        // Вызывается после добавления всех пар
+        void Sort() {
+            std::sort(copies_.begin(), copies_.end());
+        }
+
+        template<typename T>
+        const T* Find(const T* original) const {
+            auto it = std::lower_bound(copies_.begin(), copies_.end(),
+                                       std::pair<const void*, const void*>(original, nullptr));
+            assert(it != copies_.end() && it->first == original);
+            return static_cast<const T*>(it->second);
+        }
+
+    private:
+        std::vector<std::pair<const void*, const void*>> copies_;
+    };
+
     class Expr {
     public:
         virtual ~Expr() = default;
@@ -82,9 +114,44 @@ namespace ASTImpl {
 
         virtual double Evaluate(const CellLookup& cellLookup) const = 0;
 
+        // Значение аргумента функции поиска: ссылка на ячейку даёт значение
+        // ячейки как есть, остальные выражения — число
+        virtual CellInterface::Value EvaluateValue(const CellLookup& cellLookup) const {
+            return Evaluate(cellLookup);
+        }
+
+        // Диапазон, если узел — аргумент-диапазон функции
+        virtual const RangeRef* GetRange() const {
+            return nullptr;
+        }
+
+        // Ссылка на удалённые ячейки допустима на месте любого аргумента функции
+        virtual bool IsDeletedReference() const {
+            return false;
+        }
+
+        // Связывает арифметические узлы поддерева с общими узлами table и
+        // возвращает операнд для узла-родителя; nullopt, если поддерево
+        // разделять нельзя: в нём есть функция, диапазон, ссылка на другой
+        // лист или удалённая ссылка
+        virtual std::optional<SubexpressionTable::Operand> Share(SubexpressionTable& /* table */) {
+            return std::nullopt;
+        }
+
+        // Отвязывает поддерево от общих узлов
+        virtual void Unshare() {
+        }
+
+        // Копия поддерева, узлы ссылок которой указывают на элементы
+        // списков копии
+        virtual std::unique_ptr<Expr> Clone(const ReferenceCopies& copies) const = 0;
+
         // higher is tighter
         virtual ExprPrecedence GetPrecedence() const = 0;
 
+        // Память, занятая узлом вместе с поддеревом, в байтах
+        virtual size_t GetTreeBytes() const = 0;
+
         void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
                           bool right_child = false) const {
             auto precedence = GetPrecedence();
@@ -131,6 +198,10 @@ namespace ASTImpl {
                 rhs_->PrintFormula(out, precedence, /* right_child = */ true);
             }
 
+            std::unique_ptr<Expr> Clone(const ReferenceCopies& copies) const override {
+                return std::make_unique<BinaryOpExpr>(type_, lhs_->Clone(copies), rhs_->Clone(copies));
+            }
+
             ExprPrecedence GetPrecedence() const override {
                 switch (type_) {
                     case Add:
@@ -148,7 +219,35 @@ namespace ASTImpl {
                 }
             }
 
+            size_t GetTreeBytes() const override {
+                return sizeof(*this) + lhs_->GetTreeBytes() + rhs_->GetTreeBytes();
+            }
+
+            std::optional<SubexpressionTable::Operand> Share(SubexpressionTable& table) override {
+                shared_.Reset();
+                auto lhs = lhs_->Share(table);
+                auto rhs = rhs_->Share(table);
+                if (!lhs || !rhs) {
+                    return std::nullopt;
+                }
+                shared_ = SubexpressionRef(table.Acquire(type_, *lhs, *rhs));
+                return shared_.Get();
+            }
+
+            void Unshare() override {
+                shared_.Reset();
+                lhs_->Unshare();
+                rhs_->Unshare();
+            }
+
             double Evaluate(const CellLookup& cellLookup) const override {
+                return shared_.Evaluate([&] {
+                    return Compute(cellLookup);
+                });
+            }
+
+        private:
+            double Compute(const CellLookup& cellLookup) const {
                 auto lhs_operand = lhs_->Evaluate(cellLookup);
                 auto rhs_operand = rhs_->Evaluate(cellLookup);
                 double result = 0;
@@ -173,10 +272,11 @@ namespace ASTImpl {
                 return result;
             }
 
-        private:
             Type type_;
             std::unique_ptr<Expr> lhs_;
             std::unique_ptr<Expr> rhs_;
+            // Общий узел подвыражения, если формула связана с таблицей листа
+            SubexpressionRef shared_;
         };
 
         class UnaryOpExpr final : public Expr {
@@ -202,25 +302,51 @@ namespace ASTImpl {
                 operand_->PrintFormula(out, precedence);
             }
 
+            std::unique_ptr<Expr> Clone(const ReferenceCopies& copies) const override {
+                return std::make_unique<UnaryOpExpr>(type_, operand_->Clone(copies));
+            }
+
             ExprPrecedence GetPrecedence() const override {
                 return EP_UNARY;
             }
 
-            double Evaluate(const CellLookup& cellLookup) const override {
-                auto operand_value = operand_->Evaluate(cellLookup);
-                switch (type_) {
-                    case UnaryMinus:
-                        return -operand_value;
-                    case UnaryPlus:
-                        return +operand_value;
-                    default:
-                        return NAN;
+            size_t GetTreeBytes() const override {
+                return sizeof(*this) + operand_->GetTreeBytes();
+            }
+
+            std::optional<SubexpressionTable::Operand> Share(SubexpressionTable& table) override {
+                shared_.Reset();
+                auto operand = operand_->Share(table);
+                if (!operand) {
+                    return std::nullopt;
                 }
+                shared_ = SubexpressionRef(table.Acquire(type_, *operand));
+                return shared_.Get();
+            }
+
+            void Unshare() override {
+                shared_.Reset();
+                operand_->Unshare();
+            }
+
+            double Evaluate(const CellLookup& cellLookup) const override {
+                return shared_.Evaluate([&]() -> double {
+                    auto operand_value = operand_->Evaluate(cellLookup);
+                    switch (type_) {
+                        case UnaryMinus:
+                            return -operand_value;
+                        case UnaryPlus:
+                            return +operand_value;
+                        default:
+                            return NAN;
+                    }
+                });
             }
 
         private:
             Type type_;
             std::unique_ptr<Expr> operand_;
+            SubexpressionRef shared_;
         };
 
         class CellExpr final : public Expr {
@@ -233,7 +359,8 @@ namespace ASTImpl {
                 if (!cell_->IsValid()) {
                     out << FormulaError::Category::Ref;
                 } else {
-                    out << cell_->ToString();
+                    char buffer[Position::MAX_STRING_LENGTH];
+                    out.write(buffer, cell_->ToChars(buffer) - buffer);
                 }
             }
 
@@ -241,18 +368,375 @@ namespace ASTImpl {
                 Print(out);
             }
 
+            std::unique_ptr<Expr> Clone(const ReferenceCopies& copies) const override {
+                return std::make_unique<CellExpr>(copies.Find(cell_));
+            }
+
             ExprPrecedence GetPrecedence() const override {
                 return EP_ATOM;
             }
 
+            size_t GetTreeBytes() const override {
+                return sizeof(*this);
+            }
+
             double Evaluate(const CellLookup& cellLookup) const override {
-                return cellLookup(*cell_);
+                return cellLookup({}, *cell_);
+            }
+
+            std::optional<SubexpressionTable::Operand> Share(SubexpressionTable& /* table */) override {
+                if (!cell_->IsValid()) {
+                    return std::nullopt;
+                }
+                return *cell_;
+            }
+
+            CellInterface::Value EvaluateValue(const CellLookup& cellLookup) const override {
+                return cellLookup.GetValue({}, *cell_);
             }
 
         private:
             const Position* cell_;
         };
 
+        class ExternalCellExpr final : public Expr {
+        public:
+            explicit ExternalCellExpr(const ExternalCell* cell)
+                    : cell_(cell) {
+            }
+
+            void Print(std::ostream& out) const override {
+                if (!cell_->pos.IsValid()) {
+                    out << FormulaError::Category::Ref;
+                    return;
+                }
+                char buffer[Position::MAX_STRING_LENGTH];
+                out << cell_->sheet << '!';
+                out.write(buffer, cell_->pos.ToChars(buffer) - buffer);
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+                Print(out);
+            }
+
+            std::unique_ptr<Expr> Clone(const ReferenceCopies& copies) const override {
+                return std::make_unique<ExternalCellExpr>(copies.Find(cell_));
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            size_t GetTreeBytes() const override {
+                return sizeof(*this);
+            }
+
+            double Evaluate(const CellLookup& cellLookup) const override {
+                return cellLookup(cell_->sheet, cell_->pos);
+            }
+
+            CellInterface::Value EvaluateValue(const CellLookup& cellLookup) const override {
+                return cellLookup.GetValue(cell_->sheet, cell_->pos);
+            }
+
+        private:
+            const ExternalCell* cell_;
+        };
+
+        class RangeExpr final : public Expr {
+        public:
+            explicit RangeExpr(const RangeRef* range)
+                    : range_(range) {
+            }
+
+            void Print(std::ostream& out) const override {
+                if (!range_->range.IsValid()) {
+                    out << FormulaError::Category::Ref;
+                    return;
+                }
+                char buffer[Position::MAX_STRING_LENGTH];
+                if (!range_->sheet.empty()) {
+                    out << range_->sheet << '!';
+                }
+                out.write(buffer, range_->range.first.ToChars(buffer) - buffer);
+                out << ':';
+                out.write(buffer, range_->range.last.ToChars(buffer) - buffer);
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+                Print(out);
+            }
+
+            std::unique_ptr<Expr> Clone(const ReferenceCopies& copies) const override {
+                return std::make_unique<RangeExpr>(copies.Find(range_));
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            size_t GetTreeBytes() const override {
+                return sizeof(*this);
+            }
+
+            double Evaluate(const CellLookup& /* cellLookup */) const override {
+                // Грамматика допускает диапазон только там, где его ждёт функция
+                throw FormulaError(FormulaError::Category::Value);
+            }
+
+            const RangeRef* GetRange() const override {
+                return range_;
+            }
+
+        private:
+            const RangeRef* range_;
+        };
+
+        // Ссылка, ячейки которой удалены вместе со строками или столбцами
+        class DeletedRefExpr final : public Expr {
+        public:
+            void Print(std::ostream& out) const override {
+                out << FormulaError::Category::Ref;
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+                Print(out);
+            }
+
+            std::unique_ptr<Expr> Clone(const ReferenceCopies& /* copies */) const override {
+                return std::make_unique<DeletedRefExpr>();
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            size_t GetTreeBytes() const override {
+                return sizeof(*this);
+            }
+
+            double Evaluate(const CellLookup& /* cellLookup */) const override {
+                throw FormulaError(FormulaError::Category::Ref);
+            }
+
+            bool IsDeletedReference() const override {
+                return true;
+            }
+        };
+
+        // Функции поиска. Результат всегда число: текст в найденной ячейке
+        // даёт #VALUE!, пустая ячейка — ноль, отсутствие значения — #N/A.
+        class FunctionExpr final : public Expr {
+        public:
+            enum Type {
+                Match,    // MATCH(значение, диапазон, [тип=1])
+                VLookup,  // VLOOKUP(значение, таблица, столбец, [приблизительно=1])
+                XLookup,  // XLOOKUP(значение, диапазон, результаты, [если_нет], [режим=0])
+            };
+
+            struct Signature {
+                std::string_view name;
+                Type type;
+                size_t min_args;
+                size_t max_args;
+                // Бит i установлен, если аргумент i — диапазон; прочие
+                // аргументы — выражения
+                unsigned range_args;
+            };
+
+            static const Signature* FindSignature(std::string_view name) {
+                static const Signature SIGNATURES[] = {
+                        {"MATCH", Match, 2, 3, 0b010},
+                        {"VLOOKUP", VLookup, 3, 4, 0b010},
+                        {"XLOOKUP", XLookup, 3, 5, 0b110},
+                };
+                for (const auto& signature : SIGNATURES) {
+                    if (signature.name == name) {
+                        return &signature;
+                    }
+                }
+                return nullptr;
+            }
+
+        public:
+            explicit FunctionExpr(const Signature& signature, std::vector<std::unique_ptr<Expr>> args)
+                    : signature_(signature), args_(std::move(args)) {
+            }
+
+            void Print(std::ostream& out) const override {
+                out << '(' << signature_.name;
+                for (const auto& arg : args_) {
+                    out << ' ';
+                    arg->Print(out);
+                }
+                out << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+                out << signature_.name << '(';
+                for (size_t i = 0; i < args_.size(); ++i) {
+                    if (i > 0) {
+                        out << ',';
+                    }
+                    // Аргументы разделены запятыми, скобки вокруг них не нужны
+                    args_[i]->PrintFormula(out, EP_ADD);
+                }
+                out << ')';
+            }
+
+            std::unique_ptr<Expr> Clone(const ReferenceCopies& copies) const override {
+                std::vector<std::unique_ptr<Expr>> args;
+                args.reserve(args_.size());
+                for (const auto& arg : args_) {
+                    args.push_back(arg->Clone(copies));
+                }
+                return std::make_unique<FunctionExpr>(signature_, std::move(args));
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            size_t GetTreeBytes() const override {
+                size_t bytes = sizeof(*this) + args_.capacity() * sizeof(args_[0]);
+                for (const auto& arg : args_) {
+                    bytes += arg->GetTreeBytes();
+                }
+                return bytes;
+            }
+
+            // Сама функция зависит от диапазонов и не разделяется, но её
+            // аргументы могут
+            std::optional<SubexpressionTable::Operand> Share(SubexpressionTable& table) override {
+                for (const auto& arg : args_) {
+                    arg->Share(table);
+                }
+                return std::nullopt;
+            }
+
+            void Unshare() override {
+                for (const auto& arg : args_) {
+                    arg->Unshare();
+                }
+            }
+
+            double Evaluate(const CellLookup& cellLookup) const override {
+                switch (signature_.type) {
+                    case Match:
+                        return EvaluateMatch(cellLookup);
+                    case VLookup:
+                        return EvaluateVLookup(cellLookup);
+                    case XLookup:
+                        return EvaluateXLookup(cellLookup);
+                }
+                return NAN;
+            }
+
+        private:
+            static bool IsColumn(const Range& range) {
+                return range.first.col == range.last.col;
+            }
+
+            static bool IsLine(const Range& range) {
+                return IsColumn(range) || range.first.row == range.last.row;
+            }
+
+            // Диапазон аргумента i; удалённый диапазон даёт #REF!
+            const RangeRef& GetRangeArg(size_t i) const {
+                const RangeRef* ref = args_[i]->GetRange();
+                if (!ref || !ref->range.IsValid()) {
+                    throw FormulaError(FormulaError::Category::Ref);
+                }
+                return *ref;
+            }
+
+            CellInterface::Value EvaluateKey(const CellLookup& cellLookup) const {
+                auto key = args_[0]->EvaluateValue(cellLookup);
+                if (const auto* error = std::get_if<FormulaError>(&key)) {
+                    throw *error;
+                }
+                return key;
+            }
+
+            double EvaluateMatch(const CellLookup& cellLookup) const {
+                auto key = EvaluateKey(cellLookup);
+                const RangeRef& ref = GetRangeArg(1);
+                double type = args_.size() > 2 ? args_[2]->Evaluate(cellLookup) : 1;
+                if (!IsLine(ref.range)) {
+                    throw FormulaError(FormulaError::Category::NA);
+                }
+                auto mode = type == 0 ? LookupMode::Exact
+                                      : type > 0 ? LookupMode::ExactOrLess : LookupMode::ExactOrGreater;
+                auto offset = cellLookup.Lookup(ref.sheet, ref.range, key, mode);
+                if (!offset) {
+                    throw FormulaError(FormulaError::Category::NA);
+                }
+                return *offset + 1;
+            }
+
+            double EvaluateVLookup(const CellLookup& cellLookup) const {
+                auto key = EvaluateKey(cellLookup);
+                const RangeRef& ref = GetRangeArg(1);
+                const Range& table = ref.range;
+                double col = args_[2]->Evaluate(cellLookup);
+                bool approximate = args_.size() > 3 ? args_[3]->Evaluate(cellLookup) != 0 : true;
+                if (col < 1) {
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                if (col > table.GetSize().cols) {
+                    throw FormulaError(FormulaError::Category::Ref);
+                }
+                Range keys{table.first, {table.last.row, table.first.col}};
+                auto offset = cellLookup.Lookup(ref.sheet, keys, key,
+                                                approximate ? LookupMode::ExactOrLess : LookupMode::Exact);
+                if (!offset) {
+                    throw FormulaError(FormulaError::Category::NA);
+                }
+                return cellLookup(ref.sheet, {table.first.row + *offset, table.first.col + static_cast<int>(col) - 1});
+            }
+
+            double EvaluateXLookup(const CellLookup& cellLookup) const {
+                auto key = EvaluateKey(cellLookup);
+                const RangeRef& ref = GetRangeArg(1);
+                const RangeRef& results = GetRangeArg(2);
+                double type = args_.size() > 4 ? args_[4]->Evaluate(cellLookup) : 0;
+                if (!IsLine(ref.range)) {
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                // Результаты берутся из первого столбца или первой строки
+                // диапазона той же длины, что и диапазон поиска
+                bool column = IsColumn(ref.range);
+                auto size = ref.range.GetSize();
+                auto resultSize = results.range.GetSize();
+                if (column ? resultSize.rows != size.rows : resultSize.cols != size.cols) {
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                LookupMode mode;
+                if (type == 0) {
+                    mode = LookupMode::Exact;
+                } else if (type == -1) {
+                    mode = LookupMode::ExactOrLess;
+                } else if (type == 1) {
+                    mode = LookupMode::ExactOrGreater;
+                } else {
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                auto offset = cellLookup.Lookup(ref.sheet, ref.range, key, mode);
+                if (!offset) {
+                    if (args_.size() > 3) {
+                        return args_[3]->Evaluate(cellLookup);
+                    }
+                    throw FormulaError(FormulaError::Category::NA);
+                }
+                Position first = results.range.first;
+                return cellLookup(results.sheet, column ? Position{first.row + *offset, first.col}
+                                                        : Position{first.row, first.col + *offset});
+            }
+
+            const Signature& signature_;
+            std::vector<std::unique_ptr<Expr>> args_;
+        };
+
         class NumberExpr final : public Expr {
         public:
             explicit NumberExpr(double value)
@@ -267,14 +751,26 @@ namespace ASTImpl {
                 out << value_;
             }
 
+            std::unique_ptr<Expr> Clone(const ReferenceCopies& /* copies */) const override {
+                return std::make_unique<NumberExpr>(value_);
+            }
+
             ExprPrecedence GetPrecedence() const override {
                 return EP_ATOM;
             }
 
+            size_t GetTreeBytes() const override {
+                return sizeof(*this);
+            }
+
             double Evaluate(const CellLookup& cellLookup) const override {
                 return value_;
             }
 
+            std::optional<SubexpressionTable::Operand> Share(SubexpressionTable& /* table */) override {
+                return value_;
+            }
+
         private:
             double value_;
         };
@@ -293,6 +789,14 @@ namespace ASTImpl {
                 return std::move(cells_);
             }
 
+            std::forward_list<ExternalCell> MoveExternalCells() {
+                return std::move(external_cells_);
+            }
+
+            std::forward_list<RangeRef> MoveRanges() {
+                return std::move(ranges_);
+            }
+
         public:
             void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
                 assert(args_.size() >= 1);
@@ -312,30 +816,38 @@ namespace ASTImpl {
             }
 
             void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-                double value = 0;
                 auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-                std::istringstream in(valueStr);
-                in >> value;
-                if (!in) {
+                auto value = ParseDouble(valueStr);
+                if (!value) {
                     throw ParsingError("Invalid number: " + valueStr);
                 }
 
-                auto node = std::make_unique<NumberExpr>(value);
+                auto node = std::make_unique<NumberExpr>(*value);
                 args_.push_back(std::move(node));
             }
 
             void exitCell(FormulaParser::CellContext* ctx) override {
                 auto value_str = ctx->CELL()->getSymbol()->getText();
-                auto value = Position::FromString(value_str);
+                auto separator = value_str.find('!');
+                auto value = Position::FromString(std::string_view(value_str).substr(separator + 1));
                 if (!value.IsValid()) {
                     throw FormulaException("Invalid position: " + value_str);
                 }
 
+                if (separator != std::string::npos) {
+                    external_cells_.push_front({value_str.substr(0, separator), value});
+                    args_.push_back(std::make_unique<ExternalCellExpr>(&external_cells_.front()));
+                    return;
+                }
                 cells_.push_front(value);
                 auto node = std::make_unique<CellExpr>(&cells_.front());
                 args_.push_back(std::move(node));
             }
 
+            void exitRef(FormulaParser::RefContext* /* ctx */) override {
+                args_.push_back(std::make_unique<DeletedRefExpr>());
+            }
+
             void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
                 assert(args_.size() >= 2);
 
@@ -360,6 +872,48 @@ namespace ASTImpl {
                 args_.back() = std::move(node);
             }
 
+            void exitRangeArg(FormulaParser::RangeArgContext* ctx) override {
+                auto first_str = ctx->CELL(0)->getSymbol()->getText();
+                auto last_str = ctx->CELL(1)->getSymbol()->getText();
+                auto separator = first_str.find('!');
+                auto first = Position::FromString(std::string_view(first_str).substr(separator + 1));
+                auto last = Position::FromString(last_str);
+                // Лист указывается только перед первым углом: Sheet2!A1:B10
+                if (!first.IsValid() || !last.IsValid()) {
+                    throw FormulaException("Invalid range: " + first_str + ':' + last_str);
+                }
+
+                Range range{{std::min(first.row, last.row), std::min(first.col, last.col)},
+                            {std::max(first.row, last.row), std::max(first.col, last.col)}};
+                ranges_.push_front({separator == std::string::npos ? std::string() : first_str.substr(0, separator),
+                                    range});
+                args_.push_back(std::make_unique<RangeExpr>(&ranges_.front()));
+            }
+
+            void exitFunction(FormulaParser::FunctionContext* ctx) override {
+                auto name = ctx->FUNCTION()->getSymbol()->getText();
+                const auto* signature = FunctionExpr::FindSignature(name);
+                if (!signature) {
+                    throw ParsingError("Unknown function: " + name);
+                }
+                size_t count = ctx->arg().size();
+                if (count < signature->min_args || count > signature->max_args) {
+                    throw ParsingError("Wrong number of arguments: " + name);
+                }
+                assert(args_.size() >= count);
+
+                std::vector<std::unique_ptr<Expr>> args(std::make_move_iterator(args_.end() - count),
+                                                        std::make_move_iterator(args_.end()));
+                args_.resize(args_.size() - count);
+                for (size_t i = 0; i < count; ++i) {
+                    bool range_expected = signature->range_args >> i & 1;
+                    if (range_expected != (args[i]->GetRange() != nullptr) && !args[i]->IsDeletedReference()) {
+                        throw ParsingError("Wrong argument " + std::to_string(i + 1) + " of " + name);
+                    }
+                }
+                args_.push_back(std::make_unique<FunctionExpr>(*signature, std::move(args)));
+            }
+
             void visitErrorNode(antlr4::tree::ErrorNode* node) override {
                 throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
             }
@@ -367,6 +921,8 @@ namespace ASTImpl {
         private:
             std::vector<std::unique_ptr<Expr>> args_;
             std::forward_list<Position> cells_;
+            std::forward_list<ExternalCell> external_cells_;
+            std::forward_list<RangeRef> ranges_;
         };
 
         class BailErrorListener : public antlr4::BaseErrorListener {
@@ -382,33 +938,62 @@ namespace ASTImpl {
     }  // namespace
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
-    using namespace antlr4;
+namespace {
+    FormulaAST ParseInput(antlr4::ANTLRInputStream& input) {
+        using namespace antlr4;
 
-    ANTLRInputStream input(in);
+        FormulaLexer lexer(&input);
+        ASTImpl::BailErrorListener error_listener;
+        lexer.removeErrorListeners();
+        lexer.addErrorListener(&error_listener);
 
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
+        CommonTokenStream tokens(&lexer);
 
-    CommonTokenStream tokens(&lexer);
+        FormulaParser parser(&tokens);
+        auto error_handler = std::make_shared<BailErrorStrategy>();
+        parser.setErrorHandler(error_handler);
+        parser.removeErrorListeners();
 
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
+        tree::ParseTree* tree = parser.main();
+        ASTImpl::ParseASTListener listener;
+        tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+        return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveExternalCells(),
+                          listener.MoveRanges());
+    }
+}  // namespace
+
+std::optional<double> ParseDouble(std::string_view str) {
+    double value = 0;
+    const char* end = str.data() + str.size();
+    auto [ptr, ec] = std::from_chars(str.data(), end, value);
+    if (ptr != end) {
+        return std::nullopt;
+    }
+    if (ec == std::errc::result_out_of_range) {
+        // from_chars не различает переполнение и потерю значимости; этот
+        // редкий случай разбирает поток, сводящий потерю значимости к нулю
+        std::istringstream in{std::string(str)};
+        if (!(in >> value) || !in.eof()) {
+            return std::nullopt;
+        }
+    } else if (ec != std::errc()) {
+        return std::nullopt;
+    }
+    return value;
+}
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+FormulaAST ParseFormulaAST(std::istream& in) {
+    antlr4::ANTLRInputStream input(in);
+    return ParseInput(input);
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+FormulaAST ParseFormulaAST(std::string_view in_str) {
+#ifdef SPREADSHEET_TRACING
+    trace::Scope scope("ParseFormulaAST");
+#endif
+    antlr4::ANTLRInputStream input(in_str.data(), in_str.size());
+    return ParseInput(input);
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
@@ -425,13 +1010,134 @@ void FormulaAST::PrintFormula(std::ostream& out) const {
     root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
+size_t FormulaAST::GetAstBytes() const {
+    return root_expr_->GetTreeBytes();
+}
+
+size_t FormulaAST::GetCellListBytes() const {
+    // Узел односвязного списка: указатель на следующий узел и значение
+    size_t nodes = std::distance(cells_.begin(), cells_.end());
+    size_t bytes = nodes * (sizeof(void*) + sizeof(Position));
+    for (const auto& cell : external_cells_) {
+        bytes += sizeof(void*) + sizeof(ExternalCell) + StringHeapBytes(cell.sheet);
+    }
+    for (const auto& range : ranges_) {
+        bytes += sizeof(void*) + sizeof(RangeRef) + StringHeapBytes(range.sheet);
+    }
+    return bytes;
+}
+
+ReferenceShift::Effect FormulaAST::ShiftReferences(const ReferenceShift& shift,
+                                                   const std::function<bool(std::string_view)>& isTarget) {
+    return RemapReferences(shift, isTarget);
+}
+
+ReferenceShift::Effect FormulaAST::ShiftReferences(const ReferenceMove& move,
+                                                   const std::function<bool(std::string_view)>& isTarget) {
+    return RemapReferences(move, isTarget);
+}
+
+ReferenceShift::Effect FormulaAST::ShiftReferences(const ReferencePermutation& permutation,
+                                                   const std::function<bool(std::string_view)>& isTarget) {
+    return RemapReferences(permutation, isTarget);
+}
+
+void FormulaAST::ShareSubexpressions(SubexpressionTable* table) {
+    if (table) {
+        root_expr_->Share(*table);
+    } else {
+        root_expr_->Unshare();
+    }
+}
+
+template<typename Remap>
+ReferenceShift::Effect FormulaAST::RemapReferences(const Remap& remap,
+                                                   const std::function<bool(std::string_view)>& isTarget) {
+    using Effect = ReferenceShift::Effect;
+    Effect effect = Effect::None;
+    auto shiftPosition = [&](Position& pos) {
+        Position moved = pos.IsValid() ? remap.Apply(pos) : pos;
+        if (moved != pos) {
+            effect = std::max(effect, moved.IsValid() ? Effect::Moved : Effect::Changed);
+            pos = moved;
+        }
+    };
+    if (isTarget({})) {
+        for (auto& cell : cells_) {
+            shiftPosition(cell);
+        }
+        // Сортировка перецепляет узлы списка, и указатели на них остаются в силе
+        cells_.sort();
+    }
+    for (auto& cell : external_cells_) {
+        if (isTarget(cell.sheet)) {
+            shiftPosition(cell.pos);
+        }
+    }
+    external_cells_.sort();
+    for (auto& ref : ranges_) {
+        if (!ref.range.IsValid() || !isTarget(ref.sheet)) {
+            continue;
+        }
+        Range moved = remap.Apply(ref.range);
+        if (moved == ref.range) {
+            continue;
+        }
+        bool sameSize = moved.IsValid() && moved.GetSize() == ref.range.GetSize();
+        effect = std::max(effect, sameSize ? Effect::Moved : Effect::Changed);
+        ref.range = moved;
+    }
+    return effect;
+}
+
+FormulaAST FormulaAST::Copy(int rows, int cols) const {
+    auto offset = [rows, cols](Position pos) {
+        Position moved{pos.row + rows, pos.col + cols};
+        return pos.IsValid() && moved.IsValid() ? moved : Position::NONE;
+    };
+    // Списки копируются в том же порядке, и узлы дерева копии находят свои
+    // элементы по адресам исходных
+    ASTImpl::ReferenceCopies copies;
+    std::forward_list<Position> cells;
+    auto cell = cells.before_begin();
+    for (const auto& pos : cells_) {
+        cell = cells.insert_after(cell, offset(pos));
+        copies.Add(&pos, &*cell);
+    }
+    std::forward_list<ExternalCell> external_cells;
+    auto external = external_cells.before_begin();
+    for (const auto& ref : external_cells_) {
+        external = external_cells.insert_after(external, {ref.sheet, offset(ref.pos)});
+        copies.Add(&ref, &*external);
+    }
+    std::forward_list<RangeRef> ranges;
+    auto range = ranges.before_begin();
+    for (const auto& ref : ranges_) {
+        Range moved{offset(ref.range.first), offset(ref.range.last)};
+        if (!moved.IsValid()) {
+            moved = {Position::NONE, Position::NONE};
+        }
+        range = ranges.insert_after(range, {ref.sheet, moved});
+        copies.Add(&ref, &*range);
+    }
+    copies.Sort();
+    return FormulaAST(root_expr_->Clone(copies), std::move(cells), std::move(external_cells), std::move(ranges));
+}
+
 double FormulaAST::Execute(const CellLookup& cellLookup) const {
     return root_expr_->Evaluate(cellLookup);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-        : root_expr_(std::move(root_expr)), cells_(std::move(cells)) {
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+                       std::forward_list<ExternalCell> external_cells, std::forward_list<RangeRef> ranges)
+        : root_expr_(std::move(root_expr)), cells_(std::move(cells)), external_cells_(std::move(external_cells)),
+          ranges_(std::move(ranges)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+    external_cells_.sort();
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
+
 FormulaAST::~FormulaAST() = default;
\ No newline at end of file
@@ -5,14 +5,32 @@
 
 #include <forward_list>
 #include <functional>
+#include <optional>
 #include <stdexcept>
 
-using CellLookup = std::function<double(Position)>;
+// Доступ формулы к ячейкам при вычислении. Пустое имя листа обозначает
+// лист формулы.
+class CellLookup {
+public:
+    virtual ~CellLookup() = default;
+
+    // Значение ячейки pos листа sheet как число
+    virtual double operator()(std::string_view sheet, Position pos) const = 0;
+
+    // Значение ячейки без приведения к числу
+    virtual CellInterface::Value GetValue(std::string_view sheet, Position pos) const = 0;
+
+    // Смещение первой ячейки диапазона, подходящей к key; см. SheetInterface::Lookup
+    virtual std::optional<int> Lookup(std::string_view sheet, const Range& range,
+                                      const CellInterface::Value& key, LookupMode mode) const = 0;
+};
 
 namespace ASTImpl {
     class Expr;
 }
 
+class SubexpressionTable;
+
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
@@ -20,11 +38,13 @@ class ParsingError : public std::runtime_error {
 class FormulaAST {
 public:
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+                        std::forward_list<Position> cells,
+                        std::forward_list<ExternalCell> external_cells = {},
+                        std::forward_list<RangeRef> ranges = {});
 
-    FormulaAST(FormulaAST&&) = default;
+    FormulaAST(FormulaAST&&);
 
-    FormulaAST& operator=(FormulaAST&&) = default;
+    FormulaAST& operator=(FormulaAST&&);
 
     ~FormulaAST();
 
@@ -36,6 +56,32 @@ public:
 
     void PrintFormula(std::ostream& out) const;
 
+    // Сдвигает ссылки на листы, для имён которых isTarget возвращает true;
+    // узлы дерева указывают на элементы списков и видят новые позиции
+    ReferenceShift::Effect ShiftReferences(const ReferenceShift& shift,
+                                           const std::function<bool(std::string_view)>& isTarget);
+
+    ReferenceShift::Effect ShiftReferences(const ReferenceMove& move,
+                                           const std::function<bool(std::string_view)>& isTarget);
+
+    ReferenceShift::Effect ShiftReferences(const ReferencePermutation& permutation,
+                                           const std::function<bool(std::string_view)>& isTarget);
+
+    // Связывает арифметические подвыражения с общими узлами table либо,
+    // если table пуст, отвязывает их. Повторный вызов связывает дерево
+    // заново, например после переноса ссылок.
+    void ShareSubexpressions(SubexpressionTable* table);
+
+    // Копия дерева, все ссылки которой смещены на rows строк и cols
+    // столбцов; ушедшие за пределы листа становятся #REF!. Копия не
+    // связана с общими узлами.
+    FormulaAST Copy(int rows, int cols) const;
+
+    // Память, занятая узлами дерева и списком ячеек, в байтах
+    size_t GetAstBytes() const;
+
+    size_t GetCellListBytes() const;
+
     std::forward_list<Position>& GetCells() {
         return cells_;
     }
@@ -44,16 +90,35 @@ public:
         return cells_;
     }
 
+    // Ссылки на ячейки других листов, по возрастанию
+    const std::forward_list<ExternalCell>& GetExternalCells() const {
+        return external_cells_;
+    }
+
+    // Диапазоны, переданные функциям поиска, в порядке разбора
+    const std::forward_list<RangeRef>& GetRanges() const {
+        return ranges_;
+    }
+
 private:
+    template<typename Remap>
+    ReferenceShift::Effect RemapReferences(const Remap& remap, const std::function<bool(std::string_view)>& isTarget);
+
     std::unique_ptr<ASTImpl::Expr> root_expr_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
     std::forward_list<Position> cells_;
+    std::forward_list<ExternalCell> external_cells_;
+    std::forward_list<RangeRef> ranges_;
 };
 
+// Разбирает десятичное число, занимающее всю строку, без учёта локали.
+// Потеря значимости даёт ноль, переполнение и некорректный текст — nullopt.
+std::optional<double> ParseDouble(std::string_view str);
+
 FormulaAST ParseFormulaAST(std::istream& in);
 
-FormulaAST ParseFormulaAST(const std::string& in_str);
+FormulaAST ParseFormulaAST(std::string_view in_str);
   
\ No newline at end of file
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <vector>
+
+// Небольшой каркас бенчмарков spreadsheet_bench. Каждый бенчмарк
+// регистрируется макросом BENCHMARK и получает контекст, через который
+// замеряет операции и сообщает дополнительные метрики. Результаты
+// выводятся в JSON, чтобы прогоны можно было сравнивать.
+namespace bench {
+
+    struct Result {
+        std::string name;
+        uint64_t operations = 0;
+        double seconds = 0;
+        std::map<std::string, double> metrics;
+    };
+
+    class Context {
+    public:
+        Context(double scale, uint32_t seed, std::vector<Result>& results)
+                : scale_(scale), seed_(seed), results_(results) {
+        }
+
+        // Масштабирует размер задачи; базовые размеры подобраны так, чтобы
+        // весь набор при scale = 1 выполнялся за секунды
+        size_t Scaled(size_t base) const {
+            auto scaled = static_cast<size_t>(base * scale_);
+            return scaled > 0 ? scaled : 1;
+        }
+
+        uint32_t GetSeed() const {
+            return seed_;
+        }
+
+        // Замеряет func, выполняющую operations операций, и добавляет
+        // результат под именем name. Возвращает добавленный результат, к
+        // которому можно приписать метрики; ссылка действительна до
+        // следующего замера.
+        template<typename Func>
+        Result& Measure(const std::string& name, uint64_t operations, Func func) {
+            auto start = std::chrono::steady_clock::now();
+            func();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            results_.push_back({name, operations, elapsed.count(), {}});
+            return results_.back();
+        }
+
+        Result& Report(const std::string& name) {
+            results_.push_back({name, 0, 0, {}});
+            return results_.back();
+        }
+
+    private:
+        double scale_;
+        uint32_t seed_;
+        std::vector<Result>& results_;
+    };
+
+    using Benchmark = std::function<void(Context&)>;
+
+    struct Registrar {
+        Registrar(const char* name, Benchmark benchmark);
+    };
+
+    const std::vector<std::pair<std::string, Benchmark>>& GetBenchmarks();
+
+    // Не даёт компилятору выбросить вычисления, результат которых не нужен
+    void DoNotOptimize(double value);
+
+    void WriteJson(std::ostream& out, const std::vector<Result>& results, double scale, uint32_t seed);
+
+}  // namespace bench
+
+#define BENCH_CONCAT_IMPL(a, b) a##b
+#define BENCH_CONCAT(a, b) BENCH_CONCAT_IMPL(a, b)
+#define BENCHMARK(name)                                                                   \
+  static void BENCH_CONCAT(Benchmark_, __LINE__)(bench::Context&);                      \
+  static bench::Registrar BENCH_CONCAT(registrar_, __LINE__)(name, BENCH_CONCAT(Benchmark_, __LINE__)); \
+  static void BENCH_CONCAT(Benchmark_, __LINE__)(bench::Context& context)
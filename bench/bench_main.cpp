@@ -0,0 +1,131 @@
+// spreadsheet_bench: воспроизводимый набор бенчмарков движка таблицы.
+// Запуск: spreadsheet_bench [--filter=подстрока] [--scale=множитель]
+//                           [--seed=число] [--out=файл.json]
+// Без --out JSON выводится в stdout, краткая сводка — в stderr.
+
+#include "bench.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+namespace bench {
+
+    namespace {
+        std::vector<std::pair<std::string, Benchmark>>& GetRegistry() {
+            static std::vector<std::pair<std::string, Benchmark>> registry;
+            return registry;
+        }
+
+        volatile double sink;
+
+        void WriteJsonString(std::ostream& out, std::string_view str) {
+            out << '"';
+            for (char c : str) {
+                if (c == '"' || c == '\\') {
+                    out << '\\';
+                }
+                out << c;
+            }
+            out << '"';
+        }
+    }  // namespace
+
+    Registrar::Registrar(const char* name, Benchmark benchmark) {
+        GetRegistry().emplace_back(name, std::move(benchmark));
+    }
+
+    const std::vector<std::pair<std::string, Benchmark>>& GetBenchmarks() {
+        return GetRegistry();
+    }
+
+    void DoNotOptimize(double value) {
+        sink = value;
+    }
+
+    void WriteJson(std::ostream& out, const std::vector<Result>& results, double scale, uint32_t seed) {
+        out << std::setprecision(9);
+        out << "{\n  \"scale\": " << scale << ",\n  \"seed\": " << seed << ",\n  \"results\": [";
+        bool first = true;
+        for (const auto& result : results) {
+            out << (first ? "\n" : ",\n") << "    {\"name\": ";
+            first = false;
+            WriteJsonString(out, result.name);
+            if (result.operations > 0) {
+                out << ", \"operations\": " << result.operations
+                    << ", \"seconds\": " << result.seconds
+                    << ", \"ns_per_op\": " << result.seconds * 1e9 / result.operations
+                    << ", \"ops_per_second\": " << (result.seconds > 0 ? result.operations / result.seconds : 0);
+            }
+            for (const auto& [key, value] : result.metrics) {
+                out << ", ";
+                WriteJsonString(out, key);
+                out << ": " << value;
+            }
+            out << '}';
+        }
+        out << "\n  ]\n}\n";
+    }
+
+}  // namespace bench
+
+int main(int argc, char* argv[]) {
+    std::string filter;
+    std::string out_path;
+    double scale = 1;
+    uint32_t seed = 42;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        auto value = [&](std::string_view prefix) {
+            return std::string(arg.substr(prefix.size()));
+        };
+        if (arg.rfind("--filter=", 0) == 0) {
+            filter = value("--filter=");
+        } else if (arg.rfind("--scale=", 0) == 0) {
+            scale = std::strtod(value("--scale=").c_str(), nullptr);
+        } else if (arg.rfind("--seed=", 0) == 0) {
+            seed = static_cast<uint32_t>(std::strtoul(value("--seed=").c_str(), nullptr, 10));
+        } else if (arg.rfind("--out=", 0) == 0) {
+            out_path = value("--out=");
+        } else {
+            std::cerr << "Unknown argument: " << arg << '\n';
+            return 1;
+        }
+    }
+
+    std::vector<bench::Result> results;
+    for (const auto& [name, benchmark] : bench::GetBenchmarks()) {
+        if (!filter.empty() && name.find(filter) == std::string::npos) {
+            continue;
+        }
+        size_t first_result = results.size();
+        bench::Context context(scale, seed, results);
+        benchmark(context);
+        for (size_t i = first_result; i < results.size(); ++i) {
+            const auto& result = results[i];
+            std::cerr << result.name;
+            if (result.operations > 0) {
+                std::cerr << ": " << result.seconds * 1e9 / result.operations << " ns/op";
+            }
+            for (const auto& [key, metric] : result.metrics) {
+                std::cerr << ", " << key << " = " << metric;
+            }
+            std::cerr << '\n';
+        }
+    }
+
+    if (out_path.empty()) {
+        bench::WriteJson(std::cout, results, scale, seed);
+    } else {
+        std::ofstream out(out_path);
+        bench::WriteJson(out, results, scale, seed);
+        if (!out) {
+            std::cerr << "Cannot write " << out_path << '\n';
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,64 @@
+// Скорость разбора формул и приведения текста ячеек к числу.
+
+#include "bench.h"
+#include "common.h"
+#include "formula.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+    std::string RandomNumber(std::mt19937& random) {
+        std::string number = std::to_string(random() % 100000);
+        switch (random() % 4) {
+            case 0:
+                return number;
+            case 1:
+                return number + "." + std::to_string(random() % 1000);
+            case 2:
+                return "." + number;
+            default:
+                return number + "e-" + std::to_string(random() % 30);
+        }
+    }
+}
+
+BENCHMARK("formula") {
+    size_t count = context.Scaled(100'000);
+
+    std::mt19937 random(context.GetSeed());
+    std::vector<std::string> formulas(count);
+    size_t bytes = 0;
+    for (auto& formula : formulas) {
+        Position pos{int(random() % 1000), int(random() % 100)};
+        formula = RandomNumber(random) + "*(" + pos.ToString() + "+" + RandomNumber(random)
+                  + ")/" + RandomNumber(random) + "-" + RandomNumber(random);
+        bytes += formula.size();
+    }
+
+    context.Measure("formula/parse", count, [&] {
+        size_t sum = 0;
+        for (const auto& formula : formulas) {
+            sum += ParseFormula(formula)->GetReferencedCells().size();
+        }
+        bench::DoNotOptimize(sum);
+    }).metrics["bytes"] = bytes;
+
+    const int cells = 1000;
+    auto sheet = CreateSheet();
+    std::string sum_expression;
+    for (int row = 0; row < cells; ++row) {
+        sheet->SetCell({row, 0}, RandomNumber(random));
+        sum_expression += (row ? "+A" : "A") + std::to_string(row + 1);
+    }
+    auto sum_formula = ParseFormula(sum_expression);
+    size_t rounds = context.Scaled(10'000);
+    context.Measure("formula/text_coercion", rounds * cells, [&] {
+        double sum = 0;
+        for (size_t i = 0; i < rounds; ++i) {
+            sum += std::get<double>(sum_formula->Evaluate(*sheet));
+        }
+        bench::DoNotOptimize(sum);
+    });
+}
@@ -0,0 +1,97 @@
+// Функции поиска: столбец формул MATCH по столбцу ключей на весь лист.
+// Индекс строится один раз при первом поиске, после чего каждый поиск не
+// зависит от длины диапазона; для сравнения — просмотр диапазона целиком.
+
+#include "bench.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <random>
+#include <string>
+
+BENCHMARK("lookup") {
+    int rows = static_cast<int>(std::min<size_t>(context.Scaled(Position::MAX_ROWS), Position::MAX_ROWS));
+    int lookups = static_cast<int>(std::min<size_t>(context.Scaled(100'000), rows));
+    std::string range = "A1:A" + std::to_string(rows);
+    // Нечётный множитель переставляет ключи 0..rows-1, если rows — степень двойки
+    auto key = [rows](int row) {
+        return static_cast<int>((static_cast<long long>(row) * 48271 + 11) % rows);
+    };
+
+    Sheet sheet;
+    context.Measure("lookup/fill_keys", rows, [&] {
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell({row, 0}, std::to_string(key(row)));
+        }
+    });
+
+    std::mt19937 random(context.GetSeed());
+    context.Measure("lookup/set_formulas", lookups, [&] {
+        for (int row = 0; row < lookups; ++row) {
+            sheet.SetCell({row, 2}, "=MATCH(" + std::to_string(random() % rows) + "," + range + ",0)");
+        }
+    });
+
+    auto evaluate = [&] {
+        double sum = 0;
+        for (int row = 0; row < lookups; ++row) {
+            auto value = sheet.GetCell({row, 2})->GetValue();
+            sum += std::holds_alternative<double>(value) ? std::get<double>(value) : 0;
+        }
+        bench::DoNotOptimize(sum);
+    };
+    auto& first = context.Measure("lookup/first_pass", lookups, evaluate);
+    first.metrics["index_bytes"] = sheet.GetMemoryUsage().lookup_indexes;
+
+    // Правка ключа сбрасывает все формулы диапазона, а индекс обновляется
+    // на месте
+    size_t edits = context.Scaled(10);
+    context.Measure("lookup/edit_and_reevaluate", edits * lookups, [&] {
+        for (size_t i = 0; i < edits; ++i) {
+            int row = static_cast<int>(random() % rows);
+            sheet.SetCell({row, 0}, std::to_string(key(row)));
+            evaluate();
+        }
+    });
+
+    size_t scans = context.Scaled(20);
+    context.Measure("lookup/linear_scan", scans, [&] {
+        double sum = 0;
+        for (size_t i = 0; i < scans; ++i) {
+            CellInterface::Value value = static_cast<double>(random() % rows);
+            sum += sheet.SheetInterface::Lookup({{0, 0}, {rows - 1, 0}}, value, LookupMode::Exact).value_or(-1);
+        }
+        bench::DoNotOptimize(sum);
+    });
+}
+
+// Столбец-цепочка, у каждой строки которого своё окно MATCH из трёх
+// ячеек: правка начала цепочки сбрасывает все формулы, и для каждой
+// ячейки цепочки находятся окна, в которые она входит. Лист пересчитывается
+// после каждой правки, иначе следующей правке нечего сбрасывать.
+BENCHMARK("lookup_windows") {
+    int rows = static_cast<int>(std::min<size_t>(context.Scaled(8'000), Position::MAX_ROWS - 2));
+    Sheet sheet;
+    sheet.SetCell({0, 0}, "1");
+    for (int row = 1; row < rows + 2; ++row) {
+        sheet.SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+    }
+    for (int row = 0; row < rows; ++row) {
+        sheet.SetCell({row, 1}, "=MATCH(3,A" + std::to_string(row + 1) + ":A" + std::to_string(row + 3) + ",0)");
+    }
+
+    sheet.Recalculate();
+
+    size_t edits = context.Scaled(20);
+    context.Measure("lookup_windows/edit_and_recalculate", edits, [&] {
+        for (size_t i = 0; i < edits; ++i) {
+            sheet.SetCell({0, 0}, std::to_string(i % 7));
+            sheet.Recalculate();
+        }
+    });
+
+    // Очистка столбца окон удаляет диапазоны и их индексы по одному
+    context.Measure("lookup_windows/clear", rows, [&] {
+        sheet.ClearRange({{0, 1}, {rows - 1, 1}});
+    });
+}
@@ -0,0 +1,48 @@
+// Запись формул через кэш разбора: тысячи ячеек с одинаковой формулой из
+// шаблона и повторная отправка уже записанных текстов берут формулу из
+// кэша без ANTLR, а первая запись уникальной формулы платит за поиск и
+// вставку в кэш. Для сравнения — те же правки с выключенным кэшем.
+
+#include "bench.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <string>
+
+namespace {
+    const std::string TEMPLATE = "=(C1-D1)/D1*100+VLOOKUP(E1,F1:G100,2,0)";
+    // Строк на странице клиента; страница помещается в кэш
+    constexpr int PAGE_ROWS = 500;
+
+    void MeasureSet(bench::Context& context, const std::string& name, size_t capacity) {
+        int rows = static_cast<int>(context.Scaled(100'000));
+        Sheet sheet;
+        sheet.GetFormulaCache().SetCapacity(capacity);
+        context.Measure(name + "/template", rows, [&] {
+            for (int row = 0; row < rows; ++row) {
+                sheet.SetCell({row, 0}, TEMPLATE);
+            }
+        });
+        // Клиент записывает страницу формул и затем присылает её тексты ещё
+        // раз: каждая формула разбирается один раз и один раз берётся из кэша
+        auto& resend = context.Measure(name + "/resend", 2 * rows, [&] {
+            for (int page = 0; page < rows; page += PAGE_ROWS) {
+                int end = std::min(rows, page + PAGE_ROWS);
+                for (int row = page; row < end; ++row) {
+                    sheet.SetCell({row, 1}, "=A" + std::to_string(row + 1) + "*2");
+                }
+                for (int row = page; row < end; ++row) {
+                    sheet.SetCell({row, 1}, sheet.GetCell({row, 1})->GetText());
+                }
+            }
+        });
+        auto stats = sheet.GetFormulaCache().GetStats();
+        resend.metrics["hit_rate"] = stats.GetHitRate();
+        resend.metrics["cache_bytes"] = static_cast<double>(sheet.GetMemoryUsage().formula_cache);
+    }
+}
+
+BENCHMARK("parse_cache") {
+    MeasureSet(context, "parse_cache/on", FormulaCache::DEFAULT_CAPACITY);
+    MeasureSet(context, "parse_cache/off", 0);
+}
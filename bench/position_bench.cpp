@@ -0,0 +1,56 @@
+// Разбор и печать ссылок на ячейки.
+
+#include "bench.h"
+#include "common.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+BENCHMARK("position") {
+    size_t count = context.Scaled(2'000'000);
+
+    std::mt19937 random(context.GetSeed());
+    std::uniform_int_distribution<int> rows(0, Position::MAX_ROWS - 1);
+    std::uniform_int_distribution<int> cols(0, Position::MAX_COLS - 1);
+    std::vector<Position> positions(count);
+    for (auto& pos : positions) {
+        pos = {rows(random), cols(random)};
+    }
+
+    std::string refs;
+    std::vector<size_t> offsets;
+    offsets.reserve(count + 1);
+    for (const auto& pos : positions) {
+        offsets.push_back(refs.size());
+        refs += pos.ToString();
+    }
+    offsets.push_back(refs.size());
+
+    context.Measure("position/from_string", count, [&] {
+        long long sum = 0;
+        std::string_view all = refs;
+        for (size_t i = 0; i < count; ++i) {
+            auto pos = Position::FromString(all.substr(offsets[i], offsets[i + 1] - offsets[i]));
+            sum += pos.row + pos.col;
+        }
+        bench::DoNotOptimize(sum);
+    });
+
+    context.Measure("position/to_chars", count, [&] {
+        long long sum = 0;
+        char buffer[Position::MAX_STRING_LENGTH];
+        for (const auto& pos : positions) {
+            sum += pos.ToChars(buffer) - buffer;
+        }
+        bench::DoNotOptimize(sum);
+    });
+
+    context.Measure("position/to_string", count, [&] {
+        long long sum = 0;
+        for (const auto& pos : positions) {
+            sum += pos.ToString().size();
+        }
+        bench::DoNotOptimize(sum);
+    });
+}
@@ -0,0 +1,36 @@
+// Накладные расходы профилировщика пересчёта на холодном вычислении цепочки.
+
+#include "bench.h"
+#include "sheet.h"
+
+#include <string>
+
+BENCHMARK("profiler") {
+    const int length = 5000;
+    size_t rounds = context.Scaled(200);
+
+    for (bool enabled : {false, true}) {
+        Sheet sheet;
+        sheet.GetProfiler().SetEnabled(enabled);
+        sheet.SetCell({0, 0}, "1");
+        for (int row = 1; row < length; ++row) {
+            sheet.SetCell({row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+        }
+        const CellInterface* last = sheet.GetCell({length - 1, 0});
+
+        auto& result = context.Measure(enabled ? "profiler/chain/enabled" : "profiler/chain/disabled",
+                                       rounds * length, [&] {
+            double sum = 0;
+            for (size_t i = 0; i < rounds; ++i) {
+                sheet.SetCell({0, 0}, std::to_string(i));
+                sum += std::get<double>(last->GetValue());
+            }
+            bench::DoNotOptimize(sum);
+        });
+#ifdef SPREADSHEET_PROFILING
+        result.metrics["compiled_in"] = 1;
+#else
+        result.metrics["compiled_in"] = 0;
+#endif
+    }
+}
@@ -0,0 +1,64 @@
+// Операции над блоками: копирование формул со смещением ссылок без
+// повторного разбора, перенос блока вместе со связями, сортировка строк
+// перестановкой ячеек и очистка блока с одним обновлением печатной области
+// и журнала на всю операцию.
+
+#include "bench.h"
+#include "sheet.h"
+#include "thread_pool.h"
+
+#include <string>
+
+namespace {
+    const int WIDTH = 10;
+
+    // Значения и в последнем столбце формула над ячейками своей строки
+    void Fill(Sheet& sheet, int rows) {
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col + 1 < WIDTH; ++col) {
+                sheet.SetCell({row, col}, std::to_string(row + col));
+            }
+            std::string number = std::to_string(row + 1);
+            sheet.SetCell({row, WIDTH - 1}, "=A" + number + "+I" + number);
+        }
+    }
+}
+
+BENCHMARK("range") {
+    int rows = static_cast<int>(context.Scaled(100'000));
+    Sheet sheet;
+    Fill(sheet, rows);
+    Range block{{0, 0}, {rows - 1, WIDTH - 1}};
+    double cells = static_cast<double>(rows) * WIDTH;
+
+    auto& copy = context.Measure("range/copy", 1, [&] {
+        sheet.CopyRange(block, {0, WIDTH});
+    });
+    copy.metrics["cells"] = cells;
+
+    context.Measure("range/move", 1, [&] {
+        sheet.MoveRange(block, {0, 2 * WIDTH});
+    });
+
+    context.Measure("range/evaluate", 1, [&] {
+        auto value = sheet.GetCell({rows - 1, 3 * WIDTH - 1})->GetValue();
+        bench::DoNotOptimize(std::holds_alternative<double>(value) ? std::get<double>(value) : 0);
+    });
+
+    // Ключ первого столбца перемешан так, что переставляются почти все строки
+    Range moved{{0, 2 * WIDTH}, {rows - 1, 3 * WIDTH - 1}};
+    for (int row = 0; row < rows; ++row) {
+        sheet.SetCell({row, 2 * WIDTH}, std::to_string((static_cast<long long>(row) * 48271 + 11) % rows));
+    }
+    context.Measure("range/sort", 1, [&] {
+        sheet.SortRange(moved, {{2 * WIDTH}});
+    });
+    context.Measure("range/sort_back_parallel", 1, [&] {
+        ThreadPool pool(4);
+        sheet.SortRange(moved, {{2 * WIDTH + 1}}, &pool);
+    });
+
+    context.Measure("range/clear", 1, [&] {
+        sheet.ClearRange({{0, 0}, {rows - 1, 3 * WIDTH - 1}});
+    });
+}
@@ -0,0 +1,74 @@
+// Пересчёт после правки, от которой зависят все формулы листа: целиком,
+// квантами по миллисекунде и в фоне. Для квантов замеряется их длительность,
+// для фонового пересчёта — задержка чтения, которое ждёт конца кванта.
+
+#include "bench.h"
+#include "sheet.h"
+#include "workload.h"
+
+#include <chrono>
+#include <random>
+#include <string>
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    double Seconds(Clock::duration duration) {
+        return std::chrono::duration<double>(duration).count();
+    }
+
+    void ReportHistogram(bench::Context& context, const std::string& name, const bench::LatencyHistogram& histogram) {
+        auto& result = context.Report(name);
+        result.metrics["count"] = static_cast<double>(histogram.GetCount());
+        result.metrics["p50_ns"] = histogram.GetPercentile(0.5) * 1e9;
+        result.metrics["p99_ns"] = histogram.GetPercentile(0.99) * 1e9;
+        result.metrics["max_ns"] = histogram.GetPercentile(1) * 1e9;
+    }
+}
+
+BENCHMARK("recalc") {
+    int rows = static_cast<int>(context.Scaled(200'000));
+    Sheet sheet;
+    sheet.SetCell({0, 2}, "1");
+    for (int row = 0; row < rows; ++row) {
+        std::string number = std::to_string(row + 1);
+        sheet.SetCell({row, 0}, number);
+        sheet.SetCell({row, 1}, "=A" + number + "*2+C1");
+    }
+    int edit = 0;
+    auto touch = [&] {
+        sheet.SetCell({0, 2}, std::to_string(++edit));
+    };
+
+    touch();
+    context.Measure("recalc/full", rows, [&] {
+        sheet.Recalculate();
+    });
+
+    touch();
+    bench::LatencyHistogram slices;
+    context.Measure("recalc/slices", rows, [&] {
+        RecalcStatus status = RecalcStatus::Paused;
+        while (status == RecalcStatus::Paused) {
+            auto start = Clock::now();
+            status = sheet.RecalculateSlice(std::chrono::milliseconds(1));
+            slices.Record(Seconds(Clock::now() - start));
+        }
+    });
+    ReportHistogram(context, "recalc/slices/latency", slices);
+
+    touch();
+    std::mt19937 random(context.GetSeed());
+    bench::LatencyHistogram reads;
+    context.Measure("recalc/async", rows, [&] {
+        auto done = sheet.RecalculateAsync(CancellationToken(), std::chrono::milliseconds(1));
+        while (done.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            auto start = Clock::now();
+            auto value = sheet.GetCell({static_cast<int>(random() % rows), 1})->GetValue();
+            reads.Record(Seconds(Clock::now() - start));
+            bench::DoNotOptimize(std::holds_alternative<double>(value) ? std::get<double>(value) : 0);
+        }
+        done.get();
+    });
+    ReportHistogram(context, "recalc/async/read_latency", reads);
+}
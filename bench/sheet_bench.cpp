@@ -0,0 +1,323 @@
+// Основные операции листа: запись ячеек, холодное и тёплое вычисление на
+// цепочках и графах с большим числом входов и выходов, проверка циклов,
+// очистка, печать и чтение окна значений.
+
+#include "bench.h"
+#include "common.h"
+#include "sheet.h"
+
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+    const int GRID_WIDTH = 100;
+
+    Position GridPosition(size_t index) {
+        return {static_cast<int>(index / GRID_WIDTH), static_cast<int>(index % GRID_WIDTH)};
+    }
+
+    std::string Ref(Position pos) {
+        return pos.ToString();
+    }
+
+    double GetNumber(const CellInterface* cell) {
+        auto value = cell->GetValue();
+        return std::holds_alternative<double>(value) ? std::get<double>(value) : 0;
+    }
+
+    // Цепочка A1 <- A2 <- ... <- A{length}: каждая ячейка прибавляет единицу
+    // к предыдущей. Глубина ограничена рекурсией вычисления формул.
+    void MakeChain(SheetInterface& sheet, int length) {
+        sheet.SetCell({0, 0}, "1");
+        for (int row = 1; row < length; ++row) {
+            sheet.SetCell({row, 0}, "=" + Ref({row - 1, 0}) + "+1");
+        }
+    }
+}
+
+BENCHMARK("set_cell") {
+    size_t count = context.Scaled(200'000);
+    std::mt19937 random(context.GetSeed());
+
+    std::vector<std::string> texts(count);
+    for (auto& text : texts) {
+        text = "value " + std::to_string(random() % 100'000);
+    }
+    auto text_sheet = CreateSheet();
+    context.Measure("set_cell/text", count, [&] {
+        for (size_t i = 0; i < count; ++i) {
+            text_sheet->SetCell(GridPosition(i), texts[i]);
+        }
+    });
+
+    std::vector<std::string> formulas(count);
+    for (size_t i = 0; i < count; ++i) {
+        auto pos = GridPosition(i);
+        formulas[i] = pos.row == 0
+                      ? "=" + std::to_string(random() % 100)
+                      : "=" + Ref({pos.row - 1, pos.col}) + "*2+" + Ref({pos.row - 1, int(random() % GRID_WIDTH)});
+    }
+    auto formula_sheet = CreateSheet();
+    context.Measure("set_cell/formula", count, [&] {
+        for (size_t i = 0; i < count; ++i) {
+            formula_sheet->SetCell(GridPosition(i), formulas[i]);
+        }
+    });
+}
+
+BENCHMARK("get_value/chain") {
+    const int length = 5000;
+    size_t rounds = context.Scaled(200);
+    auto sheet = CreateSheet();
+    MakeChain(*sheet, length);
+    const CellInterface* last = sheet->GetCell({length - 1, 0});
+
+    context.Measure("get_value/chain/cold", rounds, [&] {
+        double sum = 0;
+        for (size_t i = 0; i < rounds; ++i) {
+            sheet->SetCell({0, 0}, std::to_string(i));
+            sum += GetNumber(last);
+        }
+        bench::DoNotOptimize(sum);
+    }).metrics["chain_length"] = length;
+
+    size_t reads = context.Scaled(2'000'000);
+    context.Measure("get_value/chain/warm", reads, [&] {
+        double sum = 0;
+        for (size_t i = 0; i < reads; ++i) {
+            sum += GetNumber(last);
+        }
+        bench::DoNotOptimize(sum);
+    });
+}
+
+BENCHMARK("get_value/fan_in") {
+    const int inputs = 10'000;
+    size_t rounds = context.Scaled(200);
+    auto sheet = CreateSheet();
+    std::string sum = "=";
+    for (int row = 0; row < inputs; ++row) {
+        sheet->SetCell({row, 0}, std::to_string(row));
+        sum += (row ? "+" : "") + Ref({row, 0});
+    }
+    sheet->SetCell({0, 1}, sum);
+    const CellInterface* total = sheet->GetCell({0, 1});
+
+    context.Measure("get_value/fan_in/cold", rounds, [&] {
+        double result = 0;
+        for (size_t i = 0; i < rounds; ++i) {
+            sheet->SetCell({int(i % inputs), 0}, std::to_string(i));
+            result += GetNumber(total);
+        }
+        bench::DoNotOptimize(result);
+    }).metrics["inputs"] = inputs;
+
+    size_t reads = context.Scaled(2'000'000);
+    context.Measure("get_value/fan_in/warm", reads, [&] {
+        double result = 0;
+        for (size_t i = 0; i < reads; ++i) {
+            result += GetNumber(total);
+        }
+        bench::DoNotOptimize(result);
+    });
+}
+
+BENCHMARK("get_value/fan_out") {
+    const int outputs = 10'000;
+    size_t rounds = context.Scaled(100);
+    auto sheet = CreateSheet();
+    sheet->SetCell({0, 0}, "1");
+    std::vector<const CellInterface*> cells;
+    for (int row = 0; row < outputs; ++row) {
+        sheet->SetCell({row, 1}, "=A1*" + std::to_string(row));
+        cells.push_back(sheet->GetCell({row, 1}));
+    }
+
+    context.Measure("get_value/fan_out/cold", rounds * outputs, [&] {
+        double sum = 0;
+        for (size_t i = 0; i < rounds; ++i) {
+            sheet->SetCell({0, 0}, std::to_string(i));
+            for (const auto* cell : cells) {
+                sum += GetNumber(cell);
+            }
+        }
+        bench::DoNotOptimize(sum);
+    }).metrics["outputs"] = outputs;
+
+    context.Measure("get_value/fan_out/warm", rounds * outputs, [&] {
+        double sum = 0;
+        for (size_t i = 0; i < rounds; ++i) {
+            for (const auto* cell : cells) {
+                sum += GetNumber(cell);
+            }
+        }
+        bench::DoNotOptimize(sum);
+    });
+}
+
+BENCHMARK("cycle_check") {
+    const int length = 5000;
+    size_t rounds = context.Scaled(200);
+    auto sheet = CreateSheet();
+    MakeChain(*sheet, length);
+
+    // Каждая запись в начало цепочки обходит всех её потомков
+    context.Measure("cycle_check/acyclic", rounds, [&] {
+        for (size_t i = 0; i < rounds; ++i) {
+            sheet->SetCell({0, 0}, i % 2 ? "=B1" : "=C1");
+        }
+    }).metrics["dependents"] = length;
+
+    size_t caught = 0;
+    std::string cycle = "=" + Ref({length - 1, 0});
+    context.Measure("cycle_check/rejected", rounds, [&] {
+        for (size_t i = 0; i < rounds; ++i) {
+            try {
+                sheet->SetCell({0, 0}, cycle);
+            } catch (const CircularDependencyException&) {
+                ++caught;
+            }
+        }
+    });
+    bench::DoNotOptimize(caught);
+}
+
+BENCHMARK("clear_cell") {
+    size_t count = context.Scaled(200'000);
+    auto sheet = CreateSheet();
+    for (size_t i = 0; i < count; ++i) {
+        sheet->SetCell(GridPosition(i), "x");
+    }
+
+    // Очистка с конца каждый раз сужает печатную область
+    context.Measure("clear_cell/bottom_up", count, [&] {
+        for (size_t i = count; i-- > 0;) {
+            sheet->ClearCell(GridPosition(i));
+        }
+    });
+}
+
+BENCHMARK("print") {
+    size_t count = context.Scaled(200'000);
+    std::mt19937 random(context.GetSeed());
+    auto sheet = CreateSheet();
+    for (size_t i = 0; i < count; ++i) {
+        auto pos = GridPosition(i);
+        if (pos.row > 0 && random() % 2) {
+            sheet->SetCell(pos, "=" + Ref({pos.row - 1, pos.col}) + "+1");
+        } else {
+            sheet->SetCell(pos, std::to_string(random() % 1000));
+        }
+    }
+
+    std::ostringstream values;
+    auto& values_result = context.Measure("print/values", count, [&] {
+        sheet->PrintValues(values);
+    });
+    values_result.metrics["bytes"] = values.str().size();
+
+    std::ostringstream texts;
+    auto& texts_result = context.Measure("print/texts", count, [&] {
+        sheet->PrintTexts(texts);
+    });
+    texts_result.metrics["bytes"] = texts.str().size();
+}
+
+BENCHMARK("viewport") {
+    // Окно интерфейса 50x200 над листом, в котором между прокрутками
+    // меняются случайные ячейки
+    const Size window{50, 200};
+    const int rows = 2000;
+    size_t rounds = context.Scaled(200);
+    std::mt19937 random(context.GetSeed());
+    Sheet sheet;
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < window.cols; ++col) {
+            if (row > 0 && random() % 2) {
+                sheet.SetCell({row, col}, "=" + Ref({row - 1, col}) + "+1");
+            } else {
+                sheet.SetCell({row, col}, std::to_string(random() % 1000));
+            }
+        }
+    }
+    auto edit = [&] {
+        for (int i = 0; i < 100; ++i) {
+            sheet.SetCell({int(random() % rows), int(random() % window.cols)}, std::to_string(random() % 1000));
+        }
+    };
+
+    context.Measure("viewport/get_values", rounds, [&] {
+        double sum = 0;
+        for (size_t i = 0; i < rounds; ++i) {
+            edit();
+            Position top_left{int(random() % (rows - window.rows)), 0};
+            sheet.GetValues(top_left, window, [&](const ValuesWindow& values) {
+                sum += values.values.size();
+            });
+        }
+        bench::DoNotOptimize(sum);
+    });
+
+    context.Measure("viewport/print_values", rounds, [&] {
+        for (size_t i = 0; i < rounds; ++i) {
+            edit();
+            std::ostringstream out;
+            sheet.PrintValues(out);
+            bench::DoNotOptimize(out.tellp());
+        }
+    });
+}
+
+BENCHMARK("sparse_height") {
+    // Одинаковое число ячеек, разбросанных по листам высотой от 16K до
+    // полного миллиона строк: время записи, чтения окна и расход памяти не
+    // должны зависеть от высоты, печать — только от объёма вывода
+    size_t count = context.Scaled(20'000);
+    const int columns = 16;
+    for (int height : {16'384, 131'072, Position::MAX_ROWS}) {
+        std::string suffix = "/" + std::to_string(height);
+        std::mt19937 random(context.GetSeed());
+        std::vector<Position> positions(count);
+        for (auto& pos : positions) {
+            pos = {int(random() % height), int(random() % columns)};
+        }
+
+        Sheet sheet;
+        context.Measure("sparse_height/set_cell" + suffix, count, [&] {
+            for (size_t i = 0; i < count; ++i) {
+                // Совпавшие позиции изредка замыкают цикл; такие правки отклоняются
+                try {
+                    sheet.SetCell(positions[i], i % 2 ? std::to_string(i) : "=" + Ref(positions[i / 2]) + "+1");
+                } catch (const CircularDependencyException&) {
+                }
+            }
+        });
+
+        const Size window{50, columns};
+        size_t rounds = context.Scaled(2'000);
+        context.Measure("sparse_height/get_values" + suffix, rounds, [&] {
+            double sum = 0;
+            for (size_t i = 0; i < rounds; ++i) {
+                Position top_left{int(random() % (height - window.rows)), 0};
+                sheet.GetValues(top_left, window, [&](const ValuesWindow& values) {
+                    sum += values.values.size();
+                });
+            }
+            bench::DoNotOptimize(sum);
+        });
+
+        std::ostringstream texts;
+        auto& print_result = context.Measure("sparse_height/print_texts" + suffix, 1, [&] {
+            sheet.PrintTexts(texts);
+        });
+        print_result.metrics["bytes"] = texts.str().size();
+
+        auto usage = sheet.GetMemoryUsage();
+        auto& memory = context.Report("sparse_height/memory" + suffix);
+        memory.metrics["cells"] = count;
+        memory.metrics["grid_bytes"] = usage.grid;
+        memory.metrics["bytes_per_cell"] = double(usage.Total()) / count;
+    }
+}
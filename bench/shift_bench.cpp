@@ -0,0 +1,52 @@
+// Вставка и удаление строк в начале листа из миллиона ячеек: ячейки
+// переносятся вместе со связями, а ссылки формул переписываются на месте,
+// без повторного разбора.
+
+#include "bench.h"
+#include "sheet.h"
+
+#include <string>
+
+namespace {
+    const int WIDTH = 10;
+
+    // Значения и в последнем столбце формула над ячейками своей строки
+    void Fill(Sheet& sheet, int rows) {
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col + 1 < WIDTH; ++col) {
+                sheet.SetCell({row, col}, std::to_string(row + col));
+            }
+            std::string number = std::to_string(row + 1);
+            sheet.SetCell({row, WIDTH - 1}, "=A" + number + "+I" + number);
+        }
+    }
+}
+
+BENCHMARK("shift") {
+    int rows = static_cast<int>(context.Scaled(100'000));
+    Sheet sheet;
+    Fill(sheet, rows);
+
+    // Тысяча строк кратна плиткам: плитки переносятся целиком
+    auto& block = context.Measure("shift/insert_1k_rows", 1, [&] {
+        sheet.InsertRows(0, 1000);
+    });
+    block.metrics["cells"] = static_cast<double>(rows) * WIDTH;
+
+    // По одной строке: ячейки раскладываются по плиткам заново
+    size_t single = context.Scaled(10);
+    context.Measure("shift/insert_row", single, [&] {
+        for (size_t i = 0; i < single; ++i) {
+            sheet.InsertRows(0);
+        }
+    });
+
+    context.Measure("shift/delete_1k_rows", 1, [&] {
+        sheet.DeleteRows(0, 1000);
+    });
+
+    context.Measure("shift/evaluate", 1, [&] {
+        auto value = sheet.GetCell({static_cast<int>(single) + rows - 1, WIDTH - 1})->GetValue();
+        bench::DoNotOptimize(std::holds_alternative<double>(value) ? std::get<double>(value) : 0);
+    });
+}
@@ -0,0 +1,68 @@
+// Лист больше бюджета памяти: пропускная способность чтения рабочего
+// набора, когда остальные плитки вытеснены на диск.
+
+#include "bench.h"
+#include "sheet.h"
+
+#include <filesystem>
+#include <random>
+#include <string>
+
+namespace {
+    const int WIDTH = 32;
+
+    void Fill(Sheet& sheet, int rows, uint32_t seed) {
+        std::mt19937 random(seed);
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < WIDTH; ++col) {
+                sheet.SetCell({row, col}, "record " + std::to_string(random() % 1'000'000));
+            }
+        }
+        // Цепочка формул связана с графом и всегда остаётся в памяти
+        sheet.SetCell({0, WIDTH}, "1");
+        for (int row = 8; row < rows; row += 8) {
+            sheet.SetCell({row, WIDTH}, "=" + Position{row - 8, WIDTH}.ToString() + "+1");
+        }
+    }
+}
+
+BENCHMARK("spill/working_set") {
+    int rows = static_cast<int>(context.Scaled(20'000));
+    size_t reads = context.Scaled(500'000);
+    // Девять чтений из десяти приходятся на горячую десятую часть строк
+    int hot_rows = rows / 10;
+
+    Sheet reference;
+    Fill(reference, rows, context.GetSeed());
+    size_t total = reference.GetMemoryUsage().Total();
+
+    for (int over_budget : {1, 2, 10}) {
+        std::string suffix = "/x" + std::to_string(over_budget);
+        Sheet sheet;
+        Sheet* target = &reference;
+        if (over_budget > 1) {
+            auto path = std::filesystem::temp_directory_path() / ("spreadsheet_spill_bench" + suffix.substr(1));
+            sheet.EnableSpilling(path.string(), total / over_budget);
+            Fill(sheet, rows, context.GetSeed());
+            target = &sheet;
+        }
+
+        std::mt19937 random(context.GetSeed());
+        auto& result = context.Measure("spill/working_set" + suffix, reads, [&] {
+            size_t length = 0;
+            for (size_t i = 0; i < reads; ++i) {
+                int row = random() % 10 ? random() % hot_rows : random() % rows;
+                if (const auto* cell = target->GetCell({row, static_cast<int>(random() % WIDTH)})) {
+                    length += cell->GetText().size();
+                }
+            }
+            bench::DoNotOptimize(static_cast<double>(length));
+        });
+        auto stats = target->GetSpillStats();
+        result.metrics["budget_bytes"] = over_budget > 1 ? total / over_budget : total;
+        result.metrics["resident_bytes"] = target->GetMemoryUsage().Total();
+        result.metrics["loads"] = stats.loads;
+        result.metrics["evictions"] = stats.evictions;
+        result.metrics["file_bytes"] = stats.file_bytes;
+    }
+}
@@ -0,0 +1,59 @@
+// Стресс-прогоны на синтетических нагрузках: построение таблицы заданной
+// формы и проигрывание смешанной трассы с распределением задержек по видам
+// операций (p50/p99/p999).
+
+#include "bench.h"
+#include "workload.h"
+
+#include <algorithm>
+#include <string>
+
+namespace {
+    void RunStress(bench::Context& context, const std::string& name,
+                   const bench::Trace& layout, const bench::Trace& edits) {
+        auto sheet = CreateSheet();
+        bench::ReplayStats build;
+        context.Measure(name + "/build", layout.size(), [&] {
+            bench::Replay(*sheet, layout, build);
+        });
+        bench::ReportLatencies(context, name + "/build", build);
+
+        bench::ReplayStats replay;
+        context.Measure(name + "/replay", edits.size(), [&] {
+            bench::Replay(*sheet, edits, replay);
+        });
+        bench::ReportLatencies(context, name + "/replay", replay);
+    }
+}
+
+BENCHMARK("stress/running_totals") {
+    bench::WorkloadGenerator generator(context.GetSeed());
+    // Нарастающий итог во всю высоту листа: правка сбрасывает хвост цепочки,
+    // а чтение вычисляет её от начала до читаемой строки
+    int rows = static_cast<int>(std::min<size_t>(context.Scaled(Position::MAX_ROWS), Position::MAX_ROWS));
+    auto layout = generator.RunningTotals(rows, 1);
+    auto edits = generator.MixedEdits(layout, context.Scaled(200), 0.5);
+    RunStress(context, "stress/running_totals", layout, edits);
+}
+
+BENCHMARK("stress/fan_in") {
+    bench::WorkloadGenerator generator(context.GetSeed());
+    auto layout = generator.FanIn(static_cast<int>(context.Scaled(100'000)), 100);
+    auto edits = generator.MixedEdits(layout, context.Scaled(100'000), 0.5);
+    RunStress(context, "stress/fan_in", layout, edits);
+}
+
+BENCHMARK("stress/random_dag") {
+    bench::WorkloadGenerator generator(context.GetSeed());
+    auto layout = generator.RandomDag(static_cast<int>(context.Scaled(200'000)), 4);
+    auto edits = generator.MixedEdits(layout, context.Scaled(50'000), 0.5);
+    RunStress(context, "stress/random_dag", layout, edits);
+}
+
+BENCHMARK("stress/near_cyclic") {
+    bench::WorkloadGenerator generator(context.GetSeed());
+    const int length = 2000;
+    auto chain = generator.Chain(length);
+    auto storm = generator.NearCyclicStorm(length, context.Scaled(30'000));
+    RunStress(context, "stress/near_cyclic", chain, storm);
+}
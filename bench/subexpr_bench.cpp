@@ -0,0 +1,55 @@
+// Пересчёт листа, формулы которого повторяют одно подвыражение над общими
+// входами: с разделением подвыражение вычисляется один раз за пересчёт, а
+// каждая формула досчитывает только свою часть. Для сравнения — тот же
+// лист без разделения и формулы со своими входами в каждой строке, где
+// разделять нечего.
+
+#include "bench.h"
+#include "sheet.h"
+
+#include <string>
+
+namespace {
+    // Длинное выражение над входами строки input
+    std::string Growth(const std::string& input) {
+        std::string current = "C" + input;
+        std::string previous = "D" + input;
+        return "((" + current + "-" + previous + ")/" + previous + "*100+(" + current + "+" + previous + ")/2)";
+    }
+
+    void Fill(Sheet& sheet, int rows, bool shared) {
+        for (int row = 0; row < rows; ++row) {
+            std::string number = std::to_string(row + 1);
+            sheet.SetCell({row, 2}, std::to_string(row + 2));
+            sheet.SetCell({row, 3}, std::to_string(row + 1));
+            sheet.SetCell({row, 0}, number);
+            sheet.SetCell({row, 1}, "=" + Growth(shared ? "1" : number) + "*A" + number);
+        }
+    }
+
+    void MeasureRecalc(bench::Context& context, const std::string& name, bool sharing, bool shared) {
+        int rows = static_cast<int>(context.Scaled(100'000));
+        Sheet sheet;
+        sheet.EnableSubexpressionSharing(sharing);
+        Fill(sheet, rows, shared);
+        auto& result = context.Measure(name, rows, [&] {
+            sheet.Recalculate();
+        });
+        auto stats = sheet.GetSubexpressionStats();
+        auto usage = sheet.GetMemoryUsage();
+        result.metrics["nodes"] = static_cast<double>(stats.nodes);
+        if (stats.hits + stats.evaluations > 0) {
+            result.metrics["hit_rate"] = static_cast<double>(stats.hits)
+                                         / static_cast<double>(stats.hits + stats.evaluations);
+        }
+        result.metrics["subexpression_bytes"] = static_cast<double>(usage.subexpressions);
+        result.metrics["total_bytes"] = static_cast<double>(usage.Total());
+    }
+}
+
+BENCHMARK("subexpr") {
+    MeasureRecalc(context, "subexpr/recalc_shared", true, true);
+    MeasureRecalc(context, "subexpr/recalc_shared_off", false, true);
+    MeasureRecalc(context, "subexpr/recalc_unique", true, false);
+    MeasureRecalc(context, "subexpr/recalc_unique_off", false, false);
+}
@@ -0,0 +1,80 @@
+// Память текстовых ячеек на категориальных данных: сколько заняли бы
+// отдельные копии строк и сколько занимает пул строк листа.
+
+#include "bench.h"
+#include "sheet.h"
+
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+    size_t GetResidentBytes() {
+        std::ifstream statm("/proc/self/statm");
+        size_t pages = 0;
+        size_t resident = 0;
+        statm >> pages >> resident;
+        return resident * 4096;
+    }
+
+    // Память отдельной копии строки в ячейке: объект строки и, если текст не
+    // помещается во внутренний буфер, выделение в куче
+    size_t GetStringBytes(size_t length) {
+        const size_t sso_capacity = std::string().capacity();
+        return sizeof(std::string) + (length > sso_capacity ? length + 1 : 0);
+    }
+
+    std::vector<std::string> MakeLabels(const std::string& prefix, int count) {
+        std::vector<std::string> labels;
+        for (int i = 0; i < count; ++i) {
+            labels.push_back(prefix + std::to_string(i));
+        }
+        return labels;
+    }
+}
+
+BENCHMARK("text_pool") {
+    // При --scale=10 получается 10M ячеек
+    size_t count = context.Scaled(1'000'000);
+
+    const std::vector<std::vector<std::string>> columns = {
+            {"USD", "EUR", "GBP", "JPY", "CHF"},
+            MakeLabels("Region/North-West district #", 40),
+            MakeLabels("Product category ", 300),
+            {"open", "closed", "pending", "cancelled"},
+    };
+    // 10M ячеек помещаются в 10000 строк
+    const int width = 1000;
+
+    std::mt19937 random(context.GetSeed());
+    std::vector<const std::string*> labels(count);
+    size_t copies_bytes = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const auto& column = columns[i % width % columns.size()];
+        labels[i] = &column[random() % column.size()];
+        copies_bytes += GetStringBytes(labels[i]->size());
+    }
+
+    size_t rss_before = GetResidentBytes();
+    Sheet sheet;
+    auto& result = context.Measure("text_pool/set_cell", count, [&] {
+        for (size_t i = 0; i < count; ++i) {
+            sheet.SetCell({static_cast<int>(i / width), static_cast<int>(i % width)}, *labels[i]);
+        }
+    });
+    size_t rss_after = GetResidentBytes();
+
+    auto stats = sheet.GetStringPool().GetStats();
+    size_t pooled_bytes = stats.references * sizeof(PooledString) + stats.stored_bytes;
+    // запись пула и узел индекса на каждую уникальную строку
+    pooled_bytes += stats.unique_strings * (sizeof(std::string) + sizeof(uint32_t) + 4 * sizeof(void*));
+
+    result.metrics["unique_texts"] = stats.unique_strings;
+    result.metrics["text_bytes_referenced"] = stats.referenced_bytes;
+    result.metrics["text_bytes_stored"] = stats.stored_bytes;
+    result.metrics["separate_strings_bytes"] = copies_bytes;
+    result.metrics["string_pool_bytes"] = pooled_bytes;
+    result.metrics["accounted_bytes"] = sheet.GetMemoryUsage().Total();
+    result.metrics["rss_growth_bytes"] = static_cast<double>(rss_after) - static_cast<double>(rss_before);
+}
@@ -0,0 +1,53 @@
+// Пересчёт книги из независимых листов одним и несколькими потоками.
+
+#include "bench.h"
+#include "workbook.h"
+
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+BENCHMARK("workbook/recalculate") {
+    const int sheet_count = 16;
+    const int width = 100;
+    size_t cells = context.Scaled(20'000);
+    size_t rounds = context.Scaled(5);
+
+    std::vector<size_t> thread_counts{1};
+    if (std::thread::hardware_concurrency() > 1) {
+        thread_counts.push_back(std::thread::hardware_concurrency());
+    }
+    for (size_t threads : thread_counts) {
+        std::mt19937 random(context.GetSeed());
+        Workbook workbook(threads);
+        std::vector<Sheet*> sheets;
+        for (int i = 0; i < sheet_count; ++i) {
+            auto& sheet = workbook.AddSheet("Sheet" + std::to_string(i));
+            for (size_t j = 0; j < cells; ++j) {
+                Position pos{static_cast<int>(j / width), static_cast<int>(j % width)};
+                if (pos.row == 0) {
+                    sheet.SetCell(pos, std::to_string(random() % 100));
+                } else {
+                    Position lhs{pos.row - 1, pos.col};
+                    Position rhs{pos.row - 1, static_cast<int>(random() % width)};
+                    sheet.SetCell(pos, "=" + lhs.ToString() + "*0.5+" + rhs.ToString());
+                }
+            }
+            sheets.push_back(&sheet);
+        }
+
+        auto& result = context.Measure("workbook/recalculate/threads_" + std::to_string(threads),
+                                       rounds * sheet_count * cells, [&] {
+            for (size_t round = 0; round < rounds; ++round) {
+                for (Sheet* sheet : sheets) {
+                    for (int col = 0; col < width; ++col) {
+                        sheet->SetCell({0, col}, std::to_string(round + col));
+                    }
+                }
+                workbook.Recalculate();
+            }
+        });
+        result.metrics["threads"] = threads;
+    }
+}
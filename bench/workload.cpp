@@ -0,0 +1,213 @@
+#include "workload.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace bench {
+
+    namespace {
+        // Ширина области, в которую раскладываются последовательные ячейки
+        const int LAYOUT_WIDTH = 1000;
+
+        Position At(size_t index) {
+            return {static_cast<int>(index / LAYOUT_WIDTH), static_cast<int>(index % LAYOUT_WIDTH)};
+        }
+
+        size_t RowAligned(size_t index) {
+            return (index + LAYOUT_WIDTH - 1) / LAYOUT_WIDTH * LAYOUT_WIDTH;
+        }
+
+        Operation Set(Position pos, std::string text) {
+            return {Operation::Type::Set, pos, std::move(text)};
+        }
+
+        // Звено цепочки: ячейка прибавляет единицу к ячейке над ней
+        std::string ChainLink(int row) {
+            return "=" + Position{row - 1, 0}.ToString() + "+1";
+        }
+
+        // Формула, суммирующая ячейки с индексами [first, last)
+        std::string SumOf(size_t first, size_t last) {
+            std::string formula = "=";
+            for (size_t i = first; i < last; ++i) {
+                if (i > first) {
+                    formula += '+';
+                }
+                formula += At(i).ToString();
+            }
+            return formula;
+        }
+    }  // namespace
+
+    Trace WorkloadGenerator::RunningTotals(int rows, int columns) {
+        Trace trace;
+        trace.reserve(static_cast<size_t>(rows) * columns);
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < columns; ++col) {
+                auto amount = std::to_string(Uniform(1000));
+                trace.push_back(Set({row, col}, row == 0
+                                                ? amount
+                                                : "=" + Position{row - 1, col}.ToString() + "+" + amount));
+            }
+        }
+        return trace;
+    }
+
+    Trace WorkloadGenerator::FanIn(int inputs, int group) {
+        Trace trace;
+        size_t leaves = inputs;
+        for (size_t i = 0; i < leaves; ++i) {
+            trace.push_back(Set(At(i), std::to_string(Uniform(1000))));
+        }
+        size_t first_partial = RowAligned(leaves);
+        size_t partials = 0;
+        for (size_t first = 0; first < leaves; first += group) {
+            trace.push_back(Set(At(first_partial + partials++), SumOf(first, std::min(leaves, first + group))));
+        }
+        size_t root = RowAligned(first_partial + partials);
+        trace.push_back(Set(At(root), SumOf(first_partial, first_partial + partials)));
+        return trace;
+    }
+
+    Trace WorkloadGenerator::RandomDag(int cells, int max_inputs) {
+        Trace trace;
+        trace.reserve(cells);
+        for (size_t i = 0; i < static_cast<size_t>(cells); ++i) {
+            if (i < static_cast<size_t>(max_inputs) || Uniform(4) == 0) {
+                trace.push_back(Set(At(i), std::to_string(Uniform(1000))));
+                continue;
+            }
+            std::string formula = "=";
+            size_t inputs = 1 + Uniform(max_inputs);
+            for (size_t k = 0; k < inputs; ++k) {
+                if (k > 0) {
+                    formula += k % 2 ? '+' : '*';
+                }
+                formula += At(Uniform(i)).ToString();
+            }
+            trace.push_back(Set(At(i), std::move(formula)));
+        }
+        return trace;
+    }
+
+    Trace WorkloadGenerator::MixedEdits(const Trace& layout, size_t operations, double read_share) {
+        std::vector<const Operation*> cells;
+        std::vector<Position> formulas;
+        for (const auto& op : layout) {
+            if (op.type != Operation::Type::Set) {
+                continue;
+            }
+            cells.push_back(&op);
+            if (!op.text.empty() && op.text[0] == FORMULA_SIGN) {
+                formulas.push_back(op.pos);
+            }
+        }
+
+        Trace trace;
+        if (cells.empty()) {
+            return trace;
+        }
+        trace.reserve(operations);
+        const size_t resolution = 1'000'000;
+        auto read_threshold = static_cast<size_t>(read_share * resolution);
+        while (trace.size() < operations) {
+            if (!formulas.empty() && Uniform(resolution) < read_threshold) {
+                trace.push_back({Operation::Type::Read, formulas[Uniform(formulas.size())], {}});
+                continue;
+            }
+            // Текущие рёбра графа всегда подмножество рёбер исходной раскладки
+            const Operation& cell = *cells[Uniform(cells.size())];
+            trace.push_back(Set(cell.pos, Uniform(2) ? cell.text : std::to_string(Uniform(1000))));
+        }
+        return trace;
+    }
+
+    Trace WorkloadGenerator::Chain(int length) {
+        Trace trace;
+        trace.reserve(length);
+        trace.push_back(Set({0, 0}, "1"));
+        for (int row = 1; row < length; ++row) {
+            trace.push_back(Set({row, 0}, ChainLink(row)));
+        }
+        return trace;
+    }
+
+    Trace WorkloadGenerator::NearCyclicStorm(int length, size_t operations) {
+        Trace trace;
+        trace.reserve(operations);
+        Position last{length - 1, 0};
+        while (trace.size() < operations) {
+            int from = static_cast<int>(Uniform(length - 1));
+            int to = from + 1 + static_cast<int>(Uniform(length - from - 1));
+            // Обратная ссылка вниз по целой цепочке замыкает цикл
+            trace.push_back(Set({from, 0}, "=" + Position{to, 0}.ToString() + "+1"));
+            // Правка, сохраняющая цепочку, сбрасывает кэш её хвоста
+            trace.push_back(Set({to, 0}, ChainLink(to)));
+            trace.push_back({Operation::Type::Read, last, {}});
+        }
+        trace.resize(operations);
+        return trace;
+    }
+
+    double LatencyHistogram::GetPercentile(double q) const {
+        if (samples_.empty()) {
+            return 0;
+        }
+        if (!sorted_) {
+            std::sort(samples_.begin(), samples_.end());
+            sorted_ = true;
+        }
+        auto rank = static_cast<size_t>(std::ceil(q * samples_.size()));
+        return samples_[std::clamp<size_t>(rank, 1, samples_.size()) - 1];
+    }
+
+    void Replay(SheetInterface& sheet, const Trace& trace, ReplayStats& stats) {
+        auto& set = stats.latencies["set"];
+        auto& clear = stats.latencies["clear"];
+        auto& read = stats.latencies["read"];
+        auto& rejected = stats.latencies["rejected"];
+        for (const auto& op : trace) {
+            auto start = std::chrono::steady_clock::now();
+            LatencyHistogram* histogram = nullptr;
+            switch (op.type) {
+                case Operation::Type::Set:
+                    try {
+                        sheet.SetCell(op.pos, op.text);
+                        histogram = &set;
+                    } catch (const CircularDependencyException&) {
+                        histogram = &rejected;
+                    }
+                    break;
+                case Operation::Type::Clear:
+                    sheet.ClearCell(op.pos);
+                    histogram = &clear;
+                    break;
+                case Operation::Type::Read:
+                    if (const auto* cell = sheet.GetCell(op.pos)) {
+                        auto value = cell->GetValue();
+                        DoNotOptimize(std::holds_alternative<double>(value) ? std::get<double>(value) : 0);
+                    }
+                    histogram = &read;
+                    break;
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            histogram->Record(elapsed.count());
+        }
+    }
+
+    void ReportLatencies(Context& context, const std::string& name, const ReplayStats& stats) {
+        for (const auto& [kind, histogram] : stats.latencies) {
+            if (histogram.GetCount() == 0) {
+                continue;
+            }
+            auto& result = context.Report(name + "/" + kind);
+            result.metrics["count"] = histogram.GetCount();
+            result.metrics["p50_ns"] = histogram.GetPercentile(0.5) * 1e9;
+            result.metrics["p99_ns"] = histogram.GetPercentile(0.99) * 1e9;
+            result.metrics["p999_ns"] = histogram.GetPercentile(0.999) * 1e9;
+            result.metrics["max_ns"] = histogram.GetPercentile(1) * 1e9;
+        }
+    }
+
+}  // namespace bench
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "bench.h"
+#include "common.h"
+
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+// Синтетические нагрузки для стресс-прогонов: генератор строит трассы
+// операций над SheetInterface для типичных форм таблиц, а Replay
+// проигрывает их и собирает распределение задержек по видам операций.
+// При одинаковом зерне трассы совпадают на любой платформе.
+namespace bench {
+
+    struct Operation {
+        enum class Type {
+            Set,
+            Clear,
+            Read,
+        };
+
+        Type type;
+        Position pos;
+        std::string text;
+    };
+
+    using Trace = std::vector<Operation>;
+
+    class WorkloadGenerator {
+    public:
+        explicit WorkloadGenerator(uint32_t seed)
+                : random_(seed) {
+        }
+
+        // Нарастающие итоги: в каждом из columns столбцов ячейка строки r
+        // прибавляет число к итогу строки r - 1
+        Trace RunningTotals(int rows, int columns);
+
+        // Одна ячейка, зависящая от inputs входов через промежуточные суммы
+        // по group входов в каждой
+        Trace FanIn(int inputs, int group);
+
+        // Случайный ациклический граф: каждая формула ссылается на 1..max_inputs
+        // ранее заданных ячеек
+        Trace RandomDag(int cells, int max_inputs);
+
+        // Смешанная трасса по области, построенной трассой layout: чтение
+        // случайной формулы с долей read_share, иначе правка случайной ячейки —
+        // замена числом или возврат исходного текста. Граф остаётся ацикличным.
+        Trace MixedEdits(const Trace& layout, size_t operations, double read_share);
+
+        // Цепочка A1 <- A2 <- ... в первом столбце: каждая ячейка прибавляет
+        // единицу к предыдущей
+        Trace Chain(int length);
+
+        // Поток правок цепочки Chain(length): каждая попытка замкнуть цикл
+        // отклоняется, следующая за ней правка сохраняет цепочку и сбрасывает
+        // кэш хвоста, после чего читается конец цепочки
+        Trace NearCyclicStorm(int length, size_t operations);
+
+    private:
+        size_t Uniform(size_t bound) {
+            return random_() % bound;
+        }
+
+        std::mt19937 random_;
+    };
+
+    // Задержки операций одного вида
+    class LatencyHistogram {
+    public:
+        void Record(double seconds) {
+            samples_.push_back(seconds);
+            sorted_ = false;
+        }
+
+        size_t GetCount() const {
+            return samples_.size();
+        }
+
+        // Перцентиль по ближайшему рангу, q из (0, 1]
+        double GetPercentile(double q) const;
+
+    private:
+        mutable std::vector<double> samples_;
+        mutable bool sorted_ = false;
+    };
+
+    struct ReplayStats {
+        // Ключи: set, clear, read и rejected — правки, отклонённые листом
+        std::map<std::string, LatencyHistogram> latencies;
+    };
+
+    // Проигрывает трассу, замеряя каждую операцию
+    void Replay(SheetInterface& sheet, const Trace& trace, ReplayStats& stats);
+
+    // Добавляет для каждого вида операций результат name/вид с метриками
+    // count, p50_ns, p99_ns, p999_ns и max_ns
+    void ReportLatencies(Context& context, const std::string& name, const ReplayStats& stats);
+
+}  // namespace bench
@@ -1,156 +1,379 @@
 #include "cell.h"
 #include "sheet.h"
+#include "workbook.h"
+#include "trace.h"
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <iostream>
 #include <string>
 #include <optional>
 #include <stack>
 
-class Cell::Impl {
-public:
-    virtual ~Impl() = default;
+struct Cell::FormulaData {
+    // Каноническое выражение печатается один раз, при разборе. Повторный
+    // текст берётся из кэша разбора листа.
+    FormulaData(std::string expression, Sheet& sheet)
+            : FormulaData(sheet.GetFormulaCache().Parse(std::move(expression)), sheet) {
+    }
 
-    virtual Value GetValue() const = 0;
+    FormulaData(FormulaCache::Parsed parsed, Sheet& sheet)
+            : FormulaData(std::move(parsed.formula), std::move(parsed.expression), sheet) {
+    }
 
-    virtual std::string GetText() const = 0;
+    FormulaData(std::unique_ptr<FormulaInterface>&& parsed, Sheet& sheet)
+            : FormulaData(std::move(parsed), parsed->GetExpression(), sheet) {
+    }
 
-    virtual std::vector<Position> GetReferencedCells() const {
-        return {};
+    // Подвыражения формулы связываются с общими узлами листа, если он их
+    // разделяет
+    FormulaData(std::unique_ptr<FormulaInterface>&& parsed, std::string expression, Sheet& sheet)
+            : formula(std::move(parsed)),
+              text(FORMULA_SIGN + expression),
+              memory(sheet.GetMemoryCounter()) {
+        if (auto* subexpressions = sheet.GetSubexpressions()) {
+            formula->ShareSubexpressions(subexpressions);
+        }
+        Account(&MemoryCounter::Add);
     }
 
-    virtual bool IsCacheValid() const {
-        return true;
+    ~FormulaData() {
+        Account(&MemoryCounter::Remove);
     }
 
-    virtual void InvalidateCache() {}
+    void Account(void (MemoryCounter::*change)(MemoryCategory, size_t)) const {
+        auto usage = formula->GetMemoryUsage();
+        (memory.*change)(MemoryCategory::Formulas, sizeof(FormulaData) + usage.object);
+        (memory.*change)(MemoryCategory::AstNodes, usage.ast_nodes);
+        (memory.*change)(MemoryCategory::ReferenceLists, usage.cell_list);
+        (memory.*change)(MemoryCategory::Text, StringHeapBytes(text));
+    }
+
+    std::unique_ptr<FormulaInterface> formula;
+    std::string text;
+    mutable std::optional<FormulaInterface::Value> cachedValue;
+    MemoryCounter& memory;
+#ifdef SPREADSHEET_TRACING
+    // Правка, последней сбросившая кэш значения
+    uint64_t invalidatedBy = 0;
+#endif
 };
 
-class Cell::EmptyImpl : public Impl {
-public:
-    Value GetValue() const override {
-        return {};
+// Реализуйте следующие методы
+Cell::Cell(Sheet& sheet, Position pos)
+        : sheet_(sheet), pos_(pos),
+          inRefs_(sheet.GetDependencyAllocator()),
+          outRefs_(sheet.GetDependencyAllocator()) {
+    sheet_.GetMemoryCounter().Add(MemoryCategory::Cells, sizeof(Cell));
+}
+
+Cell::~Cell() {
+    sheet_.GetMemoryCounter().Remove(MemoryCategory::Cells, sizeof(Cell));
+}
+
+Cell::Content Cell::MakeContent(std::string text) {
+    if (text.empty()) {
+        return std::monostate{};
+    }
+    if (text[0] == FORMULA_SIGN && text.size() > 1 && !std::isspace(text[1])) {
+        return std::make_unique<FormulaData>(text.substr(1), sheet_);
     }
+    return PooledString(sheet_.GetStringPool(), text);
+}
 
-    std::string GetText() const override {
-        return {};
+void Cell::Set(std::string text) {
+    SetContent(MakeContent(std::move(text)), /* invalidate = */ true);
+}
+
+void Cell::Set(std::unique_ptr<FormulaInterface> formula) {
+    SetContent(std::make_unique<FormulaData>(std::move(formula), sheet_), /* invalidate = */ true);
+}
+
+void Cell::SetContent(Content newContent, bool invalidate) {
+    std::vector<Position> newRefs;
+    std::vector<ExternalCell> newExternalRefs;
+    std::vector<RangeRef> newRanges;
+    if (const auto* formula = std::get_if<std::unique_ptr<FormulaData>>(&newContent)) {
+        newRefs = (*formula)->formula->GetReferencedCells();
+        newExternalRefs = (*formula)->formula->GetExternalCells();
+        newRanges = (*formula)->formula->GetReferencedRanges();
     }
-};
 
-class Cell::TextImpl : public Impl {
-public:
+    if (IsCircularDependency(newRefs, newExternalRefs, newRanges)) {
+        throw CircularDependencyException(
+                "Setting this formula would introduce circular dependency!");
+    }
 
-    TextImpl(std::string value) : text_(std::move(value)) {}
+    auto oldRefs = GetReferencedCells();
+    auto oldExternalRefs = GetExternalCells();
+    auto oldRanges = GetReferencedRanges();
+    sheet_.UpdateLookupIndexes(*this, /* inserted = */ false);
+    content_ = std::move(newContent);
+    sheet_.UpdateLookupIndexes(*this, /* inserted = */ true);
 
-    Value GetValue() const override {
-        if (text_[0] == ESCAPE_SIGN) {
-            return text_.substr(1);
-        }
-        return text_;
+    UpdateRefs(oldRefs, oldExternalRefs, oldRanges);
+    if (!invalidate) {
+        return;
     }
 
-    std::string GetText() const override {
-        return text_;
+#ifdef SPREADSHEET_TRACING
+    trace::Scope invalidation("Invalidate", pos_);
+#endif
+    size_t invalidated = InvalidateCacheRecursive(true);
+#ifdef SPREADSHEET_TRACING
+    invalidation.SetCount(static_cast<int64_t>(invalidated));
+#endif
+#ifdef SPREADSHEET_PROFILING
+    auto& profiler = sheet_.GetProfiler();
+    if (profiler.IsEnabled()) {
+        profiler.RecordInvalidation(pos_, invalidated - 1);
     }
+#else
+    (void) invalidated;
+#endif
+}
 
-private:
-    std::string text_;
-};
+void Cell::Restore(std::string text) {
+    content_ = MakeContent(std::move(text));
+}
 
-class Cell::FormulaImpl : public Impl {
-public:
-    explicit FormulaImpl(std::string text, const SheetInterface& sheet) : sheet_(sheet) {
-        formula_ = ParseFormula(text);
+void Cell::Clear() {
+    Set("");
+}
+
+void Cell::ClearContent() {
+    SetContent(std::monostate{}, /* invalidate = */ false);
+}
+
+void Cell::InvalidateCache() {
+    InvalidateCacheRecursive(/* force = */ true);
+}
+
+void Cell::ShareSubexpressions(SubexpressionTable* table) {
+    if (auto* formula = std::get_if<std::unique_ptr<FormulaData>>(&content_)) {
+        (*formula)->formula->ShareSubexpressions(table);
     }
+}
+
+std::unique_ptr<FormulaInterface> Cell::CopyFormula(int rows, int cols) const {
+    if (const auto* formula = std::get_if<std::unique_ptr<FormulaData>>(&content_)) {
+        return (*formula)->formula->Copy(rows, cols);
+    }
+    return nullptr;
+}
 
-    Value GetValue() const override {
-        if (!cachedValue_) {
-            cachedValue_ = formula_->Evaluate(sheet_);
+Cell::Value Cell::GetValue() const {
+    if (const auto* pooled = std::get_if<PooledString>(&content_)) {
+        auto text = pooled->Get();
+        if (text[0] == ESCAPE_SIGN) {
+            text.remove_prefix(1);
         }
-        return std::visit([&](const auto& v) { return Value(v); }, *cachedValue_);
+        return std::string(text);
     }
+    if (const auto* formula = std::get_if<std::unique_ptr<FormulaData>>(&content_)) {
+        // Кэш формулы может заполнять фоновый пересчёт листа
+        auto lock = sheet_.LockForRead();
+        const auto& data = **formula;
+        if (!data.cachedValue && std::any_of(outRefs_.begin(), outRefs_.end(), [](const Cell* input) {
+                return !input->IsCacheValid();
+            })) {
+            // Устаревшие входы вычисляет лист: рекурсия по цепочке ссылок
+            // переполнила бы стек. Эту ячейку он вычисляет последней.
+            sheet_.EvaluateInputs(*this);
+        } else if (!data.cachedValue) {
+#ifdef SPREADSHEET_PROFILING
+            Profiler::EvaluationScope scope(sheet_.GetProfiler(), pos_);
+#endif
+#ifdef SPREADSHEET_TRACING
+            trace::Scope evaluation("Evaluate", pos_, data.invalidatedBy);
+#endif
+            data.cachedValue = data.formula->Evaluate(sheet_);
+        }
+#ifdef SPREADSHEET_PROFILING
+        else if (sheet_.GetProfiler().IsEnabled()) {
+            sheet_.GetProfiler().RecordCacheHit(pos_);
+        }
+#endif
+        return std::visit([&](const auto& v) { return Value(v); }, *data.cachedValue);
+    }
+    return {};
+}
 
-    std::string GetText() const override {
-        return FORMULA_SIGN + formula_->GetExpression();
+std::string Cell::GetText() const {
+    return std::string(GetTextView());
+}
+
+std::string_view Cell::GetTextView() const {
+    if (const auto* pooled = std::get_if<PooledString>(&content_)) {
+        return pooled->Get();
+    }
+    if (const auto* formula = std::get_if<std::unique_ptr<FormulaData>>(&content_)) {
+        return (*formula)->text;
     }
+    return {};
+}
 
-    std::vector<Position> GetReferencedCells() const override {
-        return formula_->GetReferencedCells();
+std::vector<Position> Cell::GetReferencedCells() const {
+    if (const auto* formula = std::get_if<std::unique_ptr<FormulaData>>(&content_)) {
+        return (*formula)->formula->GetReferencedCells();
     }
+    return {};
+}
 
-    bool IsCacheValid() const override {
-        return cachedValue_.has_value();
+std::vector<ExternalCell> Cell::GetExternalCells() const {
+    if (const auto* formula = std::get_if<std::unique_ptr<FormulaData>>(&content_)) {
+        return (*formula)->formula->GetExternalCells();
     }
+    return {};
+}
 
-    void InvalidateCache() override {
-        cachedValue_.reset();
+std::vector<RangeRef> Cell::GetReferencedRanges() const {
+    if (const auto* formula = std::get_if<std::unique_ptr<FormulaData>>(&content_)) {
+        return (*formula)->formula->GetReferencedRanges();
     }
+    return {};
+}
 
-private:
-    const SheetInterface& sheet_;
-    std::unique_ptr<FormulaInterface> formula_;
-    mutable std::optional<FormulaInterface::Value> cachedValue_;
-};
+bool Cell::IsEmpty() const {
+    return std::holds_alternative<std::monostate>(content_);
+}
 
-// Реализуйте следующие методы
-Cell::Cell(Sheet& sheet) : impl_(std::make_unique<EmptyImpl>()),
-                           sheet_(sheet) {
+bool Cell::HasFormula() const {
+    return std::holds_alternative<std::unique_ptr<FormulaData>>(content_);
 }
 
-Cell::~Cell() {}
+bool Cell::IsCacheValid() const {
+    const auto* formula = std::get_if<std::unique_ptr<FormulaData>>(&content_);
+    return !formula || (*formula)->cachedValue.has_value();
+}
 
-void Cell::Set(std::string text) {
-    std::unique_ptr<Impl> newImpl;
-    if (text.empty()) {
-        newImpl = std::make_unique<EmptyImpl>();
-    } else if (text[0] == FORMULA_SIGN && text.size() > 1 && !std::isspace(text[1])) {
-        newImpl = std::make_unique<FormulaImpl>(text.substr(1), sheet_);
-    } else {
-        newImpl = std::make_unique<TextImpl>(text);
+void Cell::AttachDependents(CellSet dependents) {
+    for (Cell* incoming : dependents) {
+        incoming->outRefs_.insert(this);
+        incoming->CountLink(this, 1);
     }
+    inRefs_ = std::move(dependents);
+}
 
-    if (IsCircularDependency(*newImpl)) {
-        throw CircularDependencyException(
-                "Setting this formula would introduce circular dependency!");
+CellSet Cell::DetachDependents() {
+    for (Cell* incoming : inRefs_) {
+        incoming->outRefs_.erase(this);
+        incoming->CountLink(this, -1);
     }
+    return std::move(inRefs_);
+}
 
-    impl_ = std::move(newImpl);
-
-    UpdateRefs();
-
-    InvalidateCacheRecursive(true);
+ReferenceShift::Effect Cell::ShiftReferences(const Sheet& target, const ReferenceShift& shift) {
+    return RemapReferences(target, shift);
 }
 
-void Cell::Clear() {
-    Set("");
+ReferenceShift::Effect Cell::ShiftReferences(const Sheet& target, const ReferenceMove& move) {
+    return RemapReferences(target, move);
 }
 
-Cell::Value Cell::GetValue() const {
-    return impl_->GetValue();
+ReferenceShift::Effect Cell::ShiftReferences(const Sheet& target, const ReferencePermutation& permutation) {
+    return RemapReferences(target, permutation);
 }
 
-std::string Cell::GetText() const {
-    return impl_->GetText();
+template<typename Remap>
+ReferenceShift::Effect Cell::RemapReferences(const Sheet& target, const Remap& remap) {
+    auto* formula = std::get_if<std::unique_ptr<FormulaData>>(&content_);
+    if (!formula) {
+        return ReferenceShift::Effect::None;
+    }
+    auto& data = **formula;
+    auto effect = data.formula->ShiftReferences(remap, [this, &target](std::string_view sheet) {
+        return (sheet.empty() ? &sheet_ : sheet_.ResolveSheet(sheet)) == &target;
+    });
+    if (effect != ReferenceShift::Effect::None) {
+        // Ссылки переписываются на месте: дерево и списки ссылок прежнего
+        // размера, меняется только текст
+        data.memory.Remove(MemoryCategory::Text, StringHeapBytes(data.text));
+        data.text = FORMULA_SIGN + data.formula->GetExpression();
+        data.memory.Add(MemoryCategory::Text, StringHeapBytes(data.text));
+        // Общие узлы ищутся по ссылкам, поэтому дерево связывается заново
+        if (auto* subexpressions = sheet_.GetSubexpressions()) {
+            data.formula->ShareSubexpressions(subexpressions);
+        }
+    }
+    if (effect == ReferenceShift::Effect::Changed) {
+        InvalidateCacheRecursive(/* force = */ true);
+    }
+    return effect;
 }
 
-bool Cell::IsReferenced() const {
-    return !inRefs_.empty();
+bool Cell::IsIsolated() const {
+    if (HasDependents()) {
+        return false;
+    }
+    const auto* formula = std::get_if<std::unique_ptr<FormulaData>>(&content_);
+    return !formula || ((*formula)->formula->GetReferencedCells().empty()
+                        && (*formula)->formula->GetExternalCells().empty()
+                        && (*formula)->formula->GetReferencedRanges().empty());
 }
 
-std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
+template<typename F>
+void Cell::ForEachDependent(F f) const {
+    for (Cell* incoming : inRefs_) {
+        f(incoming);
+    }
+    sheet_.ForEachRangeDependent(pos_, f);
 }
 
-bool Cell::IsCircularDependency(const Cell::Impl& newImpl) const {
-    if (newImpl.GetReferencedCells().empty()) {
+bool Cell::IsCircularDependency(const std::vector<Position>& newRefs,
+                                const std::vector<ExternalCell>& newExternalRefs,
+                                const std::vector<RangeRef>& newRanges) const {
+    if (newRefs.empty() && newExternalRefs.empty() && newRanges.empty()) {
         return false;
     }
 
+#ifdef SPREADSHEET_PROFILING
+    // Время читается, только если профилировщик включён
+    auto& profiler = sheet_.GetProfiler();
+    bool profiling = profiler.IsEnabled();
+    std::chrono::steady_clock::time_point start;
+    if (profiling) {
+        start = std::chrono::steady_clock::now();
+    }
+#endif
+#ifdef SPREADSHEET_TRACING
+    trace::Scope scope("CycleCheck", pos_);
+#endif
+
+    // Цикл замыкает сама ячейка или ячейка, связанная с графом. Изолированные
+    // лист может вытеснить на диск, поэтому их указатели не запоминаются.
     std::unordered_set<const CellInterface*> referenced;
-    for (const auto& pos : newImpl.GetReferencedCells()) {
-        referenced.insert(sheet_.GetCell(pos));
+    auto addReferenced = [this, &referenced](const CellInterface* cell) {
+        if (cell == this || (cell && !static_cast<const Cell*>(cell)->IsIsolated())) {
+            referenced.insert(cell);
+        }
+    };
+    for (const auto& pos : newRefs) {
+        addReferenced(sheet_.GetCell(pos));
     }
+    // Граф зависимостей общий для всей книги, поэтому обход ниже проходит
+    // и через ячейки других листов
+    for (const auto& ref : newExternalRefs) {
+        if (const Sheet* target = sheet_.ResolveSheet(ref.sheet)) {
+            addReferenced(target->GetCell(ref.pos));
+        }
+    }
+    // Ячейки диапазонов не перечисляются: обход проверяет, попадает ли
+    // посещённая ячейка в один из них
+    std::vector<std::pair<const Sheet*, Range>> ranges;
+    for (const auto& ref : newRanges) {
+        if (const Sheet* target = ref.sheet.empty() ? &sheet_ : sheet_.ResolveSheet(ref.sheet)) {
+            ranges.emplace_back(target, ref.range);
+        }
+    }
+    auto inRanges = [&ranges](const Cell* cell) {
+        return std::any_of(ranges.begin(), ranges.end(), [cell](const auto& range) {
+            return range.first == &cell->sheet_ && range.second.Contains(cell->pos_);
+        });
+    };
 
+    bool found = false;
     std::unordered_set<const Cell*> visited;
     std::stack<const Cell*> toVisit;
     toVisit.push(this);
@@ -158,41 +381,143 @@ bool Cell::IsCircularDependency(const Cell::Impl& newImpl) const {
         const Cell* current = toVisit.top();
         toVisit.pop();
         visited.insert(current);
-        if (referenced.find(current) != referenced.end()) {
-            return true;
+        if (referenced.find(current) != referenced.end() || inRanges(current)) {
+            found = true;
+            break;
         }
-        for (const Cell* incoming : current->inRefs_) {
+        current->ForEachDependent([&](const Cell* incoming) {
             if (visited.find(incoming) == visited.end()) {
                 toVisit.push(incoming);
             }
-        }
+        });
+    }
+
+#ifdef SPREADSHEET_PROFILING
+    if (profiling) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        profiler.RecordCycleCheck(pos_, visited.size(), elapsed.count());
     }
-    return false;
+#endif
+#ifdef SPREADSHEET_TRACING
+    scope.SetCount(static_cast<int64_t>(visited.size()));
+#endif
+    return found;
 }
 
-void Cell::UpdateRefs() {
+void Cell::UpdateRefs(const std::vector<Position>& oldRefs,
+                      const std::vector<ExternalCell>& oldExternalRefs,
+                      const std::vector<RangeRef>& oldRanges) {
     for (Cell* outgoing : outRefs_) {
         outgoing->inRefs_.erase(this);
+        CountLink(outgoing, -1);
     }
     outRefs_.clear();
-    for (const auto& pos : impl_->GetReferencedCells()) {
-        Cell* outgoing = dynamic_cast<Cell*>(sheet_.GetCell(pos));
-        if (!outgoing) {
-            sheet_.SetCell(pos, "");
-            outgoing = dynamic_cast<Cell*>(sheet_.GetCell(pos));
+    for (const auto& pos : oldRefs) {
+        sheet_.RemoveUnsetRef(pos, this);
+    }
+    Workbook* workbook = sheet_.GetWorkbook();
+    for (const auto& ref : oldExternalRefs) {
+        if (Sheet* target = sheet_.ResolveSheet(ref.sheet)) {
+            target->RemoveUnsetRef(ref.pos, this);
+        }
+        // Лист мог появиться уже после того, как ссылка была записана
+        if (workbook) {
+            workbook->RemoveMissingRef(ref.sheet, this);
+        }
+    }
+    for (const auto& ref : oldRanges) {
+        Sheet* target = ref.sheet.empty() ? &sheet_ : sheet_.ResolveSheet(ref.sheet);
+        if (target && target->RemoveRangeRef(ref.range, this) && target != &sheet_ && workbook) {
+            workbook->ChangeLinks(&sheet_, target, -1);
         }
-        outRefs_.insert(outgoing);
-        if (outgoing != nullptr) {
-            outgoing->inRefs_.insert(this);
+        if (!ref.sheet.empty() && workbook) {
+            workbook->RemoveMissingRef(ref.sheet, this);
+        }
+    }
+
+    for (const auto& pos : GetReferencedCells()) {
+        Connect(sheet_, pos);
+    }
+    for (const auto& ref : GetExternalCells()) {
+        if (Sheet* target = sheet_.ResolveSheet(ref.sheet)) {
+            Connect(*target, ref.pos);
+        } else if (workbook) {
+            workbook->AddMissingRef(ref.sheet, this);
+        }
+    }
+    // Формула зависит от всех позиций диапазона, в том числе пустых: связь
+    // хранится в реестре листа диапазона
+    for (const auto& ref : GetReferencedRanges()) {
+        Sheet* target = ref.sheet.empty() ? &sheet_ : sheet_.ResolveSheet(ref.sheet);
+        if (!target) {
+            if (workbook) {
+                workbook->AddMissingRef(ref.sheet, this);
+            }
+            continue;
+        }
+        target->AddRangeRef(ref.range, this);
+        if (target != &sheet_ && workbook) {
+            workbook->ChangeLinks(&sheet_, target, 1);
         }
     }
 }
 
-void Cell::InvalidateCacheRecursive(bool force) {
-    if (impl_->IsCacheValid() || force) {
-        impl_->InvalidateCache();
-        for (Cell* incoming : inRefs_) {
-            incoming->InvalidateCacheRecursive();
+void Cell::Connect(Sheet& target, Position pos) {
+    Cell* outgoing = dynamic_cast<Cell*>(target.GetCell(pos));
+    if (!outgoing) {
+        // Ячейку не создаём: зависимость хранится в реестре листа
+        target.AddUnsetRef(pos, this);
+        return;
+    }
+    if (outRefs_.insert(outgoing).second) {
+        outgoing->inRefs_.insert(this);
+        CountLink(outgoing, 1);
+    }
+}
+
+void Cell::CountLink(const Cell* outgoing, int delta) const {
+    if (&outgoing->sheet_ == &sheet_) {
+        return;
+    }
+    if (Workbook* workbook = sheet_.GetWorkbook()) {
+        workbook->ChangeLinks(&sheet_, &outgoing->sheet_, delta);
+    }
+}
+
+size_t Cell::InvalidateCacheRecursive(bool force) {
+    if (!IsCacheValid() && !force) {
+        return 0;
+    }
+    // Обход с явным стеком: цепочка зависимых бывает длиной во весь лист.
+    // Кэш сбрасывается при добавлении в стек, поэтому ячейка, достижимая
+    // несколькими путями, обходится один раз.
+    std::vector<Cell*> stack;
+    auto invalidate = [&stack](Cell* cell) {
+        if (auto* formula = std::get_if<std::unique_ptr<FormulaData>>(&cell->content_)) {
+            (*formula)->cachedValue.reset();
+            cell->sheet_.MarkStale();
+            cell->sheet_.InvalidateLookupIndexes(cell->pos_);
+#ifdef SPREADSHEET_TRACING
+            (*formula)->invalidatedBy = trace::CurrentEdit();
+#endif
+        }
+        // Подвыражения с этой ячейкой зависят от неё так же, как формулы
+        if (auto* subexpressions = cell->sheet_.GetSubexpressions()) {
+            subexpressions->Invalidate(cell->pos_);
         }
+        stack.push_back(cell);
+    };
+    size_t invalidated = 0;
+    invalidate(this);
+    while (!stack.empty()) {
+        Cell* cell = stack.back();
+        stack.pop_back();
+        ++invalidated;
+        cell->ForEachDependent([&invalidate](Cell* incoming) {
+            if (incoming->IsCacheValid()) {
+                invalidate(incoming);
+            }
+        });
     }
+    return invalidated;
 }
\ No newline at end of file
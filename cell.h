@@ -2,42 +2,151 @@
 
 #include "common.h"
 #include "formula.h"
+#include "memory.h"
+#include "string_pool.h"
 
 #include <functional>
 #include <unordered_set>
+#include <variant>
 
 class Sheet;
+class Cell;
+
+// Множество ячеек-соседей в графе зависимостей; память учитывается листом
+using CellSet = std::unordered_set<Cell*, std::hash<Cell*>, std::equal_to<Cell*>,
+                                   CountingAllocator<Cell*>>;
 
 class Cell : public CellInterface {
 public:
-    Cell(Sheet& sheet);
+    Cell(Sheet& sheet, Position pos);
 
     ~Cell();
 
     void Set(std::string text);
 
+    // Задаёт уже разобранную формулу, например копию формулы другой ячейки
+    void Set(std::unique_ptr<FormulaInterface> formula);
+
+    // Восстанавливает текст изолированной ячейки, подгруженной с диска: без
+    // проверок, связей и сброса кэшей — значение ячейки не менялось
+    void Restore(std::string text);
+
     void Clear();
 
+    // Очищает ячейку, не сбрасывая кэши зависимых: групповая правка листа
+    // сбрасывает их один раз после всех очисток
+    void ClearContent();
+
+    // Сбрасывает кэш формулы и кэши всех ячеек, зависящих от неё
+    void InvalidateCache();
+
+    // Связывает подвыражения формулы с общими узлами table либо, если
+    // table пуст, отвязывает их
+    void ShareSubexpressions(SubexpressionTable* table);
+
+    // Копия формулы ячейки со ссылками, смещёнными на rows строк и cols
+    // столбцов (см. FormulaInterface::Copy); nullptr, если это не формула
+    std::unique_ptr<FormulaInterface> CopyFormula(int rows, int cols) const;
+
     Value GetValue() const override;
 
     std::string GetText() const override;
 
+    // Текст ячейки без копирования; действителен до изменения ячейки
+    std::string_view GetTextView() const;
+
     std::vector<Position> GetReferencedCells() const override;
 
-    bool IsReferenced() const;
+    bool IsEmpty() const;
+
+    bool HasFormula() const;
+
+    Position GetPosition() const {
+        return pos_;
+    }
+
+    Sheet& GetSheet() const {
+        return sheet_;
+    }
+
+    // Ячейки, на которые непосредственно ссылается формула
+    const CellSet& GetInputs() const {
+        return outRefs_;
+    }
+
+    // Значение ячейки известно без вычисления: это текст или формула с
+    // действительным кэшем
+    bool IsCacheValid() const;
+
+    // Ячейки, формулы которых непосредственно ссылаются на эту
+    const CellSet& GetDependents() const {
+        return inRefs_;
+    }
+
+    bool HasDependents() const {
+        return !inRefs_.empty();
+    }
+
+    // Ячейка не связана с графом зависимостей: на неё не ссылаются другие
+    // ячейки, а её формула, если есть, не ссылается ни на какие позиции и
+    // диапазоны
+    bool IsIsolated() const;
+
+    // Подключает ячейки, которые ссылались на позицию до создания этой ячейки
+    void AttachDependents(CellSet dependents);
+
+    // Отключает зависимые ячейки перед удалением этой ячейки и возвращает их
+    CellSet DetachDependents();
+
+    // Переносит ячейку при вставке и удалении строк и столбцов листа: связи
+    // хранятся указателями и не меняются
+    void Move(Position pos) {
+        pos_ = pos;
+    }
+
+    // Переносит ссылки формулы на лист target без повторного разбора и
+    // сбрасывает кэши, если значение могло измениться
+    ReferenceShift::Effect ShiftReferences(const Sheet& target, const ReferenceShift& shift);
+
+    ReferenceShift::Effect ShiftReferences(const Sheet& target, const ReferenceMove& move);
+
+    ReferenceShift::Effect ShiftReferences(const Sheet& target, const ReferencePermutation& permutation);
 
 private:
-    class Impl;
-    class EmptyImpl;
-    class TextImpl;
-    class FormulaImpl;
+    // Разобранная формула вместе с её текстом и кэшем значения
+    struct FormulaData;
+
+    // Содержимое хранится в самой ячейке: пустая ячейка и текст не требуют
+    // отдельного объекта в куче, формула представлена одним указателем.
+    // Текст хранится в пуле строк листа.
+    using Content = std::variant<std::monostate, PooledString, std::unique_ptr<FormulaData>>;
 
-    bool IsCircularDependency(const Impl& newImpl) const;
-    void UpdateRefs();
-    void InvalidateCacheRecursive(bool force = false);
+    Content MakeContent(std::string text);
+    // Заменяет содержимое и связи ячейки; кэши сбрасываются, если invalidate
+    void SetContent(Content newContent, bool invalidate);
+    template<typename Remap>
+    ReferenceShift::Effect RemapReferences(const Sheet& target, const Remap& remap);
+    std::vector<ExternalCell> GetExternalCells() const;
+    std::vector<RangeRef> GetReferencedRanges() const;
+    // Ячейки, значения которых зависят от этой: прямые зависимые и формулы,
+    // ссылающиеся на диапазон с этой ячейкой
+    template<typename F>
+    void ForEachDependent(F f) const;
+    bool IsCircularDependency(const std::vector<Position>& newRefs,
+                              const std::vector<ExternalCell>& newExternalRefs,
+                              const std::vector<RangeRef>& newRanges) const;
+    void UpdateRefs(const std::vector<Position>& oldRefs,
+                    const std::vector<ExternalCell>& oldExternalRefs,
+                    const std::vector<RangeRef>& oldRanges);
+    void Connect(Sheet& target, Position pos);
+    // Учитывает в книге связь между листами, если outgoing на другом листе
+    void CountLink(const Cell* outgoing, int delta) const;
+    // Возвращает число ячеек, кэш которых был сброшен
+    size_t InvalidateCacheRecursive(bool force = false);
 
-    std::unique_ptr<Impl> impl_;
+    Content content_;
     Sheet& sheet_;
-    std::unordered_set<Cell*> inRefs_;
-    std::unordered_set<Cell*> outRefs_;
+    Position pos_;
+    CellSet inRefs_;
+    CellSet outRefs_;
 };
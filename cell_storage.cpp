@@ -0,0 +1,286 @@
+#include "cell_storage.h"
+
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+    // Запись плитки: для каждой ячейки индекс в плитке, длина текста и текст
+    void AppendRecord(std::string& data, size_t index, std::string_view text) {
+        auto length = static_cast<uint32_t>(text.size());
+        data += static_cast<char>(index);
+        data.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        data.append(text);
+    }
+}
+
+void CellStorage::EnableSpilling(std::string path, CellLoader loader, std::function<bool()> overBudget) {
+    if (spill_file_) {
+        throw std::logic_error("Spilling is already enabled");
+    }
+    spill_file_ = std::make_unique<SpillFile>(std::move(path));
+    loader_ = std::move(loader);
+    over_budget_ = std::move(overBudget);
+}
+
+Cell* CellStorage::Find(Position pos) {
+    size_t index = Index(pos.row, pos.col);
+    auto it = tiles_.find(Key(pos));
+    if (it == tiles_.end()) {
+        if (spilled_.empty()) {
+            return nullptr;
+        }
+        auto spilled = spilled_.find(Key(pos));
+        if (spilled == spilled_.end() || !(spilled->second.occupied >> index & 1)) {
+            return nullptr;
+        }
+        it = Load(spilled);
+    }
+    if (spill_file_ && pause_depth_ == 0) {
+        it->second.referenced = true;
+    }
+    return it->second.cells[index].get();
+}
+
+Cell& CellStorage::Insert(Position pos, std::unique_ptr<Cell> cell) {
+    uint64_t key = Key(pos);
+    auto it = FindTile(key);
+    if (it == tiles_.end()) {
+        it = tiles_.try_emplace(key).first;
+    }
+    auto& tile = it->second;
+    auto& slot = tile.cells[Index(pos.row, pos.col)];
+    if (!slot) {
+        ++tile.count;
+    }
+    slot = std::move(cell);
+    tile.dirty = true;
+    nothing_to_evict_ = false;
+    return *slot;
+}
+
+std::unique_ptr<Cell> CellStorage::Extract(Position pos) {
+    auto it = FindTile(Key(pos));
+    if (it == tiles_.end()) {
+        return nullptr;
+    }
+    auto cell = std::move(it->second.cells[Index(pos.row, pos.col)]);
+    it->second.dirty = true;
+    nothing_to_evict_ = false;
+    if (cell && --it->second.count == 0) {
+        tiles_.erase(it);
+    }
+    return cell;
+}
+
+template<typename Map>
+std::vector<uint64_t> CellStorage::CollectKeys(const Map& map, ReferenceShift::Axis axis, int firstTile) {
+    std::vector<uint64_t> keys;
+    if (axis == ReferenceShift::Axis::Rows) {
+        for (auto it = map.lower_bound(Key(firstTile, 0)); it != map.end(); ++it) {
+            keys.push_back(it->first);
+        }
+        return keys;
+    }
+    // Плитки упорядочены по строкам: в каждой строке плиток левые пропускаются
+    for (auto it = map.lower_bound(Key(0, firstTile)); it != map.end();) {
+        if (TileCol(it->first) < firstTile) {
+            it = map.lower_bound(Key(TileRow(it->first), firstTile));
+            continue;
+        }
+        keys.push_back(it->first);
+        ++it;
+    }
+    return keys;
+}
+
+void CellStorage::Shift(const ReferenceShift& shift, const std::function<void(Cell&, Position)>& moved) {
+    bool rows = shift.axis == ReferenceShift::Axis::Rows;
+    int tileSize = rows ? TILE_ROWS : TILE_COLS;
+    int movedFrom = shift.GetMovedFrom();
+    int firstTile = movedFrom / tileSize;
+    nothing_to_evict_ = false;
+
+    if (movedFrom % tileSize == 0 && shift.delta % tileSize == 0) {
+        // Меняются только ключи плиток: ячейки остаются на своих местах
+        // внутри плиток, а копии вытесненных плиток на диске — в силе
+        int tiles = shift.delta / tileSize;
+        auto shiftKey = [rows, tiles](uint64_t key) {
+            return rows ? Key(TileRow(key) + tiles, TileCol(key)) : Key(TileRow(key), TileCol(key) + tiles);
+        };
+        std::vector<Tiles::node_type> nodes;
+        for (uint64_t key : CollectKeys(tiles_, shift.axis, firstTile)) {
+            nodes.push_back(tiles_.extract(key));
+        }
+        for (auto& node : nodes) {
+            node.key() = shiftKey(node.key());
+            for (size_t i = 0; i < node.mapped().cells.size(); ++i) {
+                if (const auto& cell = node.mapped().cells[i]) {
+                    moved(*cell, CellPosition(node.key(), i));
+                }
+            }
+            tiles_.insert(std::move(node));
+        }
+        std::vector<SpilledTiles::node_type> spilled;
+        for (uint64_t key : CollectKeys(spilled_, shift.axis, firstTile)) {
+            spilled.push_back(spilled_.extract(key));
+        }
+        for (auto& node : spilled) {
+            node.key() = shiftKey(node.key());
+            spilled_.insert(std::move(node));
+        }
+        return;
+    }
+
+    for (uint64_t key : CollectKeys(spilled_, shift.axis, firstTile)) {
+        Load(spilled_.find(key));
+    }
+    std::vector<std::pair<Position, std::unique_ptr<Cell>>> cells;
+    for (uint64_t key : CollectKeys(tiles_, shift.axis, firstTile)) {
+        auto it = tiles_.find(key);
+        auto& tile = it->second;
+        for (size_t i = 0; i < tile.cells.size(); ++i) {
+            Position pos = CellPosition(key, i);
+            if (tile.cells[i] && (rows ? pos.row : pos.col) >= movedFrom) {
+                cells.emplace_back(shift.Apply(pos), std::move(tile.cells[i]));
+                --tile.count;
+            }
+        }
+        tile.dirty = true;
+        if (tile.count == 0) {
+            tiles_.erase(it);
+        }
+    }
+    for (auto& [pos, cell] : cells) {
+        assert(pos.IsValid());
+        moved(Insert(pos, std::move(cell)), pos);
+    }
+}
+
+void CellStorage::MarkDirty(Position pos) {
+    if (auto it = tiles_.find(Key(pos)); it != tiles_.end()) {
+        it->second.dirty = true;
+        nothing_to_evict_ = false;
+    }
+}
+
+CellStorage::Tiles::iterator CellStorage::FindTile(uint64_t key) {
+    auto it = tiles_.find(key);
+    if (it != tiles_.end() || spilled_.empty()) {
+        return it;
+    }
+    auto spilled = spilled_.find(key);
+    return spilled == spilled_.end() ? tiles_.end() : Load(spilled);
+}
+
+CellStorage::Tiles::iterator CellStorage::Load(SpilledTiles::iterator spilled) {
+    uint64_t key = spilled->first;
+    SpillFile::Extent extent = spilled->second.extent;
+    std::string data = spill_file_->Read(extent);
+    spilled_.erase(spilled);
+    ++stats_.loads;
+    stats_.bytes_read += data.size();
+
+    auto it = tiles_.try_emplace(key).first;
+    auto& tile = it->second;
+    tile.extent = extent;
+    tile.dirty = false;
+    Position origin{TileRow(key) * TILE_ROWS, TileCol(key) * TILE_COLS};
+    for (size_t offset = 0; offset < data.size();) {
+        size_t index = static_cast<unsigned char>(data[offset]);
+        uint32_t length = 0;
+        std::memcpy(&length, data.data() + offset + 1, sizeof(length));
+        std::string_view text(data.data() + offset + 1 + sizeof(length), length);
+        offset += 1 + sizeof(length) + length;
+        Position pos{origin.row + static_cast<int>(index) / TILE_COLS,
+                     origin.col + static_cast<int>(index) % TILE_COLS};
+        tile.cells[index] = loader_(pos, text);
+        ++tile.count;
+    }
+    nothing_to_evict_ = false;
+    return it;
+}
+
+void CellStorage::LoadRange(uint64_t first, uint64_t last) {
+    if (spilled_.empty()) {
+        return;
+    }
+    std::vector<uint64_t> keys;
+    for (auto it = spilled_.lower_bound(first); it != spilled_.end() && it->first <= last; ++it) {
+        keys.push_back(it->first);
+    }
+    for (uint64_t key : keys) {
+        Load(spilled_.find(key));
+    }
+}
+
+void CellStorage::EvictCold() {
+    if (!spill_file_ || pause_depth_ > 0 || nothing_to_evict_) {
+        return;
+    }
+    while (over_budget_()) {
+        if (!EvictOne()) {
+            nothing_to_evict_ = true;
+            return;
+        }
+    }
+}
+
+bool CellStorage::EvictOne() {
+    // Стрелка проходит плитки по кругу: плитка с битом обращения получает
+    // второй шанс, плитка со связанными ячейками пропускается
+    size_t steps = 2 * tiles_.size();
+    auto it = tiles_.lower_bound(clock_hand_);
+    for (size_t step = 0; step < steps; ++step, ++it) {
+        if (it == tiles_.end()) {
+            it = tiles_.begin();
+        }
+        auto& tile = it->second;
+        if (tile.referenced) {
+            tile.referenced = false;
+            continue;
+        }
+        if (!IsEvictable(tile)) {
+            continue;
+        }
+
+        SpilledTile spilled;
+        if (tile.dirty) {
+            std::string data;
+            for (size_t i = 0; i < tile.cells.size(); ++i) {
+                if (tile.cells[i]) {
+                    AppendRecord(data, i, tile.cells[i]->GetTextView());
+                }
+            }
+            spill_file_->Write(tile.extent, data);
+            stats_.bytes_written += data.size();
+        }
+        spilled.extent = tile.extent;
+        for (size_t i = 0; i < tile.cells.size(); ++i) {
+            if (tile.cells[i]) {
+                spilled.occupied |= uint64_t(1) << i;
+            }
+        }
+        uint64_t key = it->first;
+        clock_hand_ = key + 1;
+        spilled_.emplace(key, spilled);
+        tiles_.erase(it);
+        ++stats_.evictions;
+        return true;
+    }
+    return false;
+}
+
+bool CellStorage::IsEvictable(const Tile& tile) const {
+    return std::all_of(tile.cells.begin(), tile.cells.end(), [](const auto& cell) {
+        return !cell || cell->IsIsolated();
+    });
+}
+
+SpillStats CellStorage::GetSpillStats() const {
+    SpillStats stats = stats_;
+    stats.resident_tiles = tiles_.size();
+    stats.spilled_tiles = spilled_.size();
+    stats.file_bytes = spill_file_ ? spill_file_->GetSize() : 0;
+    return stats;
+}
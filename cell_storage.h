@@ -0,0 +1,270 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+#include "memory.h"
+#include "spill_file.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct SpillStats {
+    size_t resident_tiles = 0;
+    size_t spilled_tiles = 0;
+    uint64_t evictions = 0;
+    uint64_t loads = 0;
+    uint64_t bytes_written = 0;
+    uint64_t bytes_read = 0;
+    uint64_t file_bytes = 0;
+};
+
+// Разреженное хранилище ячеек листа. Лист делится на плитки
+// TILE_ROWS x TILE_COLS, и в памяти есть только плитки с ячейками: объём
+// зависит от числа занятых ячеек, а не от размеров листа. Плитки
+// упорядочены по строкам, поэтому обход окна пропускает пустые участки,
+// не просматривая их.
+//
+// Хранилище может вытеснять холодные плитки в файл (EnableSpilling).
+// Вытесняются только плитки, все ячейки которых изолированы от графа
+// зависимостей, поэтому цепочки формул всегда остаются в памяти, а
+// указатели на ячейки внутри графа не меняются. Плитки выбираются по
+// алгоритму CLOCK и подгружаются при обращении к любой их ячейке.
+class CellStorage {
+public:
+    static const int TILE_ROWS = 8;
+    static const int TILE_COLS = 8;
+
+    // Восстанавливает ячейку по тексту при подгрузке плитки
+    using CellLoader = std::function<std::unique_ptr<Cell>(Position, std::string_view)>;
+
+    // Приостанавливает вытеснение до конца области: указатели на ячейки,
+    // полученные внутри неё, остаются действительными
+    class Pause {
+    public:
+        explicit Pause(CellStorage& storage)
+                : storage_(storage) {
+            ++storage_.pause_depth_;
+        }
+
+        Pause(const Pause&) = delete;
+
+        Pause& operator=(const Pause&) = delete;
+
+        ~Pause() {
+            --storage_.pause_depth_;
+        }
+
+    private:
+        CellStorage& storage_;
+    };
+
+    explicit CellStorage(MemoryCounter& memory)
+            : tiles_(Tiles::allocator_type(memory, MemoryCategory::Grid)),
+              spilled_(SpilledTiles::allocator_type(memory, MemoryCategory::Grid)) {
+    }
+
+    // Включает вытеснение в файл path: пока overBudget возвращает true,
+    // EvictCold выгружает холодные плитки
+    void EnableSpilling(std::string path, CellLoader loader, std::function<bool()> overBudget);
+
+    // Ячейка в позиции pos; вытесненная плитка при этом подгружается
+    Cell* Find(Position pos);
+
+    // Кладёт ячейку в пустую позицию pos
+    Cell& Insert(Position pos, std::unique_ptr<Cell> cell);
+
+    // Забирает ячейку из позиции pos; опустевшая плитка освобождается
+    std::unique_ptr<Cell> Extract(Position pos);
+
+    // Сдвигает ячейки при вставке и удалении строк или столбцов: ячейки
+    // начиная с shift.GetMovedFrom() переносятся на shift.delta. Удаляемые
+    // позиции должны быть пусты, а переносимые ячейки — остаться в пределах
+    // листа. Сдвиг, кратный плиткам, переносит плитки целиком, в том числе
+    // вытесненные; иначе затронутые плитки подгружаются и ячейки
+    // раскладываются заново. moved(cell, pos) вызывается для каждой
+    // перенесённой ячейки.
+    void Shift(const ReferenceShift& shift, const std::function<void(Cell&, Position)>& moved);
+
+    // Отмечает, что содержимое ячейки pos изменилось и копия плитки на
+    // диске устарела
+    void MarkDirty(Position pos);
+
+    // Вытесняет холодные плитки, пока память превышает бюджет. Ничего не
+    // делает внутри Pause. Указатели на изолированные ячейки, полученные до
+    // вызова, становятся недействительными.
+    void EvictCold();
+
+    SpillStats GetSpillStats() const;
+
+    // Вызывает f(pos, cell) для каждой ячейки окна размера size с левым
+    // верхним углом topLeft в порядке строк. Вытесненные плитки окна
+    // подгружаются полосами, и между полосами память возвращается к бюджету.
+    template<typename F>
+    void ForEachInWindow(Position topLeft, Size size, F f);
+
+    // Вызывает f(pos, cell) для каждой ячейки в памяти в порядке плиток.
+    // Вытесненные ячейки изолированы, поэтому их значения не зависят от
+    // других ячеек и не требуют пересчёта.
+    template<typename F>
+    void ForEach(F f) const;
+
+    // То же, начиная с ячейки from в порядке плиток, пока f возвращает
+    // true. Возвращает позицию ячейки, на которой f вернула false, чтобы
+    // продолжить обход с неё, либо nullopt, если обход закончен.
+    template<typename F>
+    std::optional<Position> ForEachFrom(Position from, F f) const;
+
+private:
+    struct Tile {
+        std::array<std::unique_ptr<Cell>, TILE_ROWS * TILE_COLS> cells;
+        int count = 0;
+        // Бит обращения CLOCK
+        bool referenced = true;
+        // Копия на диске устарела или отсутствует
+        bool dirty = true;
+        SpillFile::Extent extent;
+    };
+
+    static_assert(TILE_ROWS * TILE_COLS <= 64, "occupied mask must fit a tile");
+
+    struct SpilledTile {
+        SpillFile::Extent extent;
+        // Занятые позиции плитки: обращение к пустой позиции не подгружает её
+        uint64_t occupied = 0;
+    };
+
+    using Tiles = std::map<uint64_t, Tile, std::less<uint64_t>,
+                           CountingAllocator<std::pair<const uint64_t, Tile>>>;
+    using SpilledTiles = std::map<uint64_t, SpilledTile, std::less<uint64_t>,
+                                  CountingAllocator<std::pair<const uint64_t, SpilledTile>>>;
+
+    static uint64_t Key(int tileRow, int tileCol) {
+        return static_cast<uint64_t>(tileRow) << 32 | static_cast<uint32_t>(tileCol);
+    }
+
+    static uint64_t Key(Position pos) {
+        return Key(pos.row / TILE_ROWS, pos.col / TILE_COLS);
+    }
+
+    static int TileRow(uint64_t key) {
+        return static_cast<int>(key >> 32);
+    }
+
+    static int TileCol(uint64_t key) {
+        return static_cast<int>(key & 0xFFFFFFFF);
+    }
+
+    static size_t Index(int row, int col) {
+        return static_cast<size_t>(row % TILE_ROWS) * TILE_COLS + col % TILE_COLS;
+    }
+
+    static Position CellPosition(uint64_t key, size_t index) {
+        return {TileRow(key) * TILE_ROWS + static_cast<int>(index) / TILE_COLS,
+                TileCol(key) * TILE_COLS + static_cast<int>(index) % TILE_COLS};
+    }
+
+    // Ключи плиток map, затронутых сдвигом с плитки firstTile по оси axis
+    template<typename Map>
+    static std::vector<uint64_t> CollectKeys(const Map& map, ReferenceShift::Axis axis, int firstTile);
+
+    // Плитка key в памяти, при необходимости подгруженная; end(), если её нет
+    Tiles::iterator FindTile(uint64_t key);
+    Tiles::iterator Load(SpilledTiles::iterator spilled);
+    // Подгружает вытесненные плитки с ключами из [first, last]
+    void LoadRange(uint64_t first, uint64_t last);
+    bool EvictOne();
+    bool IsEvictable(const Tile& tile) const;
+
+    Tiles tiles_;
+    SpilledTiles spilled_;
+    std::unique_ptr<SpillFile> spill_file_;
+    CellLoader loader_;
+    std::function<bool()> over_budget_;
+    // Позиция стрелки CLOCK: ключ следующей проверяемой плитки
+    uint64_t clock_hand_ = 0;
+    // После безуспешного обхода вытеснение не повторяется до изменения ячеек
+    bool nothing_to_evict_ = false;
+    int pause_depth_ = 0;
+    SpillStats stats_;
+};
+
+template<typename F>
+void CellStorage::ForEachInWindow(Position topLeft, Size size, F f) {
+    if (size.rows <= 0 || size.cols <= 0) {
+        return;
+    }
+    int lastRow = topLeft.row + size.rows - 1;
+    int lastCol = topLeft.col + size.cols - 1;
+    int tileRow = topLeft.row / TILE_ROWS;
+    while (tileRow <= lastRow / TILE_ROWS) {
+        uint64_t bandFirst = Key(tileRow, topLeft.col / TILE_COLS);
+        uint64_t bandLast = Key(tileRow, lastCol / TILE_COLS);
+        LoadRange(bandFirst, bandLast);
+        auto first = tiles_.lower_bound(bandFirst);
+        auto last = tiles_.upper_bound(bandLast);
+        if (first == last) {
+            // Полоса плиток пуста: переходим сразу к следующей занятой
+            auto spilled = spilled_.upper_bound(bandLast);
+            if (last == tiles_.end() && spilled == spilled_.end()) {
+                return;
+            }
+            int next = std::min(last == tiles_.end() ? lastRow / TILE_ROWS + 1 : TileRow(last->first),
+                                spilled == spilled_.end() ? lastRow / TILE_ROWS + 1 : TileRow(spilled->first));
+            tileRow = std::max(tileRow + 1, next);
+            continue;
+        }
+        {
+            Pause pause(*this);
+            int rowEnd = std::min(lastRow, tileRow * TILE_ROWS + TILE_ROWS - 1);
+            for (int row = std::max(topLeft.row, tileRow * TILE_ROWS); row <= rowEnd; ++row) {
+                // f может подгрузить плитки за полосой (например, вычисляя
+                // формулу с диапазоном), и last тогда указывает уже не на
+                // конец полосы, поэтому обход ограничивается ключом
+                for (auto it = first; it != tiles_.end() && it->first <= bandLast; ++it) {
+                    int tileCol = TileCol(it->first);
+                    int colEnd = std::min(lastCol, tileCol * TILE_COLS + TILE_COLS - 1);
+                    for (int col = std::max(topLeft.col, tileCol * TILE_COLS); col <= colEnd; ++col) {
+                        if (const auto& cell = it->second.cells[Index(row, col)]) {
+                            f(Position{row, col}, *cell);
+                        }
+                    }
+                }
+            }
+        }
+        EvictCold();
+        ++tileRow;
+    }
+}
+
+template<typename F>
+void CellStorage::ForEach(F f) const {
+    for (const auto& [key, tile] : tiles_) {
+        for (size_t i = 0; i < tile.cells.size(); ++i) {
+            if (const auto& cell = tile.cells[i]) {
+                f(CellPosition(key, i), *cell);
+            }
+        }
+    }
+}
+
+template<typename F>
+std::optional<Position> CellStorage::ForEachFrom(Position from, F f) const {
+    uint64_t first = Key(from);
+    for (auto it = tiles_.lower_bound(first); it != tiles_.end(); ++it) {
+        const auto& cells = it->second.cells;
+        for (size_t i = it->first == first ? Index(from.row, from.col) : 0; i < cells.size(); ++i) {
+            if (cells[i] && !f(CellPosition(it->first, i), *cells[i])) {
+                return CellPosition(it->first, i);
+            }
+        }
+    }
+    return std::nullopt;
+}
@@ -2,6 +2,7 @@
 
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -13,21 +14,104 @@ struct Position {
     int row = 0;
     int col = 0;
 
-    bool operator==(Position rhs) const;
+    constexpr bool operator==(Position rhs) const {
+        return row == rhs.row && col == rhs.col;
+    }
+
+    constexpr bool operator!=(Position rhs) const {
+        return !(*this == rhs);
+    }
 
     bool operator<(Position rhs) const;
 
-    bool IsValid() const;
+    constexpr bool IsValid() const {
+        return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
+    }
 
     std::string ToString() const;
 
-    static Position FromString(std::string_view str);
+    // Записывает строковое представление позиции в buffer, в котором должно
+    // быть не меньше MAX_STRING_LENGTH символов. Возвращает указатель на
+    // символ, следующий за последним записанным. Для некорректной позиции
+    // ничего не записывает.
+    constexpr char* ToChars(char* buffer) const;
+
+    static constexpr Position FromString(std::string_view str);
 
-    static const int MAX_ROWS = 16384;
+    static const int MAX_ROWS = 1048576;
     static const int MAX_COLS = 16384;
+    static const int MAX_STRING_LENGTH = 17;
+    static const int MAX_LETTER_COUNT = 3;
     static const Position NONE;
 };
 
+inline constexpr Position Position::NONE = {-1, -1};
+
+struct PositionHasher {
+    size_t operator()(Position pos) const {
+        return static_cast<size_t>(pos.row) * Position::MAX_COLS + pos.col;
+    }
+};
+
+constexpr char* Position::ToChars(char* buffer) const {
+    constexpr int letters = 26;
+    if (!IsValid()) {
+        return buffer;
+    }
+
+    int length = 0;
+    for (int c = col; c >= 0; c = c / letters - 1) {
+        ++length;
+    }
+    char* end = buffer + length;
+    for (int c = col; c >= 0; c = c / letters - 1) {
+        *--end = static_cast<char>('A' + c % letters);
+    }
+    end = buffer + length;
+
+    int digits = 0;
+    for (int r = row + 1; r > 0; r /= 10) {
+        ++digits;
+    }
+    end += digits;
+    char* out = end;
+    for (int r = row + 1; r > 0; r /= 10) {
+        *--out = static_cast<char>('0' + r % 10);
+    }
+    return end;
+}
+
+constexpr Position Position::FromString(std::string_view str) {
+    constexpr int letters = 26;
+    constexpr int max_row = 0x7FFFFFFF;
+
+    size_t letter_count = 0;
+    while (letter_count < str.size() && str[letter_count] >= 'A' && str[letter_count] <= 'Z') {
+        ++letter_count;
+    }
+    if (letter_count == 0 || letter_count == str.size() || letter_count > MAX_LETTER_COUNT) {
+        return NONE;
+    }
+
+    long long row = 0;
+    for (size_t i = letter_count; i < str.size(); ++i) {
+        if (str[i] < '0' || str[i] > '9') {
+            return NONE;
+        }
+        row = row * 10 + (str[i] - '0');
+        if (row > max_row) {
+            return NONE;
+        }
+    }
+
+    int col = 0;
+    for (size_t i = 0; i < letter_count; ++i) {
+        col = col * letters + (str[i] - 'A' + 1);
+    }
+
+    return {static_cast<int>(row) - 1, col - 1};
+}
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -35,6 +119,137 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Ссылка на ячейку другого листа книги: Sheet2!A1
+struct ExternalCell {
+    std::string sheet;
+    Position pos;
+
+    bool operator==(const ExternalCell& rhs) const {
+        return sheet == rhs.sheet && pos == rhs.pos;
+    }
+
+    bool operator<(const ExternalCell& rhs) const;
+
+    std::string ToString() const;
+};
+
+// Прямоугольный диапазон ячеек A1:B10; оба угла входят в диапазон
+struct Range {
+    Position first;
+    Position last;
+
+    bool operator==(const Range& rhs) const {
+        return first == rhs.first && last == rhs.last;
+    }
+
+    bool operator!=(const Range& rhs) const {
+        return !(*this == rhs);
+    }
+
+    bool operator<(const Range& rhs) const;
+
+    bool IsValid() const {
+        return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+    }
+
+    bool Contains(Position pos) const {
+        return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col && pos.col <= last.col;
+    }
+
+    bool Intersects(const Range& rhs) const {
+        return first.row <= rhs.last.row && rhs.first.row <= last.row
+               && first.col <= rhs.last.col && rhs.first.col <= last.col;
+    }
+
+    Size GetSize() const {
+        return {last.row - first.row + 1, last.col - first.col + 1};
+    }
+
+    std::string ToString() const;
+};
+
+// Диапазон, возможно, другого листа книги: Sheet2!A1:A10. Пустое имя
+// листа обозначает лист формулы.
+struct RangeRef {
+    std::string sheet;
+    Range range;
+
+    bool operator==(const RangeRef& rhs) const {
+        return sheet == rhs.sheet && range == rhs.range;
+    }
+
+    bool operator<(const RangeRef& rhs) const;
+
+    std::string ToString() const;
+};
+
+// Вставка или удаление строк либо столбцов листа
+struct ReferenceShift {
+    enum class Axis {
+        Rows,
+        Cols,
+    };
+
+    // Как сдвиг затронул ссылки формулы
+    enum class Effect {
+        None,     // формула не ссылается на сдвинутые позиции
+        Moved,    // ссылки перенесены вместе с ячейками, значение прежнее
+        Changed,  // ссылка удалена или диапазон изменил размер
+    };
+
+    Axis axis = Axis::Rows;
+    // Первая вставленная или удалённая строка (столбец)
+    int first = 0;
+    // Число вставленных строк, а со знаком минус — удалённых
+    int delta = 0;
+
+    // Первая строка (столбец), которая сдвигается на delta
+    int GetMovedFrom() const {
+        return delta > 0 ? first : first - delta;
+    }
+
+    // Новая позиция; Position::NONE, если позиция удалена или ушла за
+    // пределы листа
+    Position Apply(Position pos) const;
+
+    // Новый диапазон: вставка внутри диапазона расширяет его, удаление части
+    // сужает. Удалённый целиком диапазон становится недействительным.
+    Range Apply(Range range) const;
+};
+
+// Перенос блока ячеек source на rows строк и cols столбцов в пределах листа.
+// Ссылки на ячейки блока следуют за ними, а ссылки на затёртые ячейки
+// места назначения удаляются.
+struct ReferenceMove {
+    Range source;
+    int rows = 0;
+    int cols = 0;
+
+    // Место назначения блока
+    Range GetTarget() const;
+
+    // Новая позиция; Position::NONE для затёртой ячейки
+    Position Apply(Position pos) const;
+
+    // Диапазон внутри блока переносится вместе с ним, диапазон внутри
+    // затёртых ячеек становится недействительным, остальные не меняются
+    Range Apply(Range range) const;
+};
+
+// Перестановка строк блока при сортировке: строка block.first.row + i
+// переходит в строку block.first.row + rows[i] в тех же столбцах
+struct ReferencePermutation {
+    Range block;
+    std::vector<int> rows;
+
+    // Новая позиция ячейки; позиции вне блока не меняются
+    Position Apply(Position pos) const;
+
+    // Диапазон внутри одной строки блока переносится вместе с ней, остальные
+    // не меняются
+    Range Apply(Range range) const;
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -42,6 +257,7 @@ public:
         Ref,    // ссылка на ячейку с некорректной позицией
         Value,  // ячейка не может быть трактована как число
         Div0,  // в результате вычисления возникло деление на ноль
+        NA,     // функция поиска не нашла значение
     };
 
     FormulaError(Category category);
@@ -78,6 +294,13 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+// Исключение, выбрасываемое при попытке изменить ячейку так, что лист
+// превысит заданный бюджет памяти
+class MemoryBudgetExceededException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
 class CellInterface {
 public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
@@ -105,6 +328,13 @@ public:
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
+// Режим поиска значения в диапазоне
+enum class LookupMode {
+    Exact,           // только равное значение
+    ExactOrLess,     // равное либо наибольшее из меньших
+    ExactOrGreater,  // равное либо наименьшее из больших
+};
+
 // Интерфейс таблицы
 class SheetInterface {
 public:
@@ -148,6 +378,21 @@ public:
     virtual void PrintValues(std::ostream& output) const = 0;
 
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Возвращает лист той же книги с именем name, на ячейки которого ссылаются
+    // формулы вида Лист!A1, либо nullptr. Отдельная таблица других листов не
+    // видит.
+    virtual const SheetInterface* FindSheet(std::string_view /* name */) const {
+        return nullptr;
+    }
+
+    // Ищет key в диапазоне range из одного столбца или одной строки и
+    // возвращает смещение первой подходящей ячейки от начала диапазона либо
+    // nullopt. Числа сравниваются с числами, текст с текстом без учёта
+    // регистра; текст, записывающий число, считается числом. Пустые ячейки
+    // и ошибки не совпадают ни с чем. Реализация по умолчанию просматривает
+    // диапазон целиком.
+    virtual std::optional<int> Lookup(const Range& range, const CellInterface::Value& key, LookupMode mode) const;
 };
 
 // Создаёт готовую к работе пустую таблицу.
@@ -3,12 +3,13 @@
 #include "FormulaAST.h"
 
 #include <algorithm>
+#include <cctype>
 #include <sstream>
 
 using namespace std::literals;
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe) {
-    return output << "#DIV/0!";
+    return output << fe.ToString();
 }
 
 FormulaError::FormulaError(Category category) : category_(category) {}
@@ -29,20 +30,38 @@ std::string_view FormulaError::ToString() const {
             return "#VALUE!";
         case Category::Div0:
             return "#DIV/0!";
+        case Category::NA:
+            return "#N/A";
     }
     return "";
 }
 
 namespace {
-    double GetDoubleFrom(const std::string& str) {
-        double value = 0;
-        if (!str.empty()) {
-            std::istringstream in(str);
-            if (!(in >> value) || !in.eof()) {
-                throw FormulaError(FormulaError::Category::Value);
-            }
+    // Разбирает текст ячейки как число по тем же правилам, что и operator>>
+    // потока: допускаются ведущие пробельные символы и знак, текст должен
+    // быть прочитан целиком.
+    double GetDoubleFrom(std::string_view str) {
+        if (str.empty()) {
+            return 0;
         }
-        return value;
+        auto start = str.find_first_not_of(" \t\n\v\f\r");
+        if (start == std::string_view::npos) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        str.remove_prefix(start);
+        size_t first = str[0] == '-' ? 1 : 0;
+        if (str[0] == '+') {
+            str.remove_prefix(1);
+        }
+        // from_chars понимает inf и nan, а поток — нет
+        if (first == str.size() || !(std::isdigit(static_cast<unsigned char>(str[first])) || str[first] == '.')) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        auto value = ParseDouble(str);
+        if (!value) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        return *value;
     }
 
     double GetDoubleFrom(double value) {
@@ -61,6 +80,49 @@ namespace {
 }
 
 namespace {
+    // Ячейки листа формулы и других листов книги
+    class SheetLookup final : public CellLookup {
+    public:
+        explicit SheetLookup(const SheetInterface& sheet)
+                : sheet_(sheet) {
+        }
+
+        double operator()(std::string_view sheet, Position pos) const override {
+            return GetCellValue(GetCell(sheet, pos));
+        }
+
+        CellInterface::Value GetValue(std::string_view sheet, Position pos) const override {
+            const CellInterface* cell = GetCell(sheet, pos);
+            return cell ? cell->GetValue() : CellInterface::Value{};
+        }
+
+        std::optional<int> Lookup(std::string_view sheet, const Range& range,
+                                  const CellInterface::Value& key, LookupMode mode) const override {
+            return GetSheet(sheet).Lookup(range, key, mode);
+        }
+
+    private:
+        const SheetInterface& GetSheet(std::string_view name) const {
+            if (name.empty()) {
+                return sheet_;
+            }
+            const SheetInterface* target = sheet_.FindSheet(name);
+            if (!target) {
+                throw FormulaError(FormulaError::Category::Ref);
+            }
+            return *target;
+        }
+
+        const CellInterface* GetCell(std::string_view sheet, Position pos) const {
+            if (!pos.IsValid()) {
+                throw FormulaError(FormulaError::Category::Ref);
+            }
+            return GetSheet(sheet).GetCell(pos);
+        }
+
+        const SheetInterface& sheet_;
+    };
+
     class Formula : public FormulaInterface {
     public:
         explicit Formula(std::string expression) try: ast_(ParseFormulaAST(expression)) {
@@ -68,16 +130,13 @@ namespace {
             std::throw_with_nested(FormulaException(ex.what()));
         };
 
+        explicit Formula(FormulaAST ast)
+                : ast_(std::move(ast)) {
+        }
+
         Value Evaluate(const SheetInterface& sheet) const override {
             try {
-                auto cellLookup = [&](Position pos) -> double {
-                    if (!pos.IsValid()) {
-                        throw FormulaError(FormulaError::Category::Ref);
-                    }
-                    const auto* cell = sheet.GetCell(pos);
-                    return GetCellValue(cell);
-                };
-                return ast_.Execute(cellLookup);
+                return ast_.Execute(SheetLookup(sheet));
             } catch (FormulaError& ex) {
                 return ex;
             }
@@ -101,6 +160,56 @@ namespace {
             return cells;
         }
 
+        std::vector<ExternalCell> GetExternalCells() const override {
+            std::vector<ExternalCell> cells;
+            for (const auto& cell : ast_.GetExternalCells()) {
+                if (cell.pos.IsValid()) {
+                    cells.push_back(cell);
+                }
+            }
+            cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+            return cells;
+        }
+
+        std::vector<RangeRef> GetReferencedRanges() const override {
+            std::vector<RangeRef> result;
+            for (const auto& ref : ast_.GetRanges()) {
+                if (ref.range.IsValid()) {
+                    result.push_back(ref);
+                }
+            }
+            std::sort(result.begin(), result.end());
+            result.erase(std::unique(result.begin(), result.end()), result.end());
+            return result;
+        }
+
+        ReferenceShift::Effect ShiftReferences(const ReferenceShift& shift,
+                                               const std::function<bool(std::string_view)>& isTarget) override {
+            return ast_.ShiftReferences(shift, isTarget);
+        }
+
+        ReferenceShift::Effect ShiftReferences(const ReferenceMove& move,
+                                               const std::function<bool(std::string_view)>& isTarget) override {
+            return ast_.ShiftReferences(move, isTarget);
+        }
+
+        ReferenceShift::Effect ShiftReferences(const ReferencePermutation& permutation,
+                                               const std::function<bool(std::string_view)>& isTarget) override {
+            return ast_.ShiftReferences(permutation, isTarget);
+        }
+
+        void ShareSubexpressions(SubexpressionTable* table) override {
+            ast_.ShareSubexpressions(table);
+        }
+
+        std::unique_ptr<FormulaInterface> Copy(int rows, int cols) const override {
+            return std::make_unique<Formula>(ast_.Copy(rows, cols));
+        }
+
+        FormulaMemoryUsage GetMemoryUsage() const override {
+            return {sizeof(*this), ast_.GetAstBytes(), ast_.GetCellListBytes()};
+        }
+
     private:
         FormulaAST ast_;
     };
@@ -2,13 +2,25 @@
 
   #include "common.h"
 
+  #include <functional>
   #include <memory>
+  #include <string_view>
   #include <vector>
 
+  class SubexpressionTable;
+
+  // Память, занятая формулой, в байтах
+  struct FormulaMemoryUsage {
+      size_t object = 0;
+      size_t ast_nodes = 0;
+      size_t cell_list = 0;
+  };
+
   // Формула, позволяющая вычислять и обновлять арифметическое выражение.
   // Поддерживаемые возможности:
   // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
   // * Значения ячеек в качестве переменных: A1+B2*C3
+  // * Функции поиска по диапазонам: MATCH(A1,B1:B100,0), VLOOKUP, XLOOKUP
   // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
   // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
   // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -34,6 +46,57 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает список ячеек других листов книги, задействованных в формуле,
+    // по возрастанию и без повторов.
+    virtual std::vector<ExternalCell> GetExternalCells() const {
+        return {};
+    }
+
+    // Возвращает диапазоны, переданные функциям поиска, по возрастанию и
+    // без повторов.
+    virtual std::vector<RangeRef> GetReferencedRanges() const {
+        return {};
+    }
+
+    // Переносит ссылки на лист, для имени которого isTarget возвращает true
+    // (пустое имя обозначает лист формулы), при вставке и удалении строк и
+    // столбцов. Ссылки на удалённые ячейки становятся #REF!.
+    virtual ReferenceShift::Effect ShiftReferences(const ReferenceShift& /* shift */,
+                                                   const std::function<bool(std::string_view)>& /* isTarget */) {
+        return ReferenceShift::Effect::None;
+    }
+
+    // Переносит ссылки при переносе блока ячеек листа: ссылки на ячейки
+    // блока следуют за ними, ссылки на затёртые ячейки становятся #REF!.
+    virtual ReferenceShift::Effect ShiftReferences(const ReferenceMove& /* move */,
+                                                   const std::function<bool(std::string_view)>& /* isTarget */) {
+        return ReferenceShift::Effect::None;
+    }
+
+    // Переносит ссылки при сортировке строк блока: ссылки на ячейки блока
+    // следуют за своими строками.
+    virtual ReferenceShift::Effect ShiftReferences(const ReferencePermutation& /* permutation */,
+                                                   const std::function<bool(std::string_view)>& /* isTarget */) {
+        return ReferenceShift::Effect::None;
+    }
+
+    // Связывает арифметические подвыражения формулы с общими узлами table
+    // (см. SubexpressionTable) либо, если table пуст, отвязывает их; после
+    // переноса ссылок формула связывается заново. Копия формулы не связана.
+    virtual void ShareSubexpressions(SubexpressionTable* /* table */) {
+    }
+
+    // Возвращает копию формулы для ячейки, отстоящей от исходной на rows
+    // строк и cols столбцов, без повторного разбора: все ссылки смещаются
+    // так же, а ушедшие за пределы листа становятся #REF!.
+    virtual std::unique_ptr<FormulaInterface> Copy(int rows, int cols) const = 0;
+
+    // Возвращает память, занятую формулой. Реализации, не ведущие учёт,
+    // возвращают нули.
+    virtual FormulaMemoryUsage GetMemoryUsage() const {
+        return {};
+    }
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
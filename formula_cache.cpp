@@ -0,0 +1,86 @@
+#include "formula_cache.h"
+
+FormulaCache::FormulaCache(MemoryCounter& memory)
+        : memory_(memory),
+          entries_(Entries::allocator_type(memory, MemoryCategory::FormulaCache)),
+          index_(Index::allocator_type(memory, MemoryCategory::FormulaCache)) {
+}
+
+FormulaCache::~FormulaCache() {
+    SetCapacity(0);
+}
+
+FormulaCache::Parsed FormulaCache::Parse(std::string expression) {
+    if (capacity_ == 0) {
+        auto parsed = ParseFormula(std::move(expression));
+        auto canonical = parsed->GetExpression();
+        return {std::move(parsed), std::move(canonical)};
+    }
+    if (auto it = index_.find(expression); it != index_.end()) {
+        ++hits_;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        const Entry& entry = *it->second;
+        return {entry.formula->Copy(0, 0), entry.expression};
+    }
+
+    ++misses_;
+    auto parsed = ParseFormula(expression);
+    // Память формулы кэша учитывается, пока на неё ссылается хоть одна запись
+    auto usage = parsed->GetMemoryUsage();
+    size_t bytes = usage.object + usage.ast_nodes + usage.cell_list;
+    memory_.Add(MemoryCategory::FormulaCache, bytes);
+    std::shared_ptr<const FormulaInterface> formula(
+            parsed->Copy(0, 0).release(), [&memory = memory_, bytes](const FormulaInterface* released) {
+                memory.Remove(MemoryCategory::FormulaCache, bytes);
+                delete released;
+            });
+    std::string canonical = formula->GetExpression();
+    if (canonical != expression) {
+        Insert(canonical, formula, canonical);
+    }
+    Insert(std::move(expression), std::move(formula), canonical);
+    return {std::move(parsed), std::move(canonical)};
+}
+
+void FormulaCache::SetCapacity(size_t entries) {
+    capacity_ = entries;
+    while (entries_.size() > capacity_) {
+        EvictOldest();
+    }
+    if (capacity_ == 0) {
+        // Выключенный кэш освобождает и таблицу индекса
+        index_ = Index(index_.get_allocator());
+    }
+}
+
+FormulaCache::Stats FormulaCache::GetStats() const {
+    return {entries_.size(), capacity_, hits_, misses_};
+}
+
+void FormulaCache::Insert(std::string text, std::shared_ptr<const FormulaInterface> formula,
+                          const std::string& expression) {
+    if (index_.count(text) > 0) {
+        return;
+    }
+    while (entries_.size() >= capacity_) {
+        EvictOldest();
+    }
+    entries_.push_front({std::move(text), std::move(formula), expression});
+    index_.emplace(entries_.front().text, entries_.begin());
+    Account(entries_.front(), true);
+}
+
+void FormulaCache::EvictOldest() {
+    const Entry& oldest = entries_.back();
+    index_.erase(oldest.text);
+    Account(oldest, false);
+    entries_.pop_back();
+}
+
+void FormulaCache::Account(const Entry& entry, bool add) {
+    if (add) {
+        memory_.Add(MemoryCategory::FormulaCache, StringHeapBytes(entry.text) + StringHeapBytes(entry.expression));
+    } else {
+        memory_.Remove(MemoryCategory::FormulaCache, StringHeapBytes(entry.text) + StringHeapBytes(entry.expression));
+    }
+}
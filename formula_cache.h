@@ -0,0 +1,89 @@
+#pragma once
+
+#include "formula.h"
+#include "memory.h"
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Кэш разбора формул листа: текст формулы отображается в разобранную
+// формулу, и повторный текст — значение, присланное клиентом ещё раз,
+// формула, восстановленная отменой, тысячи одинаковых формул из шаблона —
+// не проходит через ANTLR. Формула в кэше не меняется: ячейка получает её
+// копию (FormulaInterface::Copy без смещения), потому что ссылки формулы
+// ячейки переписываются на месте.
+//
+// Формула доступна по тексту, с которым её задали, и по каноническому
+// выражению, которое возвращает GetText ячейки. Число записей ограничено,
+// при переполнении вытесняется давно не использованная.
+class FormulaCache {
+public:
+    struct Stats {
+        size_t entries = 0;
+        size_t capacity = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+
+        // Доля разборов, взятых из кэша
+        double GetHitRate() const {
+            return hits + misses == 0 ? 0 : static_cast<double>(hits) / static_cast<double>(hits + misses);
+        }
+    };
+
+    // Формула и её каноническое выражение без знака '='
+    struct Parsed {
+        std::unique_ptr<FormulaInterface> formula;
+        std::string expression;
+    };
+
+    static constexpr size_t DEFAULT_CAPACITY = 1024;
+
+    explicit FormulaCache(MemoryCounter& memory);
+
+    FormulaCache(const FormulaCache&) = delete;
+
+    FormulaCache& operator=(const FormulaCache&) = delete;
+
+    ~FormulaCache();
+
+    // Разбирает выражение без знака '=' либо копирует формулу из кэша.
+    // Некорректное выражение бросает FormulaException и не запоминается.
+    Parsed Parse(std::string expression);
+
+    // Ограничивает число записей; ноль выключает кэш
+    void SetCapacity(size_t entries);
+
+    Stats GetStats() const;
+
+private:
+    struct Entry {
+        std::string text;
+        // Записи исходного и канонического текста делят одну формулу
+        std::shared_ptr<const FormulaInterface> formula;
+        std::string expression;
+    };
+
+    // Записи от недавно использованных к давно не использованным
+    using Entries = std::list<Entry, CountingAllocator<Entry>>;
+    // Ключи ссылаются на тексты записей
+    using Index = std::unordered_map<std::string_view, Entries::iterator, std::hash<std::string_view>,
+                                     std::equal_to<std::string_view>,
+                                     CountingAllocator<std::pair<const std::string_view, Entries::iterator>>>;
+
+    void Insert(std::string text, std::shared_ptr<const FormulaInterface> formula, const std::string& expression);
+    void EvictOldest();
+    // Память текстов записи; формулу учитывает её удалитель, узлы
+    // контейнеров — аллокатор
+    void Account(const Entry& entry, bool add);
+
+    MemoryCounter& memory_;
+    Entries entries_;
+    Index index_;
+    size_t capacity_ = DEFAULT_CAPACITY;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
@@ -0,0 +1,178 @@
+#include "lookup_index.h"
+#include "FormulaAST.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+    // Ноль одного знака: -0 и 0 равны и должны давать один хеш
+    LookupKey MakeNumberKey(double value) {
+        return value == 0 ? 0.0 : value;
+    }
+}
+
+std::optional<LookupKey> MakeLookupKey(const CellInterface::Value& value) {
+    if (const auto* number = std::get_if<double>(&value)) {
+        return MakeNumberKey(*number);
+    }
+    const auto* text = std::get_if<std::string>(&value);
+    if (!text || text->empty()) {
+        return std::nullopt;
+    }
+    if (auto number = ParseDouble(*text); number && std::isfinite(*number)) {
+        return MakeNumberKey(*number);
+    }
+    std::string folded(*text);
+    std::transform(folded.begin(), folded.end(), folded.begin(), [](char c) {
+        return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+    });
+    return folded;
+}
+
+std::optional<int> SheetInterface::Lookup(const Range& range, const CellInterface::Value& key,
+                                          LookupMode mode) const {
+    auto target = MakeLookupKey(key);
+    if (!target) {
+        return std::nullopt;
+    }
+    bool column = range.first.col == range.last.col;
+    int length = column ? range.GetSize().rows : range.GetSize().cols;
+    std::optional<int> best;
+    std::optional<LookupKey> bestKey;
+    for (int offset = 0; offset < length; ++offset) {
+        Position pos = column ? Position{range.first.row + offset, range.first.col}
+                              : Position{range.first.row, range.first.col + offset};
+        const CellInterface* cell = GetCell(pos);
+        auto candidate = cell ? MakeLookupKey(cell->GetValue()) : std::nullopt;
+        if (!candidate || candidate->index() != target->index()) {
+            continue;
+        }
+        if (*candidate == *target) {
+            return offset;
+        }
+        bool fits = (mode == LookupMode::ExactOrLess && *candidate < *target)
+                    || (mode == LookupMode::ExactOrGreater && *target < *candidate);
+        bool closer = !bestKey || (mode == LookupMode::ExactOrLess ? *bestKey < *candidate : *candidate < *bestKey);
+        if (fits && closer) {
+            best = offset;
+            bestKey = std::move(candidate);
+        }
+    }
+    return best;
+}
+
+LookupIndex::LookupIndex(MemoryCounter& memory)
+        : memory_(memory),
+          entries_(Entries::allocator_type(memory, MemoryCategory::LookupIndexes)),
+          sorted_(SortedKeys::allocator_type(memory, MemoryCategory::LookupIndexes)) {
+}
+
+LookupIndex::~LookupIndex() {
+    Clear();
+}
+
+void LookupIndex::Insert(const LookupKey& key, int offset) {
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+        Offsets offsets{offset, decltype(Offsets::rest)({memory_, MemoryCategory::LookupIndexes})};
+        it = entries_.try_emplace(key, std::move(offsets)).first;
+        AccountKey(it->first, true);
+        if (sorted_built_) {
+            AccountKey(*sorted_.insert(key).first, true);
+        }
+        return;
+    }
+    auto& offsets = it->second;
+    if (offset < offsets.first) {
+        offsets.rest.insert(offsets.rest.begin(), offsets.first);
+        offsets.first = offset;
+    } else if (offset > offsets.first) {
+        auto position = std::lower_bound(offsets.rest.begin(), offsets.rest.end(), offset);
+        if (position == offsets.rest.end() || *position != offset) {
+            offsets.rest.insert(position, offset);
+        }
+    }
+}
+
+void LookupIndex::Erase(const LookupKey& key, int offset) {
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+        return;
+    }
+    auto& offsets = it->second;
+    if (offset != offsets.first) {
+        auto position = std::lower_bound(offsets.rest.begin(), offsets.rest.end(), offset);
+        if (position != offsets.rest.end() && *position == offset) {
+            offsets.rest.erase(position);
+        }
+        return;
+    }
+    if (!offsets.rest.empty()) {
+        offsets.first = offsets.rest.front();
+        offsets.rest.erase(offsets.rest.begin());
+        return;
+    }
+    if (sorted_built_) {
+        auto sorted = sorted_.find(key);
+        AccountKey(*sorted, false);
+        sorted_.erase(sorted);
+    }
+    AccountKey(it->first, false);
+    entries_.erase(it);
+}
+
+std::optional<int> LookupIndex::Find(const LookupKey& key, LookupMode mode) {
+    if (mode == LookupMode::Exact) {
+        auto it = entries_.find(key);
+        return it == entries_.end() ? std::nullopt : std::optional(it->second.first);
+    }
+    if (!sorted_built_) {
+        for (const auto& [entryKey, offsets] : entries_) {
+            AccountKey(*sorted_.insert(entryKey).first, true);
+        }
+        sorted_built_ = true;
+    }
+    // Числа упорядочены раньше текста, поэтому соседний ключ другого типа
+    // означает, что подходящего нет
+    SortedKeys::const_iterator it;
+    if (mode == LookupMode::ExactOrLess) {
+        it = sorted_.upper_bound(key);
+        if (it == sorted_.begin()) {
+            return std::nullopt;
+        }
+        --it;
+    } else {
+        it = sorted_.lower_bound(key);
+        if (it == sorted_.end()) {
+            return std::nullopt;
+        }
+    }
+    if (it->index() != key.index()) {
+        return std::nullopt;
+    }
+    return entries_.find(*it)->second.first;
+}
+
+void LookupIndex::Clear() {
+    for (const auto& [key, offsets] : entries_) {
+        AccountKey(key, false);
+    }
+    for (const auto& key : sorted_) {
+        AccountKey(key, false);
+    }
+    entries_.clear();
+    sorted_.clear();
+    sorted_built_ = false;
+}
+
+void LookupIndex::AccountKey(const LookupKey& key, bool add) {
+    const auto* text = std::get_if<std::string>(&key);
+    if (!text) {
+        return;
+    }
+    if (add) {
+        memory_.Add(MemoryCategory::LookupIndexes, StringHeapBytes(*text));
+    } else {
+        memory_.Remove(MemoryCategory::LookupIndexes, StringHeapBytes(*text));
+    }
+}
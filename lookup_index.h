@@ -0,0 +1,88 @@
+#pragma once
+
+#include "common.h"
+#include "memory.h"
+
+#include <functional>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+// Ключ поиска: число либо текст, приведённый к нижнему регистру
+using LookupKey = std::variant<double, std::string>;
+
+// Ключ значения ячейки по правилам SheetInterface::Lookup; пустой текст и
+// ошибки ключа не дают
+std::optional<LookupKey> MakeLookupKey(const CellInterface::Value& value);
+
+// Индекс диапазона из одного столбца или одной строки для функций поиска.
+// Хеш-таблица отображает ключ в смещения ячеек с этим ключом, поэтому
+// точный поиск не зависит от длины диапазона.
+// Упорядоченное множество ключей для приблизительного поиска строится при
+// первом таком запросе и дальше поддерживается вместе с таблицей.
+//
+// Лист обновляет индекс при правках текстовых ячеек, а если значение
+// ячейки диапазона вычисляется формулой, помечает индекс устаревшим и
+// строит заново при следующем поиске.
+class LookupIndex {
+public:
+    explicit LookupIndex(MemoryCounter& memory);
+
+    LookupIndex(const LookupIndex&) = delete;
+
+    LookupIndex& operator=(const LookupIndex&) = delete;
+
+    ~LookupIndex();
+
+    // Индекс нужно построить заново; новый индекс устаревший
+    bool IsStale() const {
+        return stale_;
+    }
+
+    void MarkStale() {
+        stale_ = true;
+    }
+
+    // Строит индекс заново: fill вызывает Insert для каждой ячейки диапазона
+    template<typename F>
+    void Rebuild(F fill) {
+        Clear();
+        fill();
+        stale_ = false;
+    }
+
+    // Добавляет ячейку со смещением offset; повторное добавление ничего не меняет
+    void Insert(const LookupKey& key, int offset);
+
+    void Erase(const LookupKey& key, int offset);
+
+    // Смещение первой ячейки с подходящим ключом. Приблизительный поиск
+    // берёт ближайший ключ того же типа независимо от порядка ячеек.
+    std::optional<int> Find(const LookupKey& key, LookupMode mode);
+
+private:
+    // Смещения ячеек с одним ключом. Первое хранится отдельно, поэтому
+    // уникальный ключ не требует выделения памяти под список.
+    struct Offsets {
+        int first;
+        // Остальные смещения по возрастанию
+        std::vector<int, CountingAllocator<int>> rest;
+    };
+
+    using Entries = std::unordered_map<LookupKey, Offsets, std::hash<LookupKey>, std::equal_to<LookupKey>,
+                                       CountingAllocator<std::pair<const LookupKey, Offsets>>>;
+    using SortedKeys = std::set<LookupKey, std::less<LookupKey>, CountingAllocator<LookupKey>>;
+
+    void Clear();
+    // Память текста ключа в куче: контейнеры учитывают только свои узлы
+    void AccountKey(const LookupKey& key, bool add);
+
+    MemoryCounter& memory_;
+    Entries entries_;
+    SortedKeys sorted_;
+    bool sorted_built_ = false;
+    bool stale_ = true;
+};
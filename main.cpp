@@ -2,13 +2,19 @@
 #include "test_runner_p.h"
 #include "FormulaAST.h"
 #include "formula.h"
+#include "sheet.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "workbook.h"
+
+#include <filesystem>
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
 }
 
-inline Position operator "" _pos(const char* str, std::size_t) {
-    return Position::FromString(str);
+inline constexpr Position operator "" _pos(const char* str, std::size_t size) {
+    return Position::FromString({str, size});
 }
 
 inline std::ostream& operator<<(std::ostream& output, Size size) {
@@ -26,6 +32,36 @@ inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value
 
 namespace {
 
+    void TestPositionConversion() {
+        static_assert("A1"_pos == Position{0, 0});
+        static_assert("XFD16384"_pos == Position{16383, 16383});
+        static_assert("XFD1048576"_pos == Position{1048575, 16383});
+        static_assert(!"A1048577"_pos.IsValid());
+        static_assert(!"A0"_pos.IsValid());
+
+        ASSERT_EQUAL("AB12"_pos, (Position{11, 27}))
+        ASSERT_EQUAL("A012"_pos, (Position{11, 0}))
+        ASSERT_EQUAL("ABCD1"_pos, Position::NONE)
+        ASSERT_EQUAL("A"_pos, Position::NONE)
+        ASSERT_EQUAL("12"_pos, Position::NONE)
+        ASSERT_EQUAL("A1B"_pos, Position::NONE)
+        ASSERT_EQUAL("a1"_pos, Position::NONE)
+        ASSERT_EQUAL("A99999999999"_pos, Position::NONE)
+
+        ASSERT_EQUAL((Position{0, 0}).ToString(), "A1")
+        ASSERT_EQUAL((Position{16383, 16383}).ToString(), "XFD16384")
+        ASSERT_EQUAL((Position{1048575, 16383}).ToString(), "XFD1048576")
+        ASSERT_EQUAL((Position{9, 701}).ToString(), "ZZ10")
+        ASSERT_EQUAL((Position{9, 702}).ToString(), "AAA10")
+        ASSERT_EQUAL(Position::NONE.ToString(), "")
+        for (int row = 0; row < Position::MAX_ROWS; row += 3989) {
+            for (int col = 0; col < Position::MAX_COLS; col += 37) {
+                Position pos{row, col};
+                ASSERT_EQUAL(Position::FromString(pos.ToString()), pos)
+            }
+        }
+    }
+
     void TestEmpty() {
         auto sheet = CreateSheet();
         ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
@@ -104,6 +140,510 @@ namespace {
         ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 1}));
     }
 
+    void TestPrintableSizeShrinks() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "a");
+        sheet->SetCell("C5"_pos, "b");
+        sheet->SetCell("E2"_pos, "c");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 5}));
+
+        sheet->SetCell("E2"_pos, "");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 3}));
+
+        sheet->ClearCell("C5"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+
+        sheet->ClearCell("A1"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+    }
+
+    void TestTallSparseSheet() {
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "top");
+        sheet.SetCell("C500000"_pos, "=B1048576*2");
+        sheet.SetCell("B1048576"_pos, "21");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{Position::MAX_ROWS, 3}))
+        ASSERT_EQUAL(sheet.GetCell("C500000"_pos)->GetValue(), CellInterface::Value(42.0))
+
+        // Память растёт с числом ячеек, а не с высотой листа
+        ASSERT(sheet.GetMemoryUsage().grid < 16 * 1024)
+
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        const std::string& printed = texts.str();
+        ASSERT_EQUAL(size_t(std::count(printed.begin(), printed.end(), '\n')), size_t(Position::MAX_ROWS))
+        ASSERT_EQUAL(printed.substr(0, 9), "\ttop\t\n\t\t\n")
+        ASSERT(printed.find("\t\t=B1048576*2\n") != std::string::npos)
+        ASSERT_EQUAL(printed.substr(printed.size() - 5), "\t21\t\n")
+
+        sheet.ClearCell("B1048576"_pos);
+        sheet.ClearCell("C500000"_pos);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 2}))
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        ASSERT_EQUAL(values.str(), "\ttop\n")
+        sheet.ClearCell("B1"_pos);
+        ASSERT_EQUAL(sheet.GetMemoryUsage().grid, 0u)
+    }
+
+    void TestTallFormulaChain() {
+        // Цепочка во всю высоту листа вычисляется и сбрасывается без
+        // рекурсии по ссылкам
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 1; row < Position::MAX_ROWS; ++row) {
+            sheet.SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+        }
+        const CellInterface* bottom = sheet.GetCell("A1048576"_pos);
+        ASSERT_EQUAL(bottom->GetValue(), CellInterface::Value(double(Position::MAX_ROWS)))
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT(!static_cast<const Cell*>(sheet.GetCell("A524288"_pos))->IsCacheValid())
+        ASSERT_EQUAL(bottom->GetValue(), CellInterface::Value(double(Position::MAX_ROWS + 1)))
+    }
+
+    void TestTextInterning() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "USD");
+        sheet.SetCell("A2"_pos, "EUR");
+        sheet.SetCell("A3"_pos, "USD");
+        sheet.SetCell("A4"_pos, "'USD");
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "USD")
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value("USD"))
+
+        auto stats = sheet.GetStringPool().GetStats();
+        ASSERT_EQUAL(stats.unique_strings, 3u)
+        ASSERT_EQUAL(stats.references, 4u)
+        ASSERT_EQUAL(stats.stored_bytes, 10u)
+        ASSERT_EQUAL(stats.referenced_bytes, 13u)
+
+        sheet.SetCell("A1"_pos, "=1");
+        sheet.ClearCell("A3"_pos);
+        sheet.SetCell("A2"_pos, "GBP");
+        stats = sheet.GetStringPool().GetStats();
+        ASSERT_EQUAL(stats.unique_strings, 2u)
+        ASSERT_EQUAL(stats.references, 2u)
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "GBP")
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "'USD")
+    }
+
+    void TestMemoryUsage() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=B1+C1*2");
+        auto usage = sheet.GetMemoryUsage();
+        ASSERT_EQUAL(usage.cells, sizeof(Cell))
+        ASSERT(usage.grid > 0)
+        ASSERT(usage.formulas > 0)
+        ASSERT(usage.ast_nodes > 0)
+        ASSERT(usage.reference_lists > 0)
+        ASSERT(usage.dependencies > 0)
+
+        sheet.SetCell("B1"_pos, "1");
+        ASSERT_EQUAL(sheet.GetMemoryUsage().cells, 2 * sizeof(Cell))
+        sheet.ClearCell("A1"_pos);
+        usage = sheet.GetMemoryUsage();
+        ASSERT_EQUAL(usage.cells, sizeof(Cell))
+        ASSERT_EQUAL(usage.formulas, 0u)
+        ASSERT_EQUAL(usage.ast_nodes, 0u)
+        ASSERT_EQUAL(usage.reference_lists, 0u)
+    }
+
+    void TestMemoryBudget() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "12");
+        sheet.SetCell("A2"_pos, "=A1");
+        sheet.SetMemoryBudget(sheet.GetMemoryUsage().Total());
+
+        std::string long_text(1000, 'x');
+        try {
+            sheet.SetCell("A1"_pos, long_text);
+            ASSERT(false)
+        } catch (const MemoryBudgetExceededException&) {
+        }
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "12")
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(12.0))
+        try {
+            sheet.SetCell("B1"_pos, "=A1+A2");
+            ASSERT(false)
+        } catch (const MemoryBudgetExceededException&) {
+        }
+        ASSERT(sheet.GetCell("B1"_pos) == nullptr)
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 1}))
+
+        // Правки, не увеличивающие память, разрешены
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetMemoryBudget(0);
+        sheet.SetCell("A1"_pos, long_text);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), long_text)
+    }
+
+    void TestSpilling() {
+        // Таблица значений и цепочка формул в первом столбце; тот же лист
+        // без вытеснения служит образцом
+        Sheet reference;
+        Sheet sheet;
+        auto path = (std::filesystem::temp_directory_path() / "spreadsheet_spill_test.bin").string();
+        sheet.EnableSpilling(path, 64 * 1024);
+        auto set = [&](Position pos, const std::string& text) {
+            reference.SetCell(pos, text);
+            sheet.SetCell(pos, text);
+        };
+        // Журнал правок одинаков у обоих листов и не вытесняется
+        auto cellMemory = [](const Sheet& target) {
+            auto usage = target.GetMemoryUsage();
+            return usage.Total() - usage.journal;
+        };
+        for (int row = 0; row < 200; ++row) {
+            set({row, 0}, row == 0 ? "1" : "=" + Position{row - 1, 0}.ToString() + "+1");
+            for (int col = 1; col < 24; ++col) {
+                set({row, col}, "value " + std::to_string(row * 100 + col));
+            }
+        }
+        auto stats = sheet.GetSpillStats();
+        ASSERT(stats.spilled_tiles > 0)
+        ASSERT(stats.evictions > 0)
+        ASSERT(cellMemory(sheet) < cellMemory(reference) / 2)
+
+        // Цепочка не вытесняется и вычисляется без подгрузок
+        uint64_t loads = sheet.GetSpillStats().loads;
+        ASSERT_EQUAL(sheet.GetCell({199, 0})->GetValue(), CellInterface::Value(200.0))
+        ASSERT_EQUAL(sheet.GetSpillStats().loads, loads)
+
+        // Чтение вытесненной ячейки подгружает её плитку
+        ASSERT_EQUAL(sheet.GetCell({3, 13})->GetText(), "value 313")
+        ASSERT(sheet.GetSpillStats().loads > loads)
+        ASSERT(sheet.GetCell({3, 40}) == nullptr)
+
+        sheet.SetCell({5, 7}, "changed");
+        reference.SetCell({5, 7}, "changed");
+        sheet.ClearCell({6, 7});
+        reference.ClearCell({6, 7});
+        std::ostringstream expected;
+        std::ostringstream actual;
+        reference.PrintTexts(expected);
+        sheet.PrintTexts(actual);
+        ASSERT_EQUAL(actual.str(), expected.str())
+        ASSERT(cellMemory(sheet) < cellMemory(reference) / 2)
+
+        // Вытесненная ячейка, на которую сослалась формула, остаётся в памяти
+        set({2, 1}, "5");
+        set({0, 30}, "=B3*2");
+        ASSERT_EQUAL(sheet.GetCell({0, 30})->GetValue(), CellInterface::Value(10.0))
+        for (int i = 0; i < 100; ++i) {
+            sheet.GetCell({i % 200, 1 + i % 23});
+        }
+        ASSERT_EQUAL(sheet.GetCell({0, 30})->GetValue(), CellInterface::Value(10.0))
+        sheet.SetCell({2, 1}, "6");
+        reference.SetCell({2, 1}, "6");
+        ASSERT_EQUAL(sheet.GetCell({0, 30})->GetValue(), CellInterface::Value(12.0))
+        for (int row = 0; row < 200; row += 17) {
+            for (int col = 0; col < 24; col += 5) {
+                ASSERT_EQUAL(sheet.GetCell({row, col})->GetText(), reference.GetCell({row, col})->GetText())
+            }
+        }
+    }
+
+    void TestGetValues() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B2"_pos, "=A1+1");
+        sheet.SetCell("C2"_pos, "text");
+        sheet.SetCell("Z100"_pos, "=1/0");
+
+        int calls = 0;
+        sheet.GetValues("B1"_pos, {3, 3}, [&](const ValuesWindow& window) {
+            ++calls;
+            ASSERT_EQUAL(window.top_left, "B1"_pos)
+            ASSERT_EQUAL(window.values.size(), 9u)
+            ASSERT_EQUAL(window.At(0, 0), CellInterface::Value(""))
+            ASSERT_EQUAL(window.At(1, 0), CellInterface::Value(2.0))
+            ASSERT_EQUAL(window.At(1, 1), CellInterface::Value("text"))
+            ASSERT_EQUAL(window.At(2, 2), CellInterface::Value(""))
+        });
+        ASSERT_EQUAL(calls, 1)
+
+        try {
+            sheet.GetValues({Position::MAX_ROWS - 1, 0}, {2, 1}, [](const ValuesWindow&) {});
+            ASSERT(false)
+        } catch (const InvalidPositionException&) {
+        }
+
+        // Окно над концом длинной устаревшей цепочки вычисляется без рекурсии
+        const int length = 10000;
+        for (int row = 1; row < length; ++row) {
+            sheet.SetCell({row, 5}, "=" + Position{row - 1, 5}.ToString() + "+1");
+        }
+        sheet.SetCell({0, 5}, "1");
+        sheet.GetValues({length - 2, 5}, {2, 1}, [&](const ValuesWindow& window) {
+            ASSERT_EQUAL(window.At(1, 0), CellInterface::Value(double(length)))
+        });
+        ASSERT_EQUAL(sheet.GetCell({length / 2, 5})->GetValue(), CellInterface::Value(length / 2 + 1.0))
+    }
+
+    void TestChangeSubscription() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("A3"_pos, "=A2*2");
+        sheet.SetCell("B1"_pos, "=C1");
+
+        int notifications = 0;
+        auto id = sheet.Subscribe({10, true}, [&] { ++notifications; });
+        sheet.SetCell("A1"_pos, "5");
+        sheet.SetCell("A2"_pos, "=A1+2");
+        ASSERT_EQUAL(notifications, 1)
+        auto batch = sheet.TakeChanges(id);
+        ASSERT(!batch.overflow)
+        ASSERT_EQUAL(batch.positions, (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}))
+        ASSERT_EQUAL(batch.values, (std::vector<CellInterface::Value>{"5", 7.0, 14.0}))
+        ASSERT(sheet.TakeChanges(id).positions.empty())
+
+        // Зависимые ячейки пустой позиции тоже попадают в набор
+        sheet.SetCell("C1"_pos, "3");
+        sheet.ClearCell("C1"_pos);
+        sheet.ClearCell("D1"_pos);
+        ASSERT_EQUAL(notifications, 2)
+        batch = sheet.TakeChanges(id);
+        ASSERT_EQUAL(batch.positions, (std::vector{"B1"_pos, "C1"_pos}))
+        ASSERT_EQUAL(batch.values, (std::vector<CellInterface::Value>{0.0, ""}))
+
+        {
+            Sheet::Batch edits(sheet);
+            sheet.SetCell("E1"_pos, "x");
+            sheet.SetCell("E2"_pos, "y");
+            ASSERT_EQUAL(notifications, 2)
+        }
+        ASSERT_EQUAL(notifications, 3)
+        ASSERT_EQUAL(sheet.TakeChanges(id).positions.size(), 2u)
+
+        for (int row = 0; row < 11; ++row) {
+            sheet.SetCell({row, 7}, "1");
+        }
+        batch = sheet.TakeChanges(id);
+        ASSERT(batch.overflow)
+        ASSERT(batch.positions.empty())
+
+        sheet.Unsubscribe(id);
+        sheet.SetCell("A1"_pos, "6");
+        ASSERT_EQUAL(notifications, 4)
+    }
+
+    void TestDeltaExport() {
+        Sheet source;
+        source.SetCell("A1"_pos, "=B1");
+        source.SetCell("B1"_pos, "text\twith\\tab");
+        source.SetCell("C3"_pos, "3");
+        ASSERT_EQUAL(source.GetVersion(), 3u)
+        // Журнал правок учитывается в памяти листа
+        ASSERT(source.GetMemoryUsage().journal > 0)
+
+        Sheet replica;
+        std::stringstream delta;
+        source.ExportChangesSince(0, delta);
+        ASSERT_EQUAL(replica.ApplyChanges(delta), 3u)
+
+        // Новые тексты A1 и B1 по отдельности замкнули бы цикл со старыми
+        uint64_t synced = source.GetVersion();
+        source.SetCell("A1"_pos, "1");
+        source.SetCell("B1"_pos, "=A1+1");
+        source.ClearCell("C3"_pos);
+        source.SetCell("A1"_pos, "2");
+        delta = std::stringstream();
+        source.ExportChangesSince(synced, delta, true);
+        ASSERT_EQUAL(delta.str(), "SHEET-DELTA\t3\t7\nS\tB1\t=A1+1\t3\nC\tC3\nS\tA1\t2\t2\n")
+        ASSERT_EQUAL(replica.ApplyChanges(delta), 7u)
+
+        std::ostringstream expected, actual;
+        source.PrintTexts(expected);
+        replica.PrintTexts(actual);
+        ASSERT_EQUAL(actual.str(), expected.str())
+        ASSERT_EQUAL(replica.GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0))
+
+        delta = std::stringstream();
+        source.ExportChangesSince(source.GetVersion(), delta);
+        ASSERT_EQUAL(delta.str(), "SHEET-DELTA\t7\t7\n")
+
+        std::istringstream malformed("SHEET-DELTA\t7\t8\nX\tA1\n");
+        try {
+            replica.ApplyChanges(malformed);
+            ASSERT(false)
+        } catch (const std::invalid_argument&) {
+        }
+
+        // Дельта после пропущенной и повторная дельта не применяются
+        source.SetCell("D1"_pos, "8");
+        uint64_t skipped = source.GetVersion();
+        source.SetCell("D2"_pos, "9");
+        for (uint64_t from : {skipped, synced}) {
+            delta = std::stringstream();
+            source.ExportChangesSince(from, delta);
+            try {
+                replica.ApplyChanges(delta);
+                ASSERT(false)
+            } catch (const std::invalid_argument&) {
+            }
+        }
+        ASSERT_EQUAL(replica.GetAppliedVersion(), 7u)
+        ASSERT(replica.GetCell("D2"_pos) == nullptr)
+
+        delta = std::stringstream();
+        source.ExportChangesSince(replica.GetAppliedVersion(), delta);
+        ASSERT_EQUAL(replica.ApplyChanges(delta), 9u)
+        ASSERT_EQUAL(replica.GetCell("D2"_pos)->GetText(), "9")
+    }
+
+    void TestWorkbook() {
+        Workbook workbook(2);
+        auto& main = workbook.AddSheet("Main");
+        auto& data = workbook.AddSheet("Data");
+        ASSERT_EQUAL(workbook.GetSheetNames(), (std::vector<std::string_view>{"Main", "Data"}))
+        ASSERT(workbook.GetSheet("Data") == &data)
+        ASSERT(workbook.GetSheet("Other") == nullptr)
+
+        data.SetCell("A1"_pos, "10");
+        main.SetCell("A1"_pos, "=Data!A1*2+A2");
+        ASSERT_EQUAL(main.GetCell("A1"_pos)->GetText(), "=Data!A1*2+A2")
+        ASSERT_EQUAL(main.GetCell("A1"_pos)->GetReferencedCells(), std::vector{"A2"_pos})
+        ASSERT_EQUAL(main.GetCell("A1"_pos)->GetValue(), CellInterface::Value(20.0))
+        data.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(main.GetCell("A1"_pos)->GetValue(), CellInterface::Value(10.0))
+
+        // Граф зависимостей общий: цикл через два листа обнаруживается
+        data.SetCell("B1"_pos, "=Main!A1");
+        try {
+            main.SetCell("A2"_pos, "=Data!B1");
+            ASSERT(false)
+        } catch (const CircularDependencyException&) {
+        }
+
+        auto id = main.Subscribe();
+        data.ClearCell("A1"_pos);
+        ASSERT_EQUAL(main.TakeChanges(id).positions, std::vector{"A1"_pos})
+        main.Unsubscribe(id);
+
+        main.SetCell("B2"_pos, "=Later!C3+1");
+        ASSERT_EQUAL(main.GetCell("B2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref))
+        auto& later = workbook.AddSheet("Later");
+        ASSERT_EQUAL(main.GetCell("B2"_pos)->GetValue(), CellInterface::Value(1.0))
+        later.SetCell("C3"_pos, "4");
+        ASSERT_EQUAL(main.GetCell("B2"_pos)->GetValue(), CellInterface::Value(5.0))
+
+        for (const char* name : {"", "1st", "Bad name", "Main"}) {
+            try {
+                workbook.AddSheet(name);
+                ASSERT(false)
+            } catch (const std::invalid_argument&) {
+            }
+        }
+
+        Sheet standalone;
+        standalone.SetCell("A1"_pos, "=Main!A1");
+        ASSERT_EQUAL(standalone.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref))
+    }
+
+    void TestWorkbookRecalculate() {
+        Workbook workbook(4);
+        std::vector<Sheet*> sheets;
+        for (int i = 0; i < 6; ++i) {
+            sheets.push_back(&workbook.AddSheet("S" + std::to_string(i)));
+        }
+        for (int i = 0; i < 6; ++i) {
+            auto& sheet = *sheets[i];
+            sheet.SetCell("A1"_pos, std::to_string(i));
+            for (int row = 1; row < 200; ++row) {
+                sheet.SetCell({row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+            }
+        }
+        // S0 и S1 связаны ссылкой, остальные листы независимы
+        sheets[1]->SetCell("B1"_pos, "=S0!A200*2");
+
+        workbook.Recalculate();
+        for (int i = 0; i < 6; ++i) {
+            ASSERT(!sheets[i]->IsStale())
+            ASSERT(static_cast<const Cell*>(sheets[i]->GetCell({199, 0}))->IsCacheValid())
+        }
+        ASSERT_EQUAL(sheets[1]->GetCell("B1"_pos)->GetValue(), CellInterface::Value(398.0))
+
+        sheets[0]->SetCell("A1"_pos, "100");
+        ASSERT(sheets[0]->IsStale())
+        ASSERT(sheets[1]->IsStale())
+        ASSERT(!sheets[2]->IsStale())
+        workbook.Recalculate();
+        ASSERT_EQUAL(sheets[1]->GetCell("B1"_pos)->GetValue(), CellInterface::Value(598.0))
+    }
+
+    void TestProfile() {
+#ifdef SPREADSHEET_PROFILING
+        Sheet sheet;
+        sheet.GetProfiler().SetEnabled(true);
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 1; row < 5; ++row) {
+            sheet.SetCell({row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+        }
+        sheet.SetCell("B1"_pos, "=A5*2");
+        sheet.SetCell("C1"_pos, "=A2");
+
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0))
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0))
+        auto profile = sheet.GetProfile(2);
+        // Цепочка вычисляется снизу вверх, и каждая формула читает вход из
+        // только что заполненного кэша
+        ASSERT_EQUAL(profile.totals.evaluations, 5u)
+        ASSERT_EQUAL(profile.totals.cache_hits, 5u)
+        ASSERT_EQUAL(profile.hottest_cells.size(), 2u)
+        ASSERT_EQUAL(profile.longest_chains.size(), 2u)
+        ASSERT_EQUAL(profile.longest_chains[0],
+                     (std::vector{"B1"_pos, "A5"_pos, "A4"_pos, "A3"_pos, "A2"_pos, "A1"_pos}))
+        ASSERT_EQUAL(profile.longest_chains[1], (std::vector{"C1"_pos, "A2"_pos, "A1"_pos}))
+
+        sheet.GetProfiler().Reset();
+        sheet.SetCell("A1"_pos, "2");
+        profile = sheet.GetProfile();
+        ASSERT_EQUAL(profile.totals.invalidations, 1u)
+        ASSERT_EQUAL(profile.totals.invalidated_cells, 5u)
+        ASSERT_EQUAL(profile.totals.evaluations, 0u)
+
+        sheet.SetCell("A1"_pos, "=D1");
+        profile = sheet.GetProfile();
+        ASSERT_EQUAL(profile.totals.cycle_checks, 1u)
+        ASSERT_EQUAL(profile.totals.cycle_check_visits, 7u)
+#endif
+    }
+
+    void TestTrace() {
+#ifdef SPREADSHEET_TRACING
+        trace::Clear();
+        trace::Start();
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0))
+        sheet.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(6.0))
+        trace::Stop();
+        sheet.SetCell("A3"_pos, "=A2");
+
+        std::ostringstream out;
+        trace::WriteChromeTrace(out);
+        auto json = out.str();
+        auto count = [&](const std::string& needle) {
+            size_t result = 0;
+            for (auto pos = json.find(needle); pos != std::string::npos; pos = json.find(needle, pos + 1)) {
+                ++result;
+            }
+            return result;
+        };
+        ASSERT_EQUAL(count("\"name\":\"SetCell\""), 3u)
+        ASSERT_EQUAL(count("\"name\":\"ParseFormulaAST\""), 1u)
+        ASSERT_EQUAL(count("\"name\":\"Evaluate\""), 2u)
+        ASSERT_EQUAL(count("\"name\":\"CycleCheck\""), 1u)
+        ASSERT_EQUAL(count("\"ph\":\"s\""), 3u)
+        // Второе вычисление A2 связано с правкой A1, сбросившей его кэш
+        ASSERT_EQUAL(count("\"ph\":\"t\""), 2u)
+        ASSERT(json.find("\"cell\":\"A3\"") == std::string::npos)
+        trace::Clear();
+#endif
+    }
+
     void TestErrorValue() {
         auto sheet = CreateSheet();
         sheet->SetCell("E2"_pos, "A1");
@@ -118,7 +658,7 @@ namespace {
     void TestEmptyCellTreatedAsZero() {
         auto sheet = CreateSheet();
         sheet->SetCell("A1"_pos, "=B2");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0))
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0))
     }
 
     void TestFormulaInvalidPosition() {
@@ -133,10 +673,10 @@ namespace {
         };
         try_formula("=X0");
         try_formula("=ABCD1");
-        try_formula("=A123456");
+        try_formula("=A1234567");
         try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
-        try_formula("=XFD16385");
-        try_formula("=XFE16384");
+        try_formula("=XFD1048577");
+        try_formula("=XFE1048576");
         try_formula("=R2D2");
     }
 
@@ -152,7 +692,7 @@ namespace {
                      std::vector{"A1"_pos})
         // Ссылка на пустую ячейку
         sheet->SetCell("B2"_pos, "=B1");
-        ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty())
+        ASSERT(sheet->GetCell("B1"_pos) == nullptr)
         ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(),
                      std::vector{"B1"_pos})
         sheet->SetCell("A2"_pos, "");
@@ -180,6 +720,33 @@ namespace {
         ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready")
     }
 
+    void TestReferenceToUnsetCell() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=ZZ16000+1");
+        ASSERT(sheet->GetCell("ZZ16000"_pos) == nullptr)
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}))
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(1.0))
+
+        sheet->SetCell("ZZ16000"_pos, "5");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0))
+
+        sheet->ClearCell("ZZ16000"_pos);
+        ASSERT(sheet->GetCell("ZZ16000"_pos) == nullptr)
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(1.0))
+
+        bool caught = false;
+        try {
+            sheet->SetCell("ZZ16000"_pos, "=A1");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught)
+        ASSERT(sheet->GetCell("ZZ16000"_pos) == nullptr)
+
+        sheet->SetCell("ZZ16000"_pos, "2");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(3.0))
+    }
+
     void TestFormulaReferences() {
         auto sheet = CreateSheet();
         auto evaluate = [&](std::string expr) {
@@ -210,6 +777,50 @@ namespace {
         ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575)
     }
 
+    void TestNumberParsing() {
+        auto sheet = CreateSheet();
+        auto evaluate = [&](std::string expr) {
+            return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
+        };
+        ASSERT_EQUAL(evaluate(".5"), 0.5)
+        ASSERT_EQUAL(evaluate("1e3"), 1000)
+        ASSERT_EQUAL(evaluate("1.5E-2"), 0.015)
+        ASSERT_EQUAL(evaluate(".25e+1"), 2.5)
+        ASSERT_EQUAL(evaluate("0.1"), 0.1)
+        ASSERT_EQUAL(evaluate("1.7976931348623157e308"), 1.7976931348623157e308)
+        ASSERT_EQUAL(evaluate("4.9406564584124654e-324"), 4.9406564584124654e-324)
+        ASSERT_EQUAL(evaluate("1e-400"), 0)
+        try {
+            ParseFormula("1e400");
+            ASSERT(false)
+        } catch (const FormulaException&) {
+        }
+
+        auto coerce = [&](std::string text) {
+            sheet->SetCell("A1"_pos, std::move(text));
+            return std::visit([](auto value) { return CellInterface::Value(value); },
+                              ParseFormula("A1")->Evaluate(*sheet));
+        };
+        ASSERT_EQUAL(coerce("12"), CellInterface::Value(12.0))
+        ASSERT_EQUAL(coerce(" 12"), CellInterface::Value(12.0))
+        ASSERT_EQUAL(coerce("+3"), CellInterface::Value(3.0))
+        ASSERT_EQUAL(coerce("-.5"), CellInterface::Value(-0.5))
+        ASSERT_EQUAL(coerce("1."), CellInterface::Value(1.0))
+        ASSERT_EQUAL(coerce("2E2"), CellInterface::Value(200.0))
+        ASSERT_EQUAL(coerce("0.30000000000000004"), CellInterface::Value(0.30000000000000004))
+        const CellInterface::Value value_error = FormulaError::Category::Value;
+        ASSERT_EQUAL(coerce("12 "), value_error)
+        ASSERT_EQUAL(coerce("+-1"), value_error)
+        ASSERT_EQUAL(coerce("inf"), value_error)
+        ASSERT_EQUAL(coerce("nan"), value_error)
+        ASSERT_EQUAL(coerce("0x10"), value_error)
+        ASSERT_EQUAL(coerce("1e"), value_error)
+        ASSERT_EQUAL(coerce("."), value_error)
+        ASSERT_EQUAL(coerce(" "), value_error)
+        ASSERT_EQUAL(coerce("1e400"), value_error)
+        ASSERT_EQUAL(coerce("-1e-400"), CellInterface::Value(-0.0))
+    }
+
     void TestFormulaReferencedCells() {
         ASSERT(ParseFormula("1")->GetReferencedCells().empty())
         auto a1 = ParseFormula("A1");
@@ -222,23 +833,865 @@ namespace {
                      (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}))
     }
 
+    void TestLookupFunctions() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "apple");
+        sheet.SetCell("B1"_pos, "1.5");
+        sheet.SetCell("A2"_pos, "Pear");
+        sheet.SetCell("B2"_pos, "2");
+        sheet.SetCell("A3"_pos, "10");
+        sheet.SetCell("B3"_pos, "text");
+        sheet.SetCell("A4"_pos, "20");
+        sheet.SetCell("A5"_pos, "30");
+        sheet.SetCell("B5"_pos, "=B1*2");
+        sheet.SetCell("D1"_pos, "PEAR");
+
+        auto value = [&](const std::string& formula) {
+            sheet.SetCell("E1"_pos, formula);
+            return sheet.GetCell("E1"_pos)->GetValue();
+        };
+        const CellInterface::Value na = FormulaError::Category::NA;
+        ASSERT_EQUAL(value("=MATCH(D1, A1:A5, 0)"), CellInterface::Value(2.0))
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=MATCH(D1,A1:A5,0)")
+        ASSERT_EQUAL(value("=MATCH(25,A1:A5)"), CellInterface::Value(4.0))
+        ASSERT_EQUAL(value("=MATCH(25,A5:A1,-1)"), CellInterface::Value(5.0))
+        ASSERT_EQUAL(value("=MATCH(5,A1:A5,1)"), na)
+        ASSERT_EQUAL(value("=MATCH(10,A1:B5,0)"), na)
+        ASSERT_EQUAL(value("=VLOOKUP(D1,A1:B5,2,0)+1"), CellInterface::Value(3.0))
+        ASSERT_EQUAL(value("=VLOOKUP(30,A1:B5,2,0)"), CellInterface::Value(3.0))
+        ASSERT_EQUAL(value("=VLOOKUP(10,A1:B5,2,0)"), CellInterface::Value(FormulaError::Category::Value))
+        ASSERT_EQUAL(value("=VLOOKUP(10,A1:B5,3,0)"), CellInterface::Value(FormulaError::Category::Ref))
+        ASSERT_EQUAL(value("=XLOOKUP(20,A1:A5,B1:B5)"), CellInterface::Value(0.0))
+        ASSERT_EQUAL(value("=XLOOKUP(99,A1:A5,B1:B5,-1)"), CellInterface::Value(-1.0))
+        ASSERT_EQUAL(value("=XLOOKUP(99,A1:A5,B1:B5)"), na)
+        ASSERT_EQUAL(value("=XLOOKUP(25,A1:A5,B1:B5,0,1)"), CellInterface::Value(3.0))
+        ASSERT_EQUAL(value("=XLOOKUP(25,A1:A5,B1:B4)"), CellInterface::Value(FormulaError::Category::Value))
+
+        std::ostringstream values;
+        sheet.SetCell("E1"_pos, "=MATCH(99,A1:A5,0)");
+        sheet.PrintValues(values);
+        ASSERT(values.str().find("#N/A") != std::string::npos)
+
+        for (const char* formula : {"=MATCH(A1)", "=FIND(A1,A1:A5)", "=A1:A5", "=MATCH(A1:A2,A1:A5)",
+                                    "=MATCH(A1,A2)", "=MATCH(A1,A1:Data!A5)"}) {
+            try {
+                sheet.SetCell("E2"_pos, formula);
+                ASSERT(false)
+            } catch (const FormulaException&) {
+            }
+        }
+
+        // Формула зависит от всего диапазона, в том числе от себя и от
+        // пустых позиций, которые заполнятся позже
+        sheet.SetCell("A6"_pos, "1");
+        sheet.SetCell("F3"_pos, "=MATCH(1,A1:A6,0)");
+        for (const auto& [pos, formula] : {std::pair{"A6"_pos, "=F3"}, std::pair{"F3"_pos, "=XLOOKUP(1,A1:A5,F1:F5)"}}) {
+            try {
+                sheet.SetCell(pos, formula);
+                ASSERT(false)
+            } catch (const CircularDependencyException&) {
+            }
+        }
+        ASSERT_EQUAL(sheet.GetCell("A6"_pos)->GetText(), "1")
+        ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetValue(), CellInterface::Value(6.0))
+
+        // Поиск по индексу совпадает с просмотром диапазона
+        const Range column{"A1"_pos, "A6"_pos};
+        for (const char* key : {"apple", "APPLE", "10", "25", "0", "x", "zzz", ""}) {
+            for (auto mode : {LookupMode::Exact, LookupMode::ExactOrLess, LookupMode::ExactOrGreater}) {
+                CellInterface::Value keyValue = std::string(key);
+                ASSERT(sheet.Lookup(column, keyValue, mode) == sheet.SheetInterface::Lookup(column, keyValue, mode))
+            }
+        }
+    }
+
+    void TestLookupIndexUpdates() {
+        Sheet sheet;
+        for (int row = 0; row < 100; ++row) {
+            sheet.SetCell({row, 0}, "key" + std::to_string(row));
+        }
+        sheet.SetCell("C1"_pos, "key42");
+        sheet.SetCell("B1"_pos, "=MATCH(C1,A1:A100,0)");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(43.0))
+        ASSERT(sheet.GetMemoryUsage().lookup_indexes > 0)
+
+        auto id = sheet.Subscribe();
+        sheet.SetCell("A43"_pos, "other");
+        ASSERT_EQUAL(sheet.TakeChanges(id).positions, (std::vector{"B1"_pos, "A43"_pos}))
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::NA))
+        sheet.SetCell("A90"_pos, "key42");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(90.0))
+        sheet.SetCell("A10"_pos, "KEY42");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0))
+        sheet.ClearCell("A10"_pos);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(90.0))
+        sheet.Unsubscribe(id);
+
+        // Ключ, вычисляемый формулой, меняется вместе с её входами
+        sheet.SetCell("C2"_pos, "7");
+        sheet.SetCell("A5"_pos, "=C2*1");
+        sheet.SetCell("B2"_pos, "=MATCH(7,A1:A100,0)");
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(5.0))
+        sheet.SetCell("C2"_pos, "8");
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::NA))
+        sheet.SetCell("B3"_pos, "=MATCH(8,A1:A100,0)");
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(5.0))
+
+        for (auto pos : {"B1"_pos, "B2"_pos, "B3"_pos}) {
+            sheet.ClearCell(pos);
+        }
+        ASSERT_EQUAL(sheet.GetMemoryUsage().lookup_indexes, 0u)
+
+        // Индекс первого столбца таблицы VLOOKUP переживает формулу MATCH
+        // по тому же столбцу и удаляется вместе с последней формулой
+        sheet.SetCell("D1"_pos, "=MATCH(C1,A1:A100,0)");
+        sheet.SetCell("B90"_pos, "7");
+        sheet.SetCell("D2"_pos, "=VLOOKUP(C1,A1:B100,2,0)");
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(7.0))
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(90.0))
+        size_t indexBytes = sheet.GetMemoryUsage().lookup_indexes;
+        sheet.ClearCell("D1"_pos);
+        ASSERT_EQUAL(sheet.GetMemoryUsage().lookup_indexes, indexBytes)
+        sheet.ClearCell("D2"_pos);
+        ASSERT_EQUAL(sheet.GetMemoryUsage().lookup_indexes, 0u)
+
+        Workbook workbook(2);
+        auto& main = workbook.AddSheet("Main");
+        main.SetCell("A1"_pos, "b");
+        main.SetCell("B1"_pos, "=VLOOKUP(A1,Prices!A1:B3,2,0)");
+        ASSERT_EQUAL(main.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref))
+        auto& prices = workbook.AddSheet("Prices");
+        ASSERT_EQUAL(main.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::NA))
+        prices.SetCell("A2"_pos, "b");
+        prices.SetCell("B2"_pos, "12");
+        ASSERT_EQUAL(main.GetCell("B1"_pos)->GetValue(), CellInterface::Value(12.0))
+        prices.SetCell("B2"_pos, "13");
+        workbook.Recalculate();
+        ASSERT_EQUAL(main.GetCell("B1"_pos)->GetValue(), CellInterface::Value(13.0))
+
+        // Ячейки диапазона поиска могут быть вытеснены, и вычисление поиска
+        // внутри обхода окна подгружает их плитки
+        Sheet spilling;
+        Sheet reference;
+        auto path = (std::filesystem::temp_directory_path() / "spreadsheet_lookup_spill_test.bin").string();
+        spilling.EnableSpilling(path, 64 * 1024);
+        for (auto* target : {&spilling, &reference}) {
+            for (int row = 0; row < 3000; ++row) {
+                target->SetCell({row, 0}, std::to_string(row * 3));
+            }
+            target->SetCell("F1"_pos, "=MATCH(2997,A1:A3000,0)");
+        }
+        ASSERT(spilling.GetSpillStats().spilled_tiles > 0)
+        spilling.GetValues({0, 0}, {3, 6}, [](const ValuesWindow& window) {
+            ASSERT_EQUAL(window.At(0, 0), CellInterface::Value("0"))
+            ASSERT_EQUAL(window.At(1, 0), CellInterface::Value("3"))
+            ASSERT_EQUAL(window.At(2, 0), CellInterface::Value("6"))
+            ASSERT_EQUAL(window.At(0, 5), CellInterface::Value(1000.0))
+        });
+        std::ostringstream expected, actual;
+        reference.PrintValues(expected);
+        spilling.PrintValues(actual);
+        ASSERT_EQUAL(actual.str(), expected.str())
+
+        // Правка находит окна поиска, в которые входит ячейка, среди окон
+        // других строк и диапазона на весь столбец
+        Sheet windows;
+        for (int row = 0; row < 40; ++row) {
+            windows.SetCell({row, 0}, std::to_string(row));
+            windows.SetCell({row, 2}, "=MATCH(" + std::to_string(row + 1) + ",A" + std::to_string(row + 1) + ":A"
+                                      + std::to_string(row + 3) + ",0)");
+        }
+        windows.SetCell("D1"_pos, "=MATCH(30,A1:A40,0)");
+        ASSERT_EQUAL(windows.GetCell("C20"_pos)->GetValue(), CellInterface::Value(2.0))
+        ASSERT_EQUAL(windows.GetCell("D1"_pos)->GetValue(), CellInterface::Value(31.0))
+        windows.SetCell("A21"_pos, "x");
+        ASSERT_EQUAL(windows.GetCell("C19"_pos)->GetValue(), CellInterface::Value(2.0))
+        ASSERT_EQUAL(windows.GetCell("C20"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::NA))
+        ASSERT_EQUAL(windows.GetCell("C21"_pos)->GetValue(), CellInterface::Value(2.0))
+        windows.SetCell("A10"_pos, "30");
+        ASSERT_EQUAL(windows.GetCell("D1"_pos)->GetValue(), CellInterface::Value(10.0))
+        ASSERT_EQUAL(windows.GetCell("C9"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::NA))
+    }
+
+    void TestInsertDeleteRows() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "2");
+        sheet.SetCell("A3"_pos, "=A1+A2");
+        sheet.SetCell("B10"_pos, "=A3*2+A5");
+        sheet.SetCell("C10"_pos, "=MATCH(2,A1:A3,0)");
+        ASSERT_EQUAL(sheet.GetCell("C10"_pos)->GetValue(), CellInterface::Value(2.0))
+        Sheet replica;
+        std::stringstream delta;
+        sheet.ExportChangesSince(0, delta);
+        uint64_t synced = replica.ApplyChanges(delta);
+
+        // Ссылки следуют за ячейками, диапазон со вставкой внутри расширяется
+        auto id = sheet.Subscribe();
+        sheet.InsertRows(1, 2);
+        ASSERT(sheet.TakeChanges(id).overflow)
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr)
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "2")
+        ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetText(), "=A1+A4")
+        ASSERT_EQUAL(sheet.GetCell("B12"_pos)->GetText(), "=A5*2+A7")
+        ASSERT_EQUAL(sheet.GetCell("C12"_pos)->GetText(), "=MATCH(2,A1:A5,0)")
+        ASSERT_EQUAL(sheet.GetCell("B12"_pos)->GetValue(), CellInterface::Value(6.0))
+        ASSERT_EQUAL(sheet.GetCell("C12"_pos)->GetValue(), CellInterface::Value(4.0))
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{12, 3}))
+        sheet.SetCell("A7"_pos, "10");
+        sheet.SetCell("A4"_pos, "5");
+        ASSERT_EQUAL(sheet.GetCell("B12"_pos)->GetValue(), CellInterface::Value(22.0))
+
+        // Ссылки на удалённые ячейки становятся #REF!, а текст формулы
+        // по-прежнему разбирается
+        sheet.DeleteRows(0);
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=#REF!+A3")
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref))
+        ASSERT_EQUAL(sheet.GetCell("B11"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref))
+        ASSERT_EQUAL(sheet.GetCell("C11"_pos)->GetText(), "=MATCH(2,A1:A4,0)")
+        ASSERT_EQUAL(sheet.GetCell("C11"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::NA))
+        sheet.SetCell("A4"_pos, sheet.GetCell("A4"_pos)->GetText());
+        sheet.SetCell("A4"_pos, "=A3");
+        ASSERT_EQUAL(sheet.GetCell("B11"_pos)->GetValue(), CellInterface::Value(20.0))
+
+        sheet.DeleteRows(0, 6);
+        ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), "=#REF!*2+#REF!")
+        ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetText(), "=MATCH(2,#REF!,0)")
+        ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref))
+        sheet.SetCell("C6"_pos, "=MATCH(2,#REF!,0)");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{6, 3}))
+
+        // Дельта передаёт сдвиги до правок ячеек
+        delta = std::stringstream();
+        sheet.ExportChangesSince(synced, delta);
+        ASSERT(delta.str().find("\nI\tROWS\t1\t2\nD\tROWS\t0\t1\nD\tROWS\t0\t6\n") != std::string::npos)
+        replica.ApplyChanges(delta);
+        std::ostringstream expected, actual;
+        sheet.PrintTexts(expected);
+        replica.PrintTexts(actual);
+        ASSERT_EQUAL(actual.str(), expected.str())
+
+        try {
+            sheet.InsertRows(-1);
+            ASSERT(false)
+        } catch (const InvalidPositionException&) {
+        }
+        sheet.SetCell({Position::MAX_ROWS - 1, 0}, "last");
+        try {
+            sheet.InsertRows(0);
+            ASSERT(false)
+        } catch (const InvalidPositionException&) {
+        }
+        sheet.DeleteRows(Position::MAX_ROWS - 1);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{6, 3}))
+    }
+
+    void TestInsertDeleteCols() {
+        Workbook workbook(2);
+        auto& main = workbook.AddSheet("Main");
+        auto& data = workbook.AddSheet("Data");
+        data.SetCell("B1"_pos, "4");
+        data.SetCell("C1"_pos, "5");
+        main.SetCell("A1"_pos, "=Data!B1+Data!C1+Data!D1");
+        main.SetCell("A2"_pos, "=XLOOKUP(5,Data!A1:D1,Data!A1:D1)");
+        data.InsertCols(1);
+        ASSERT_EQUAL(main.GetCell("A1"_pos)->GetText(), "=Data!C1+Data!D1+Data!E1")
+        ASSERT_EQUAL(main.GetCell("A2"_pos)->GetText(), "=XLOOKUP(5,Data!A1:E1,Data!A1:E1)")
+        data.SetCell("E1"_pos, "1");
+        ASSERT_EQUAL(main.GetCell("A1"_pos)->GetValue(), CellInterface::Value(10.0))
+
+        // Переписанные формулы другого листа попадают в его журнал
+        uint64_t version = main.GetVersion();
+        data.DeleteCols(2);
+        ASSERT(main.GetVersion() > version)
+        ASSERT_EQUAL(main.GetCell("A1"_pos)->GetText(), "=#REF!+Data!C1+Data!D1")
+        ASSERT_EQUAL(main.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref))
+        ASSERT_EQUAL(main.GetCell("A2"_pos)->GetValue(), CellInterface::Value(5.0))
+        main.SetCell("A1"_pos, "=Data!C1*2");
+        workbook.Recalculate();
+        ASSERT_EQUAL(main.GetCell("A1"_pos)->GetValue(), CellInterface::Value(10.0))
+        data.DeleteCols(0, 4);
+        ASSERT_EQUAL(main.GetCell("A1"_pos)->GetText(), "=#REF!*2")
+        ASSERT_EQUAL(main.GetCell("A2"_pos)->GetText(), "=XLOOKUP(5,#REF!,#REF!)")
+        ASSERT_EQUAL(main.GetCell("A2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref))
+
+        // Вытесненные плитки переносятся целиком или подгружаются
+        Sheet reference;
+        Sheet sheet;
+        auto path = (std::filesystem::temp_directory_path() / "spreadsheet_shift_test.bin").string();
+        sheet.EnableSpilling(path, 32 * 1024);
+        for (int row = 0; row < 100; ++row) {
+            for (int col = 0; col < 20; ++col) {
+                std::string text = col == 0 && row > 0 ? "=" + Position{row - 1, 0}.ToString() + "+1"
+                                                       : "value " + std::to_string(row * 100 + col);
+                reference.SetCell({row, col}, text);
+                sheet.SetCell({row, col}, text);
+            }
+        }
+        ASSERT(sheet.GetSpillStats().spilled_tiles > 0)
+        for (auto* target : {&reference, &sheet}) {
+            target->InsertRows(16, 8);
+            target->InsertRows(3, 5);
+            target->DeleteRows(40, 3);
+            target->InsertCols(0, 8);
+            target->DeleteCols(10, 1);
+        }
+        std::ostringstream expected, actual;
+        reference.PrintTexts(expected);
+        sheet.PrintTexts(actual);
+        ASSERT_EQUAL(actual.str(), expected.str())
+        ASSERT_EQUAL(sheet.GetCell({109, 8})->GetText(), "=I109+1")
+    }
+
+    void TestCopyRange() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "2");
+        sheet.SetCell("B1"_pos, "=A1*10");
+        sheet.SetCell("B2"_pos, "=Data!A2+MATCH(2,A1:A2,0)");
+        sheet.SetCell("D5"_pos, "old");
+        sheet.SetCell("E5"_pos, "=D5");
+        Sheet replica;
+        std::stringstream delta;
+        sheet.ExportChangesSince(0, delta);
+        uint64_t synced = replica.ApplyChanges(delta);
+
+        // Ссылки смещаются вместе с формулой, пустая позиция источника
+        // очищает позицию блока, а зависимые блока пересчитываются
+        sheet.CopyRange({"A1"_pos, "B3"_pos}, "C4"_pos);
+        ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetText(), "=C4*10")
+        ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetText(), "=Data!C5+MATCH(2,C4:C5,0)")
+        ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetValue(), CellInterface::Value(10.0))
+        ASSERT_EQUAL(sheet.GetCell("E5"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref))
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{5, 5}))
+        sheet.SetCell("C4"_pos, "3");
+        ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetValue(), CellInterface::Value(30.0))
+
+        // Перекрывающиеся блоки: источник снимается до записи; ссылки за
+        // пределами листа становятся #REF!
+        sheet.SetCell("G1"_pos, "=G2+1");
+        sheet.SetCell("G2"_pos, "5");
+        sheet.CopyRange({"G1"_pos, "G2"_pos}, "G2"_pos);
+        ASSERT_EQUAL(sheet.GetCell("G2"_pos)->GetText(), "=G3+1")
+        ASSERT_EQUAL(sheet.GetCell("G3"_pos)->GetText(), "5")
+        ASSERT_EQUAL(sheet.GetCell("G1"_pos)->GetValue(), CellInterface::Value(7.0))
+        sheet.CopyRange({"B1"_pos, "B1"_pos}, "A1"_pos);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=#REF!*10")
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref))
+
+        delta = std::stringstream();
+        sheet.ExportChangesSince(synced, delta);
+        replica.ApplyChanges(delta);
+        std::ostringstream expected, actual;
+        sheet.PrintTexts(expected);
+        replica.PrintTexts(actual);
+        ASSERT_EQUAL(actual.str(), expected.str())
+
+        // Цикл во второй ячейке блока отменяет и первую
+        sheet.SetCell("J1"_pos, "orig");
+        sheet.SetCell("I2"_pos, "=J2");
+        sheet.SetCell("N1"_pos, "first");
+        sheet.SetCell("N2"_pos, "=M2");
+        uint64_t version = sheet.GetVersion();
+        try {
+            sheet.CopyRange({"N1"_pos, "N2"_pos}, "J1"_pos);
+            ASSERT(false)
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet.GetVersion(), version)
+        ASSERT_EQUAL(sheet.GetCell("J1"_pos)->GetText(), "orig")
+        ASSERT(sheet.GetCell("J2"_pos) == nullptr)
+        ASSERT_EQUAL(sheet.GetCell("I2"_pos)->GetValue(), CellInterface::Value(0.0))
+
+        sheet.SetMemoryBudget(sheet.GetMemoryUsage().Total() + 1024);
+        try {
+            sheet.CopyRange({"A1"_pos, "N2"_pos}, "A100"_pos);
+            ASSERT(false)
+        } catch (const MemoryBudgetExceededException&) {
+        }
+        ASSERT_EQUAL(sheet.GetVersion(), version)
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{5, 14}))
+
+        try {
+            sheet.CopyRange({"A1"_pos, "B2"_pos}, {Position::MAX_ROWS - 1, 0});
+            ASSERT(false)
+        } catch (const InvalidPositionException&) {
+        }
+    }
+
+    void TestMoveRange() {
+        Workbook workbook;
+        auto& sheet = workbook.AddSheet("Main");
+        auto& other = workbook.AddSheet("Other");
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("B1"_pos, "=A2*2");
+        sheet.SetCell("D1"_pos, "=MATCH(2,A1:A2,0)");
+        sheet.SetCell("E1"_pos, "old");
+        sheet.SetCell("F1"_pos, "=E1");
+        other.SetCell("A1"_pos, "=Main!A2");
+        Sheet replica;
+        std::stringstream delta;
+        sheet.ExportChangesSince(0, delta);
+        uint64_t synced = replica.ApplyChanges(delta);
+
+        // Ссылки следуют за ячейками, ссылки на затёртые ячейки удаляются
+        sheet.MoveRange({"A1"_pos, "A2"_pos}, "E1"_pos);
+        ASSERT(sheet.GetCell("A1"_pos) == nullptr)
+        ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetText(), "=E1+1")
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=E2*2")
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=MATCH(2,E1:E2,0)")
+        ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetText(), "=#REF!")
+        ASSERT_EQUAL(other.GetCell("A1"_pos)->GetText(), "=Main!E2")
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(4.0))
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(2.0))
+        ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref))
+        sheet.SetCell("E1"_pos, "10");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(22.0))
+        ASSERT_EQUAL(other.GetCell("A1"_pos)->GetValue(), CellInterface::Value(11.0))
+
+        // Перекрывающийся перенос; формула на затёртую ячейку получает #REF!
+        sheet.MoveRange({"E1"_pos, "E2"_pos}, "E2"_pos);
+        ASSERT(sheet.GetCell("E1"_pos) == nullptr)
+        ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetText(), "=E2+1")
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=MATCH(2,E2:E3,0)")
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(22.0))
+        sheet.SetCell("G1"_pos, "=H1");
+        sheet.SetCell("H1"_pos, "5");
+        sheet.MoveRange({"G1"_pos, "G1"_pos}, "H1"_pos);
+        ASSERT_EQUAL(sheet.GetCell("H1"_pos)->GetText(), "=#REF!")
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 8}))
+
+        delta = std::stringstream();
+        sheet.ExportChangesSince(synced, delta);
+        replica.ApplyChanges(delta);
+        std::ostringstream expected, actual;
+        sheet.PrintTexts(expected);
+        replica.PrintTexts(actual);
+        ASSERT_EQUAL(actual.str(), expected.str())
+    }
+
+    void TestClearRange() {
+        Sheet sheet;
+        for (int row = 0; row < 20; ++row) {
+            for (int col = 0; col < 20; ++col) {
+                sheet.SetCell({row, col}, std::to_string(row * 20 + col));
+            }
+        }
+        sheet.SetCell("Z1"_pos, "=B2+1");
+        sheet.SetCell("Z2"_pos, "=MATCH(20,A1:A20,0)");
+        sheet.SetCell("Z3"_pos, "=MATCH(21,B1:B20,0)");
+        ASSERT_EQUAL(sheet.GetCell("Z1"_pos)->GetValue(), CellInterface::Value(22.0))
+        ASSERT_EQUAL(sheet.GetCell("Z2"_pos)->GetValue(), CellInterface::Value(2.0))
+        auto id = sheet.Subscribe();
+        uint64_t version = sheet.GetVersion();
+
+        sheet.ClearRange({"B1"_pos, "T20"_pos});
+        ASSERT_EQUAL(sheet.GetVersion(), version + 19 * 20)
+        ASSERT(sheet.GetCell("B2"_pos) == nullptr)
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "20")
+        ASSERT_EQUAL(sheet.GetCell("Z1"_pos)->GetValue(), CellInterface::Value(1.0))
+        ASSERT_EQUAL(sheet.GetCell("Z2"_pos)->GetValue(), CellInterface::Value(2.0))
+        ASSERT_EQUAL(sheet.GetCell("Z3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::NA))
+        auto batch = sheet.TakeChanges(id);
+        ASSERT_EQUAL(batch.positions.size(), 19u * 20 + 2)
+        ASSERT(std::find(batch.positions.begin(), batch.positions.end(), "Z2"_pos) == batch.positions.end())
+
+        sheet.ClearRange({"A1"_pos, "Y20"_pos});
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 26}))
+        sheet.ClearRange({"Z1"_pos, "Z3"_pos});
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}))
+        version = sheet.GetVersion();
+        sheet.ClearRange({"A1"_pos, "C3"_pos});
+        ASSERT_EQUAL(sheet.GetVersion(), version)
+        try {
+            sheet.ClearRange({"B1"_pos, "A1"_pos});
+            ASSERT(false)
+        } catch (const InvalidPositionException&) {
+        }
+    }
+
+    void TestSortRange() {
+        Workbook book;
+        Sheet& sheet = book.AddSheet("Main");
+        Sheet& other = book.AddSheet("Other");
+        const char* names[] = {"pear", "apple", "Fig", "kiwi", "Date"};
+        const char* scores[] = {"3", "1", "=2+2", "", "1"};
+        for (int row = 0; row < 5; ++row) {
+            std::string number = std::to_string(row + 1);
+            sheet.SetCell({row, 0}, names[row]);
+            if (*scores[row]) {
+                sheet.SetCell({row, 1}, scores[row]);
+            }
+            sheet.SetCell({row, 2}, "=B" + number + "*2");
+        }
+        sheet.SetCell("E1"_pos, "=B2");
+        sheet.SetCell("E2"_pos, "=MATCH(4,B1:B5,0)");
+        sheet.SetCell("E3"_pos, "=MATCH(1,A2:C2,0)");
+        other.SetCell("A1"_pos, "=Main!B3");
+        ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetValue(), CellInterface::Value(3.0))
+        ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetValue(), CellInterface::Value(2.0))
+        Sheet replica;
+        std::stringstream delta;
+        sheet.ExportChangesSince(0, delta);
+        replica.ApplyChanges(delta);
+        uint64_t synced = sheet.GetVersion();
+
+        // Равные ключи сохраняют порядок, пустой ключ идёт последним
+        sheet.SortRange({"A1"_pos, "C5"_pos}, {{1}});
+        auto column = [&sheet](int col) {
+            std::vector<std::string> texts;
+            for (int row = 0; row < 5; ++row) {
+                const CellInterface* cell = sheet.GetCell({row, col});
+                texts.push_back(cell ? cell->GetText() : "");
+            }
+            return texts;
+        };
+        ASSERT_EQUAL(column(0), (std::vector<std::string>{"apple", "Date", "pear", "Fig", "kiwi"}))
+        ASSERT_EQUAL(column(2), (std::vector<std::string>{"=B1*2", "=B2*2", "=B3*2", "=B4*2", "=B5*2"}))
+        ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetValue(), CellInterface::Value(8.0))
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=B1")
+        ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetValue(), CellInterface::Value(4.0))
+        ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetText(), "=MATCH(1,A1:C1,0)")
+        ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetValue(), CellInterface::Value(2.0))
+        ASSERT_EQUAL(other.GetCell("A1"_pos)->GetText(), "=Main!B4")
+        ASSERT_EQUAL(other.GetCell("A1"_pos)->GetValue(), CellInterface::Value(4.0))
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{5, 5}))
+
+        sheet.SortRange({"A1"_pos, "C5"_pos}, {{1, true}, {0, true}});
+        ASSERT_EQUAL(column(0), (std::vector<std::string>{"Fig", "pear", "Date", "apple", "kiwi"}))
+        // Текст сравнивается без учёта регистра
+        sheet.SortRange({"A1"_pos, "C5"_pos}, {{0}});
+        ASSERT_EQUAL(column(0), (std::vector<std::string>{"apple", "Date", "Fig", "kiwi", "pear"}))
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=B1")
+        ASSERT_EQUAL(other.GetCell("A1"_pos)->GetText(), "=Main!B3")
+        uint64_t version = sheet.GetVersion();
+        sheet.SortRange({"A1"_pos, "C5"_pos}, {{0}});
+        ASSERT_EQUAL(sheet.GetVersion(), version)
+
+        delta = std::stringstream();
+        sheet.ExportChangesSince(synced, delta);
+        replica.ApplyChanges(delta);
+        std::ostringstream expected, actual;
+        sheet.PrintTexts(expected);
+        replica.PrintTexts(actual);
+        ASSERT_EQUAL(actual.str(), expected.str())
+
+        try {
+            sheet.SortRange({"A1"_pos, "C5"_pos}, {{3}});
+            ASSERT(false)
+        } catch (const InvalidPositionException&) {
+        }
+        try {
+            sheet.SortRange({"A1"_pos, "C5"_pos}, {});
+            ASSERT(false)
+        } catch (const std::invalid_argument&) {
+        }
+    }
+
+    void TestSortRangeParallel() {
+        const int rows = 20000;
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell({row, 0}, std::to_string(row * 7919 % 1000));
+            sheet.SetCell({row, 1}, std::to_string(row));
+        }
+        ThreadPool pool(4);
+        sheet.SortRange({{0, 0}, {rows - 1, 1}}, {{0}}, &pool);
+        for (int row = 1; row < rows; ++row) {
+            double previous = std::stod(sheet.GetCell({row - 1, 0})->GetText());
+            double current = std::stod(sheet.GetCell({row, 0})->GetText());
+            ASSERT(previous <= current)
+            if (previous == current) {
+                ASSERT(std::stoi(sheet.GetCell({row - 1, 1})->GetText()) < std::stoi(sheet.GetCell({row, 1})->GetText()))
+            }
+        }
+    }
+
+    void TestRecalculateSlice() {
+        const int rows = 500;
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell({row, 0}, std::to_string(row));
+            sheet.SetCell({row, 1}, "=A" + std::to_string(row + 1) + "*2");
+        }
+        auto cached = [&sheet](Position pos) {
+            return dynamic_cast<const Cell*>(sheet.GetCell(pos))->IsCacheValid();
+        };
+        ASSERT(sheet.IsStale())
+        // При нулевом бюджете квант вычисляет одну ячейку
+        ASSERT(sheet.RecalculateSlice(std::chrono::nanoseconds(0)) == RecalcStatus::Paused)
+        ASSERT(cached("B1"_pos))
+        ASSERT(!cached("B2"_pos))
+
+        // Правка уже пройденной ячейки: обход повторяется
+        sheet.SetCell("A1"_pos, "10");
+        RecalcStatus status;
+        int slices = 1;
+        while ((status = sheet.RecalculateSlice(std::chrono::nanoseconds(0))) == RecalcStatus::Paused) {
+            ++slices;
+        }
+        ASSERT(status == RecalcStatus::Done)
+        ASSERT(slices >= rows)
+        ASSERT(!sheet.IsStale())
+        for (int row = 0; row < rows; ++row) {
+            ASSERT(cached({row, 1}))
+        }
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0))
+        ASSERT(sheet.RecalculateSlice(std::chrono::nanoseconds(0)) == RecalcStatus::Done)
+
+        sheet.SetCell("A2"_pos, "5");
+        CancellationToken token;
+        token.Cancel();
+        ASSERT(sheet.RecalculateSlice(std::chrono::seconds(1), token) == RecalcStatus::Cancelled)
+        ASSERT(sheet.IsStale())
+        ASSERT(!cached("B2"_pos))
+    }
+
+    void TestRecalculateAsync() {
+        const int rows = 20000;
+        Workbook book(2);
+        Sheet& data = book.AddSheet("Data");
+        Sheet& sheet = book.AddSheet("Main");
+        data.SetCell("B1"_pos, "1");
+        for (int row = 0; row < rows; ++row) {
+            data.SetCell({row, 0}, std::to_string(row));
+            sheet.SetCell({row, 0}, "=Data!A" + std::to_string(row + 1) + "+Data!B1");
+        }
+
+        // Чтение во время пересчёта видит ячейки вычисленными целиком
+        auto future = sheet.RecalculateAsync(CancellationToken(), std::chrono::microseconds(100));
+        for (int row = rows - 1; row >= 0; row -= 97) {
+            ASSERT_EQUAL(sheet.GetCell({row, 0})->GetValue(), CellInterface::Value(row + 1.0))
+        }
+        ASSERT(future.get() == RecalcStatus::Done)
+        ASSERT(!sheet.IsStale())
+
+        // Правка другого листа книги вытесняет идущий пересчёт
+        future = sheet.RecalculateAsync();
+        data.SetCell("B1"_pos, "2");
+        RecalcStatus status = future.get();
+        ASSERT(status == RecalcStatus::Cancelled || status == RecalcStatus::Done)
+        ASSERT(sheet.IsStale())
+        future = sheet.RecalculateAsync();
+        ASSERT(future.get() == RecalcStatus::Done)
+        ASSERT_EQUAL(sheet.GetCell({rows - 1, 0})->GetValue(), CellInterface::Value(rows + 1.0))
+
+        data.SetCell("B1"_pos, "3");
+        CancellationToken token;
+        future = sheet.RecalculateAsync(token, std::chrono::microseconds(1));
+        token.Cancel();
+        status = future.get();
+        ASSERT(status == RecalcStatus::Cancelled || status == RecalcStatus::Done)
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(3.0))
+
+        // Книга останавливает незавершённый пересчёт до удаления листов
+        data.SetCell("B1"_pos, "4");
+        sheet.RecalculateAsync();
+    }
+
+    void TestSharedSubexpressions() {
+        Sheet sheet;
+        sheet.SetCell("C4"_pos, "4");
+        sheet.SetCell("C5"_pos, "6");
+        sheet.SetCell("A1"_pos, "=(C5-C4)/C4*10");
+        ASSERT_EQUAL(sheet.GetSubexpressionStats().nodes, 0u)
+        // Имеющиеся формулы связываются при включении, новые — при разборе
+        sheet.EnableSubexpressionSharing();
+        sheet.SetCell("A2"_pos, "=(C5-C4)/C4+1");
+        sheet.SetCell("A3"_pos, "=1+(C5-C4)/C4");
+        auto stats = sheet.GetSubexpressionStats();
+        ASSERT_EQUAL(stats.nodes, 5u)
+        ASSERT_EQUAL(stats.shared_nodes, 2u)
+        ASSERT(sheet.GetMemoryUsage().subexpressions > 0)
+
+        // Общее (C5-C4)/C4 вычисляется один раз
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(5.0))
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(1.5))
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(1.5))
+        stats = sheet.GetSubexpressionStats();
+        ASSERT_EQUAL(stats.evaluations, 5u)
+        ASSERT_EQUAL(stats.hits, 2u)
+
+        // Значения сбрасываются правкой и очисткой входа
+        sheet.SetCell("C4"_pos, "2");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(20.0))
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(3.0))
+        sheet.ClearCell("C5"_pos);
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(0.0))
+        sheet.ClearRange({"C4"_pos, "C4"_pos});
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError(FormulaError::Category::Div0)))
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError(FormulaError::Category::Div0)))
+        sheet.SetCell("C4"_pos, "=B1*2");
+        sheet.SetCell("C5"_pos, "10");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError(FormulaError::Category::Div0)))
+        // Вход-формула сбрасывает узлы через свои входы
+        sheet.SetCell("B1"_pos, "1");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(40.0))
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(5.0))
+
+        // После сдвига строк формулы связываются с узлами по новым ссылкам
+        sheet.InsertRows(0);
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=(C6-C5)/C5*10")
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(40.0))
+        sheet.SetCell("C6"_pos, "6");
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(20.0))
+        // Узлы формул столбца A и узел B2*2 формулы C5
+        sheet.SetCell("A5"_pos, "=C6-C5");
+        ASSERT_EQUAL(sheet.GetSubexpressionStats().nodes, 6u)
+        ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetValue(), CellInterface::Value(4.0))
+        sheet.DeleteRows(5);
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Ref)))
+        ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Ref)))
+
+        // Узлы удаляются вместе с последней формулой и при выключении
+        sheet.ClearRange({"A1"_pos, "A5"_pos});
+        ASSERT_EQUAL(sheet.GetSubexpressionStats().nodes, 1u)
+        sheet.EnableSubexpressionSharing(false);
+        ASSERT_EQUAL(sheet.GetSubexpressionStats().nodes, 0u)
+        ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetValue(), CellInterface::Value(2.0))
+
+        // Ссылки на другие листы и функции не разделяются, аргументы функций — да
+        Workbook book;
+        Sheet& data = book.AddSheet("Data");
+        Sheet& report = book.AddSheet("Report");
+        data.SetCell("A1"_pos, "3");
+        report.SetCell("B1"_pos, "3");
+        report.SetCell("A1"_pos, "=Data!A1*2");
+        report.SetCell("A2"_pos, "=MATCH(B1*1,Data!A1:A2,0)+B1*1");
+        report.EnableSubexpressionSharing();
+        ASSERT_EQUAL(report.GetSubexpressionStats().nodes, 1u)
+        ASSERT_EQUAL(report.GetCell("A2"_pos)->GetValue(), CellInterface::Value(4.0))
+        data.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(10.0))
+        report.SetCell("B1"_pos, "5");
+        ASSERT_EQUAL(report.GetCell("A2"_pos)->GetValue(), CellInterface::Value(6.0))
+    }
+
+    void TestFormulaCache() {
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "2");
+        sheet.SetCell("A1"_pos, "=B1+1");
+        sheet.SetCell("A2"_pos, "=B1+1");
+        auto stats = sheet.GetFormulaCache().GetStats();
+        ASSERT_EQUAL(stats.misses, 1u)
+        ASSERT_EQUAL(stats.hits, 1u)
+        ASSERT_EQUAL(stats.entries, 1u)
+        ASSERT(sheet.GetMemoryUsage().formula_cache > 0)
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(3.0))
+
+        // Текст, прочитанный из ячейки, совпадает с каноническим выражением
+        sheet.SetCell("A3"_pos, "=(B1)+(2)");
+        ASSERT_EQUAL(sheet.GetFormulaCache().GetStats().entries, 3u)
+        sheet.SetCell("A4"_pos, sheet.GetCell("A3"_pos)->GetText());
+        ASSERT_EQUAL(sheet.GetFormulaCache().GetStats().hits, 2u)
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(4.0))
+
+        // Ячейка получает копию: перенос её ссылок не меняет формулу кэша
+        sheet.InsertRows(0);
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=B2+1")
+        sheet.SetCell("A6"_pos, "=B1+1");
+        ASSERT_EQUAL(sheet.GetCell("A6"_pos)->GetText(), "=B1+1")
+        ASSERT_EQUAL(sheet.GetCell("A6"_pos)->GetValue(), CellInterface::Value(1.0))
+        ASSERT_EQUAL(sheet.GetFormulaCache().GetStats().hits, 3u)
+
+        // Ошибки разбора не запоминаются, а циклическая формула из кэша
+        // отвергается так же, как разобранная
+        try {
+            sheet.SetCell("C1"_pos, "=1+");
+            ASSERT(false)
+        } catch (const FormulaException&) {
+        }
+        ASSERT_EQUAL(sheet.GetFormulaCache().GetStats().entries, 3u)
+        try {
+            sheet.SetCell("B1"_pos, "=B1+1");
+            ASSERT(false)
+        } catch (const CircularDependencyException&) {
+        }
+
+        // Ёмкость ограничивает число записей, вытесняются давно не использованные
+        sheet.GetFormulaCache().SetCapacity(2);
+        ASSERT_EQUAL(sheet.GetFormulaCache().GetStats().entries, 2u)
+        sheet.SetCell("C2"_pos, "=B1+1");
+        sheet.SetCell("C3"_pos, "=B1*3");
+        sheet.SetCell("C4"_pos, "=B1+1");
+        stats = sheet.GetFormulaCache().GetStats();
+        ASSERT_EQUAL(stats.entries, 2u)
+        ASSERT_EQUAL(stats.hits, 6u)
+        sheet.GetFormulaCache().SetCapacity(0);
+        ASSERT_EQUAL(sheet.GetFormulaCache().GetStats().entries, 0u)
+        ASSERT_EQUAL(sheet.GetMemoryUsage().formula_cache, 0u)
+        sheet.SetCell("C5"_pos, "=B1+1");
+        ASSERT_EQUAL(sheet.GetFormulaCache().GetStats().hits, 6u)
+        ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetValue(), CellInterface::Value(1.0))
+
+        // Формула отменённой правки остаётся в кэше, но не расходует бюджет:
+        // небольшие правки после отказов проходят
+        Sheet limited;
+        limited.SetCell("A1"_pos, "1");
+        limited.SetMemoryBudget(limited.GetMemoryUsage().Total() + 400);
+        for (int i = 0; i < 5; ++i) {
+            try {
+                limited.SetCell({i + 1, 1}, "=A1+" + std::to_string(i) + "+A1*A1+A1/2+A1-A1*3");
+                ASSERT(false)
+            } catch (const MemoryBudgetExceededException&) {
+            }
+        }
+        ASSERT(limited.GetFormulaCache().GetStats().entries > 0)
+        limited.SetCell("C1"_pos, "2");
+        ASSERT_EQUAL(limited.GetCell("C1"_pos)->GetText(), "2")
+    }
+
 }  // namespace
 
 int main() {
     TestRunner tr;
+    RUN_TEST(tr, TestPositionConversion);
     RUN_TEST(tr, TestEmpty);
     RUN_TEST(tr, TestInvalidPosition);
     RUN_TEST(tr, TestSetCellPlainText);
     RUN_TEST(tr, TestClearCell);
     RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestPrintableSizeShrinks);
+    RUN_TEST(tr, TestTallSparseSheet);
+    RUN_TEST(tr, TestTallFormulaChain);
+    RUN_TEST(tr, TestTextInterning);
+    RUN_TEST(tr, TestMemoryUsage);
+    RUN_TEST(tr, TestMemoryBudget);
+    RUN_TEST(tr, TestSpilling);
+    RUN_TEST(tr, TestGetValues);
+    RUN_TEST(tr, TestChangeSubscription);
+    RUN_TEST(tr, TestDeltaExport);
+    RUN_TEST(tr, TestWorkbook);
+    RUN_TEST(tr, TestWorkbookRecalculate);
+    RUN_TEST(tr, TestProfile);
+    RUN_TEST(tr, TestTrace);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestReferenceToUnsetCell);
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaArithmetic);
+    RUN_TEST(tr, TestNumberParsing);
     RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestLookupFunctions);
+    RUN_TEST(tr, TestLookupIndexUpdates);
+    RUN_TEST(tr, TestInsertDeleteRows);
+    RUN_TEST(tr, TestInsertDeleteCols);
+    RUN_TEST(tr, TestCopyRange);
+    RUN_TEST(tr, TestMoveRange);
+    RUN_TEST(tr, TestClearRange);
+    RUN_TEST(tr, TestSortRange);
+    RUN_TEST(tr, TestSortRangeParallel);
+    RUN_TEST(tr, TestRecalculateSlice);
+    RUN_TEST(tr, TestRecalculateAsync);
+    RUN_TEST(tr, TestSharedSubexpressions);
+    RUN_TEST(tr, TestFormulaCache);
     return 0;
 }
   
\ No newline at end of file
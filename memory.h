@@ -0,0 +1,133 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+// Учёт памяти листа по категориям. Контейнеры листа и ячеек выделяют
+// память через CountingAllocator, остальные объекты учитываются явно при
+// создании и удалении. Итог доступен за O(1), поэтому лист может
+// проверять бюджет памяти при каждой правке.
+
+enum class MemoryCategory {
+    Grid,            // плитки хранилища ячеек листа
+    Cells,           // объекты Cell
+    Formulas,        // объекты формул вместе с кэшем значения
+    Text,            // тексты формул
+    AstNodes,        // узлы деревьев разбора формул
+    ReferenceLists,  // узлы списков ячеек, на которые ссылаются формулы
+    Dependencies,    // множества зависимостей между ячейками
+    LookupIndexes,   // индексы диапазонов для функций поиска
+    Subexpressions,  // общие подвыражения формул
+    FormulaCache,    // кэш разбора формул
+    Journal,         // журнал правок для выгрузки изменений
+    COUNT,
+};
+
+class MemoryCounter {
+public:
+    void Add(MemoryCategory category, size_t bytes) {
+        bytes_[static_cast<size_t>(category)] += bytes;
+        total_ += bytes;
+    }
+
+    void Remove(MemoryCategory category, size_t bytes) {
+        bytes_[static_cast<size_t>(category)] -= bytes;
+        total_ -= bytes;
+    }
+
+    size_t Get(MemoryCategory category) const {
+        return bytes_[static_cast<size_t>(category)];
+    }
+
+    size_t GetTotal() const {
+        return total_;
+    }
+
+private:
+    std::array<size_t, static_cast<size_t>(MemoryCategory::COUNT)> bytes_{};
+    size_t total_ = 0;
+};
+
+// Память, которую строка заняла в куче; короткие строки хранятся в
+// самом объекте строки и кучу не занимают
+inline size_t StringHeapBytes(const std::string& str) {
+    return str.capacity() > std::string().capacity() ? str.capacity() + 1 : 0;
+}
+
+// Аллокатор, сообщающий счётчику о каждом выделении и освобождении.
+// Аллокатор без счётчика ничего не учитывает.
+template<typename T>
+class CountingAllocator {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    CountingAllocator() = default;
+
+    CountingAllocator(MemoryCounter& counter, MemoryCategory category)
+            : counter_(&counter), category_(category) {
+    }
+
+    template<typename U>
+    CountingAllocator(const CountingAllocator<U>& other)
+            : counter_(other.counter_), category_(other.category_) {
+    }
+
+    T* allocate(size_t n) {
+        T* result = std::allocator<T>().allocate(n);
+        if (counter_) {
+            counter_->Add(category_, n * sizeof(T));
+        }
+        return result;
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (counter_) {
+            counter_->Remove(category_, n * sizeof(T));
+        }
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template<typename U>
+    bool operator==(const CountingAllocator<U>& rhs) const {
+        return counter_ == rhs.counter_ && category_ == rhs.category_;
+    }
+
+    template<typename U>
+    bool operator!=(const CountingAllocator<U>& rhs) const {
+        return !(*this == rhs);
+    }
+
+private:
+    template<typename U>
+    friend class CountingAllocator;
+
+    MemoryCounter* counter_ = nullptr;
+    MemoryCategory category_ = MemoryCategory::Grid;
+};
+
+// Память листа по категориям, в байтах
+struct SheetMemoryUsage {
+    size_t grid = 0;
+    size_t cells = 0;
+    size_t formulas = 0;
+    // Тексты ячеек в пуле строк и тексты формул
+    size_t text = 0;
+    size_t ast_nodes = 0;
+    size_t reference_lists = 0;
+    size_t dependencies = 0;
+    size_t lookup_indexes = 0;
+    size_t subexpressions = 0;
+    size_t formula_cache = 0;
+    size_t journal = 0;
+
+    size_t Total() const {
+        return grid + cells + formulas + text + ast_nodes + reference_lists + dependencies + lookup_indexes
+               + subexpressions + formula_cache + journal;
+    }
+};
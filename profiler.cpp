@@ -0,0 +1,120 @@
+#include "profiler.h"
+
+#include <iostream>
+
+Profiler::EvaluationScope::EvaluationScope(Profiler& profiler, Position pos)
+        : profiler_(profiler.IsEnabled() ? &profiler : nullptr), pos_(pos) {
+    if (profiler_) {
+        profiler_->nested_seconds_.push_back(0);
+        start_ = std::chrono::steady_clock::now();
+    }
+}
+
+Profiler::EvaluationScope::~EvaluationScope() {
+    if (!profiler_) {
+        return;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_;
+    double nested = profiler_->nested_seconds_.back();
+    profiler_->nested_seconds_.pop_back();
+    if (!profiler_->nested_seconds_.empty()) {
+        profiler_->nested_seconds_.back() += elapsed.count();
+    }
+
+    auto& stats = profiler_->GetStats(pos_);
+    ++stats.evaluations;
+    stats.total_seconds += elapsed.count();
+    stats.self_seconds += elapsed.count() - nested;
+}
+
+void Profiler::Reset() {
+    cells_.clear();
+    nested_seconds_.clear();
+}
+
+void Profiler::Shift(const ReferenceShift& shift) {
+    Remap(shift);
+}
+
+void Profiler::Move(const ReferenceMove& move) {
+    Remap(move);
+}
+
+void Profiler::Permute(const ReferencePermutation& permutation) {
+    Remap(permutation);
+}
+
+template<typename Map>
+void Profiler::Remap(const Map& remap) {
+    decltype(cells_) cells;
+    cells.reserve(cells_.size());
+    for (auto& [pos, stats] : cells_) {
+        Position moved = remap.Apply(pos);
+        if (moved.IsValid()) {
+            stats.pos = moved;
+            cells.emplace(moved, stats);
+        }
+    }
+    cells_ = std::move(cells);
+}
+
+void Profiler::RecordCacheHit(Position pos) {
+    ++GetStats(pos).cache_hits;
+}
+
+void Profiler::RecordInvalidation(Position pos, size_t invalidated) {
+    auto& stats = GetStats(pos);
+    ++stats.invalidations;
+    stats.invalidated_cells += invalidated;
+}
+
+void Profiler::RecordCycleCheck(Position pos, size_t visited, double seconds) {
+    auto& stats = GetStats(pos);
+    ++stats.cycle_checks;
+    stats.cycle_check_visits += visited;
+    stats.cycle_check_seconds += seconds;
+}
+
+std::vector<CellProfile> Profiler::GetCells() const {
+    std::vector<CellProfile> cells;
+    cells.reserve(cells_.size());
+    for (const auto& [pos, stats] : cells_) {
+        cells.push_back(stats);
+    }
+    return cells;
+}
+
+CellProfile& Profiler::GetStats(Position pos) {
+    auto& stats = cells_[pos];
+    stats.pos = pos;
+    return stats;
+}
+
+void SheetProfile::Print(std::ostream& out) const {
+    out << "evaluations: " << totals.evaluations
+        << ", cache hits: " << totals.cache_hits
+        << ", evaluation time: " << totals.self_seconds << " s\n"
+        << "invalidations: " << totals.invalidations
+        << ", invalidated cells: " << totals.invalidated_cells << '\n'
+        << "cycle checks: " << totals.cycle_checks
+        << ", visited cells: " << totals.cycle_check_visits
+        << ", time: " << totals.cycle_check_seconds << " s\n";
+
+    out << "hottest cells:\n";
+    for (const auto& cell : hottest_cells) {
+        out << "  " << cell.pos.ToString()
+            << "\tself " << cell.self_seconds << " s"
+            << "\ttotal " << cell.total_seconds << " s"
+            << "\tevaluations " << cell.evaluations
+            << "\tcache hits " << cell.cache_hits << '\n';
+    }
+
+    out << "longest dependency chains:\n";
+    for (const auto& chain : longest_chains) {
+        out << "  " << chain.size() << ':';
+        for (const auto& pos : chain) {
+            out << ' ' << pos.ToString();
+        }
+        out << '\n';
+    }
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <unordered_map>
+#include <vector>
+
+// Профилировщик пересчёта листа. Точки замера в ячейках компилируются
+// только при определённом SPREADSHEET_PROFILING; во время работы
+// профилировщик включается методом SetEnabled() и до этого обходится
+// одной проверкой флага.
+
+struct CellProfile {
+    Position pos = Position::NONE;
+    // Вычисления формулы (промахи кэша)
+    uint64_t evaluations = 0;
+    uint64_t cache_hits = 0;
+    // Изменения ячейки и число сброшенных ими кэшей зависимых ячеек
+    uint64_t invalidations = 0;
+    uint64_t invalidated_cells = 0;
+    // Проверки циклов при записи формулы и число посещённых ячеек
+    uint64_t cycle_checks = 0;
+    uint64_t cycle_check_visits = 0;
+    double cycle_check_seconds = 0;
+    // Время вычисления формулы вместе с вычислением ячеек, на которые она
+    // ссылается, и без него
+    double total_seconds = 0;
+    double self_seconds = 0;
+};
+
+struct SheetProfile {
+    // Суммы по всем ячейкам
+    CellProfile totals;
+    // Ячейки с наибольшим собственным временем вычисления
+    std::vector<CellProfile> hottest_cells;
+    // Самые длинные цепочки зависимостей: от зависимой ячейки к исходной
+    std::vector<std::vector<Position>> longest_chains;
+
+    void Print(std::ostream& out) const;
+};
+
+class Profiler {
+public:
+    // Замеряет вычисление формулы ячейки. Время вложенных вычислений
+    // вычитается из собственного времени ячейки.
+    class EvaluationScope {
+    public:
+        EvaluationScope(Profiler& profiler, Position pos);
+
+        EvaluationScope(const EvaluationScope&) = delete;
+
+        EvaluationScope& operator=(const EvaluationScope&) = delete;
+
+        ~EvaluationScope();
+
+    private:
+        Profiler* profiler_;
+        Position pos_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    void SetEnabled(bool enabled) {
+        enabled_ = enabled;
+    }
+
+    bool IsEnabled() const {
+        return enabled_;
+    }
+
+    void Reset();
+
+    // Переносит статистику вместе с ячейками при вставке и удалении строк и
+    // столбцов; статистика удалённых ячеек отбрасывается
+    void Shift(const ReferenceShift& shift);
+
+    // То же при переносе блока ячеек; статистика затёртых ячеек отбрасывается
+    void Move(const ReferenceMove& move);
+
+    // То же при сортировке строк блока
+    void Permute(const ReferencePermutation& permutation);
+
+    void RecordCacheHit(Position pos);
+
+    void RecordInvalidation(Position pos, size_t invalidated);
+
+    void RecordCycleCheck(Position pos, size_t visited, double seconds);
+
+    // Статистика всех ячеек, для которых что-либо было замерено
+    std::vector<CellProfile> GetCells() const;
+
+private:
+    CellProfile& GetStats(Position pos);
+    template<typename Map>
+    void Remap(const Map& remap);
+
+    bool enabled_ = false;
+    std::unordered_map<Position, CellProfile, PositionHasher> cells_;
+    // Время вложенных вычислений для каждого уровня текущего стека вычислений
+    std::vector<double> nested_seconds_;
+};
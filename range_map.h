@@ -0,0 +1,210 @@
+#pragma once
+
+#include "common.h"
+#include "memory.h"
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Упорядоченное отображение диапазонов листа в значения с поиском всех
+// диапазонов, содержащих позицию, за O(log R + найденные). Строки листа
+// делятся пополам до отдельных строк: узел дерева отрезков покрывает
+// отрезок строк длиной в степень двойки, и диапазон хранится в O(log)
+// узлах, которые вместе покрывают его строки. Поиск проходит узлы от
+// строки позиции до корня и сверяет с позицией только столбцы диапазонов.
+//
+// Интерфейс повторяет нужную листу часть std::map: узел дерева хранит
+// итератор элемента, поэтому все изменения идут через методы RangeMap.
+template<typename T>
+class RangeMap {
+public:
+    using Map = std::map<Range, T, std::less<Range>, CountingAllocator<std::pair<const Range, T>>>;
+    using allocator_type = typename Map::allocator_type;
+    using iterator = typename Map::iterator;
+    using const_iterator = typename Map::const_iterator;
+    using node_type = typename Map::node_type;
+    using insert_return_type = typename Map::insert_return_type;
+
+    explicit RangeMap(const allocator_type& allocator)
+            : map_(allocator),
+              nodes_(typename Nodes::allocator_type(allocator)) {
+    }
+
+    RangeMap(const RangeMap&) = delete;
+
+    RangeMap& operator=(const RangeMap&) = delete;
+
+    iterator begin() {
+        return map_.begin();
+    }
+
+    iterator end() {
+        return map_.end();
+    }
+
+    const_iterator begin() const {
+        return map_.begin();
+    }
+
+    const_iterator end() const {
+        return map_.end();
+    }
+
+    bool empty() const {
+        return map_.empty();
+    }
+
+    size_t size() const {
+        return map_.size();
+    }
+
+    iterator find(const Range& range) {
+        return map_.find(range);
+    }
+
+    const_iterator find(const Range& range) const {
+        return map_.find(range);
+    }
+
+    iterator lower_bound(const Range& range) {
+        return map_.lower_bound(range);
+    }
+
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const Range& range, Args&&... args) {
+        auto result = map_.try_emplace(range, std::forward<Args>(args)...);
+        if (result.second) {
+            Link(result.first);
+        }
+        return result;
+    }
+
+    iterator erase(iterator it) {
+        Unlink(it);
+        return map_.erase(it);
+    }
+
+    node_type extract(iterator it) {
+        Unlink(it);
+        return map_.extract(it);
+    }
+
+    insert_return_type insert(node_type&& node) {
+        auto result = map_.insert(std::move(node));
+        if (result.inserted) {
+            Link(result.position);
+        }
+        return result;
+    }
+
+    // Вызывает f(iterator) для каждого диапазона, содержащего pos
+    template<typename F>
+    void ForEachContaining(Position pos, F f) {
+        ForEachStored(pos, f);
+    }
+
+    template<typename F>
+    void ForEachContaining(Position pos, F f) const {
+        ForEachStored(pos, [&f](iterator it) {
+            f(const_iterator(it));
+        });
+    }
+
+private:
+    // Высота дерева: листья — отдельные строки листа
+    static constexpr int DEPTH = 20;
+    static constexpr int ROWS = Position::MAX_ROWS;
+    static constexpr uint32_t LEAVES = uint32_t(1) << DEPTH;
+    static_assert(ROWS <= int(LEAVES));
+
+    using Bucket = std::vector<iterator, CountingAllocator<iterator>>;
+    // Узлы дерева нумеруются как в двоичной куче: корень — 1, лист строки
+    // row — LEAVES + row. Хранятся только узлы с диапазонами.
+    using Nodes = std::unordered_map<uint32_t, Bucket, std::hash<uint32_t>, std::equal_to<uint32_t>,
+                                     CountingAllocator<std::pair<const uint32_t, Bucket>>>;
+
+    // Вызывает f(node, level) для узлов, которые вместе покрывают строки range
+    template<typename F>
+    static void ForEachNode(const Range& range, F f) {
+        uint32_t lo = LEAVES + static_cast<uint32_t>(range.first.row);
+        uint32_t hi = LEAVES + static_cast<uint32_t>(range.last.row) + 1;
+        for (int level = DEPTH; lo < hi; --level, lo >>= 1, hi >>= 1) {
+            if (lo & 1) {
+                f(lo++, level);
+            }
+            if (hi & 1) {
+                f(--hi, level);
+            }
+        }
+    }
+
+    // Узлы хранят итераторы изменяемого отображения, константный поиск
+    // приводит их к const_iterator
+    template<typename F>
+    void ForEachStored(Position pos, F&& f) const {
+        if (map_.empty() || pos.row < 0 || pos.row >= ROWS) {
+            return;
+        }
+        uint32_t node = LEAVES + static_cast<uint32_t>(pos.row);
+        for (int level = DEPTH; level >= 0; --level, node >>= 1) {
+            if (level_sizes_[level] == 0) {
+                continue;
+            }
+            auto bucket = nodes_.find(node);
+            if (bucket == nodes_.end()) {
+                continue;
+            }
+            for (iterator it : bucket->second) {
+                if (it->first.first.col <= pos.col && pos.col <= it->first.last.col) {
+                    f(it);
+                }
+            }
+        }
+    }
+
+    // Недействительный диапазон не содержит позиций листа и в дереве не хранится
+    void Link(iterator it) {
+        if (!it->first.IsValid()) {
+            return;
+        }
+        ForEachNode(it->first, [&](uint32_t node, int level) {
+            nodes_.try_emplace(node, typename Bucket::allocator_type(nodes_.get_allocator()))
+                    .first->second.push_back(it);
+            ++level_sizes_[level];
+        });
+    }
+
+    void Unlink(iterator it) {
+        if (!it->first.IsValid()) {
+            return;
+        }
+        ForEachNode(it->first, [&](uint32_t node, int level) {
+            auto bucket = nodes_.find(node);
+            auto& entries = bucket->second;
+            for (auto& entry : entries) {
+                if (entry == it) {
+                    entry = entries.back();
+                    entries.pop_back();
+                    break;
+                }
+            }
+            if (entries.empty()) {
+                nodes_.erase(bucket);
+            }
+            --level_sizes_[level];
+        });
+        if (nodes_.empty()) {
+            // Пустое дерево освобождает и таблицу узлов
+            nodes_ = Nodes(nodes_.get_allocator());
+        }
+    }
+
+    Map map_;
+    Nodes nodes_;
+    // Число записей в узлах каждого уровня: поиск пропускает пустые уровни
+    std::array<size_t, DEPTH + 1> level_sizes_{};
+};
@@ -1,31 +1,346 @@
 #include "sheet.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "workbook.h"
 
 #include <algorithm>
+#include <charconv>
+#include <cstdlib>
 #include <iostream>
+#include <numeric>
 #include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <variant>
 
 using namespace std::literals;
 
-Sheet::~Sheet() {}
+namespace {
+    void ChangeCount(std::map<int, int>& counts, int index, int delta) {
+        auto& count = counts[index];
+        count += delta;
+        if (count == 0) {
+            counts.erase(index);
+        }
+    }
+
+    int GetExtent(const std::map<int, int>& counts) {
+        return counts.empty() ? 0 : counts.rbegin()->first + 1;
+    }
+
+    const std::string_view DELTA_HEADER = "SHEET-DELTA";
+    const std::string_view SHIFT_ROWS = "ROWS";
+    const std::string_view SHIFT_COLS = "COLS";
+
+    // Меньшие части сортировки не окупают передачу потокам пула
+    const int MIN_PARALLEL_SORT_ROWS = 4096;
+
+    // Поля дельты не содержат табуляций и переводов строк
+    void WriteEscaped(std::ostream& output, std::string_view text) {
+        for (char c : text) {
+            switch (c) {
+                case '\\':
+                    output << "\\\\";
+                    break;
+                case '\t':
+                    output << "\\t";
+                    break;
+                case '\n':
+                    output << "\\n";
+                    break;
+                case '\r':
+                    output << "\\r";
+                    break;
+                default:
+                    output << c;
+            }
+        }
+    }
+
+    std::string Unescape(std::string_view text) {
+        std::string result;
+        result.reserve(text.size());
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (text[i] != '\\') {
+                result += text[i];
+                continue;
+            }
+            if (++i == text.size()) {
+                throw std::invalid_argument("Malformed delta: dangling escape");
+            }
+            switch (text[i]) {
+                case '\\':
+                    result += '\\';
+                    break;
+                case 't':
+                    result += '\t';
+                    break;
+                case 'n':
+                    result += '\n';
+                    break;
+                case 'r':
+                    result += '\r';
+                    break;
+                default:
+                    throw std::invalid_argument("Malformed delta: unknown escape");
+            }
+        }
+        return result;
+    }
+
+    std::vector<std::string_view> SplitFields(std::string_view line) {
+        std::vector<std::string_view> fields;
+        size_t start = 0;
+        while (true) {
+            size_t tab = line.find('\t', start);
+            fields.push_back(line.substr(start, tab - start));
+            if (tab == std::string_view::npos) {
+                return fields;
+            }
+            start = tab + 1;
+        }
+    }
+
+    uint64_t ParseVersion(std::string_view field) {
+        uint64_t version = 0;
+        auto [end, error] = std::from_chars(field.data(), field.data() + field.size(), version);
+        if (error != std::errc() || end != field.data() + field.size()) {
+            throw std::invalid_argument("Malformed delta: bad version");
+        }
+        return version;
+    }
+
+    int ParseIndex(std::string_view field, int limit) {
+        int index = 0;
+        auto [end, error] = std::from_chars(field.data(), field.data() + field.size(), index);
+        if (error != std::errc() || end != field.data() + field.size() || index < 0 || index > limit) {
+            throw std::invalid_argument("Malformed delta: bad index");
+        }
+        return index;
+    }
+}
+
+Sheet::Sheet(Workbook& workbook, std::string name)
+        : workbook_(&workbook), name_(std::move(name)), sync_(&workbook.GetRecalcSync()) {
+}
+
+Sheet::~Sheet() {
+    StopRecalculation();
+}
 
 void Sheet::SetCell(Position pos, std::string text) {
+    StopBackgroundWork();
     IsValidPosition(pos);
-    InsertRows(pos);
-    auto& cell = cells_[pos.row][pos.col];
-    if (!cell) {
-        cell = std::make_unique<Cell>(*this);
+#ifdef SPREADSHEET_TRACING
+    trace::Edit edit("SetCell", pos);
+#endif
+    {
+        SpillPause pause(*this);
+        if (memory_budget_ == 0) {
+            DoSetCell(pos, std::move(text));
+        } else {
+            DoSetCellWithinBudget(pos, std::move(text));
+        }
+        RecordChange(pos);
+    }
+    cells_.EvictCold();
+}
+
+void Sheet::DoSetCellWithinBudget(Position pos, std::string text) {
+    std::optional<std::string> oldText;
+    if (const auto* cell = FindCell(pos)) {
+        oldText = cell->GetText();
+    }
+    size_t before = GetBudgetedMemory();
+    DoSetCell(pos, std::move(text));
+    size_t after = GetBudgetedMemory();
+    if (after > memory_budget_ && after > before) {
+        // Прежнее содержимое уже стояло в графе, поэтому восстанавливается без ошибок
+        if (oldText) {
+            DoSetCell(pos, std::move(*oldText));
+        } else {
+            DoClearCell(pos);
+        }
+        throw MemoryBudgetExceededException("Sheet memory budget exceeded");
     }
-    cell->Set(text);
-    ResizePrintableArea(pos);
 }
 
-void Sheet::ResizePrintableArea(const Position& pos) {
-    if (pos.row + 1 > printable_size_.rows) {
-        printable_size_.rows = pos.row + 1;
+template<typename Content>
+void Sheet::DoSetCell(Position pos, Content content, CountChanges* counts) {
+    Cell* cell = cells_.Find(pos);
+    bool wasEmpty = !cell || cell->IsEmpty();
+    if (cell) {
+        cell->Set(std::move(content));
+        cells_.MarkDirty(pos);
+    } else {
+        cell = &cells_.Insert(pos, std::make_unique<Cell>(*this, pos));
+        if (auto it = unset_refs_.find(pos); it != unset_refs_.end()) {
+            cell->AttachDependents(std::move(it->second));
+            unset_refs_.erase(it);
+        }
+        try {
+            cell->Set(std::move(content));
+        } catch (...) {
+            ReleaseCell(pos);
+            throw;
+        }
     }
-    if (pos.col + 1 > printable_size_.cols) {
-        printable_size_.cols = pos.col + 1;
+    if (counts) {
+        counts->Add(pos, wasEmpty, cell->IsEmpty());
+    } else {
+        UpdatePrintableArea(pos, wasEmpty, cell->IsEmpty());
+    }
+}
+
+void Sheet::AddUnsetRef(Position pos, Cell* dependent) {
+    auto it = unset_refs_.find(pos);
+    if (it == unset_refs_.end()) {
+        it = unset_refs_.emplace(pos, CellSet(GetDependencyAllocator())).first;
+    }
+    it->second.insert(dependent);
+}
+
+void Sheet::RemoveUnsetRef(Position pos, Cell* dependent) {
+    auto it = unset_refs_.find(pos);
+    if (it == unset_refs_.end()) {
+        return;
+    }
+    it->second.erase(dependent);
+    if (it->second.empty()) {
+        unset_refs_.erase(it);
+    }
+}
+
+void Sheet::AddRangeRef(const Range& range, Cell* dependent) {
+    auto it = range_refs_.find(range);
+    if (it == range_refs_.end()) {
+        it = range_refs_.try_emplace(range, CellSet(GetDependencyAllocator())).first;
+    }
+    it->second.insert(dependent);
+}
+
+bool Sheet::RemoveRangeRef(const Range& range, Cell* dependent) {
+    auto it = range_refs_.find(range);
+    if (it == range_refs_.end() || !it->second.erase(dependent)) {
+        return false;
+    }
+    if (it->second.empty()) {
+        range_refs_.erase(it);
+        // Формулы диапазона строят индексы с его левым верхним углом: по
+        // самому диапазону или по первому столбцу таблицы VLOOKUP. Индекс,
+        // который больше не покрыт ни одним диапазоном формул, не понадобится.
+        for (auto index = lookup_indexes_.lower_bound({range.first, range.first});
+             index != lookup_indexes_.end() && index->first.first == range.first;) {
+            bool used = false;
+            range_refs_.ForEachContaining(range.first, [&](RangeRefs::iterator ref) {
+                used = used || ref->first.Contains(index->first.last);
+            });
+            index = used ? std::next(index) : lookup_indexes_.erase(index);
+        }
+    }
+    return true;
+}
+
+void Sheet::UpdateLookupIndexes(const Cell& cell, bool inserted) {
+    Position pos = cell.GetPosition();
+    std::optional<LookupKey> key;
+    bool keyReady = false;
+    lookup_indexes_.ForEachContaining(pos, [&](LookupIndexes::iterator it) {
+        const Range& range = it->first;
+        LookupIndex& index = it->second;
+        if (index.IsStale()) {
+            return;
+        }
+        if (cell.HasFormula()) {
+            index.MarkStale();
+            return;
+        }
+        if (!keyReady) {
+            key = MakeLookupKey(cell.GetValue());
+            keyReady = true;
+        }
+        if (key) {
+            // Диапазон индекса — одна строка или один столбец
+            int offset = pos.row - range.first.row + pos.col - range.first.col;
+            inserted ? index.Insert(*key, offset) : index.Erase(*key, offset);
+        }
+    });
+}
+
+void Sheet::InvalidateLookupIndexes(Position pos) {
+    lookup_indexes_.ForEachContaining(pos, [](LookupIndexes::iterator it) {
+        it->second.MarkStale();
+    });
+}
+
+std::optional<int> Sheet::Lookup(const Range& range, const CellInterface::Value& key, LookupMode mode) const {
+    auto lock = LockForRead();
+    if (range.first.row != range.last.row && range.first.col != range.last.col) {
+        return SheetInterface::Lookup(range, key, mode);
+    }
+    auto target = MakeLookupKey(key);
+    if (!target) {
+        return std::nullopt;
+    }
+#ifdef SPREADSHEET_TRACING
+    trace::Scope scope("Lookup", range.first);
+#endif
+    auto& index = lookup_indexes_.try_emplace(range, memory_).first->second;
+    if (index.IsStale()) {
+        index.Rebuild([&] {
+            cells_.ForEachInWindow(range.first, range.GetSize(), [&](Position pos, const Cell& cell) {
+                if (auto cellKey = MakeLookupKey(cell.GetValue())) {
+                    index.Insert(*cellKey, pos.row - range.first.row + pos.col - range.first.col);
+                }
+            });
+        });
+    }
+    return index.Find(*target, mode);
+}
+
+void Sheet::ReleaseCell(Position pos) {
+    auto cell = cells_.Extract(pos);
+    auto dependents = cell->DetachDependents();
+    if (!dependents.empty()) {
+        unset_refs_.insert_or_assign(pos, std::move(dependents));
+    }
+}
+
+void Sheet::UpdatePrintableArea(Position pos, bool wasEmpty, bool isEmpty) {
+    if (wasEmpty == isEmpty) {
+        return;
+    }
+    int delta = isEmpty ? -1 : 1;
+    ChangeCount(row_counts_, pos.row, delta);
+    ChangeCount(col_counts_, pos.col, delta);
+    printable_size_ = {GetExtent(row_counts_), GetExtent(col_counts_)};
+}
+
+void Sheet::CountChanges::Add(Position pos, bool wasEmpty, bool isEmpty) {
+    if (wasEmpty != isEmpty) {
+        int delta = isEmpty ? -1 : 1;
+        // Блок обходится по строкам, поэтому строка обычно последняя в rows
+        if (!rows.empty() && rows.rbegin()->first == pos.row) {
+            rows.rbegin()->second += delta;
+        } else {
+            rows[pos.row] += delta;
+        }
+        cols[pos.col] += delta;
+    }
+}
+
+void Sheet::UpdatePrintableArea(const CountChanges& counts) {
+    for (const auto& [row, delta] : counts.rows) {
+        if (delta != 0) {
+            ChangeCount(row_counts_, row, delta);
+        }
+    }
+    for (const auto& [col, delta] : counts.cols) {
+        if (delta != 0) {
+            ChangeCount(col_counts_, col, delta);
+        }
     }
+    printable_size_ = {GetExtent(row_counts_), GetExtent(col_counts_)};
 }
 
 void Sheet::IsValidPosition(const Position& pos) const {
@@ -35,11 +350,10 @@ void Sheet::IsValidPosition(const Position& pos) const {
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
+    auto lock = LockForRead();
     IsValidPosition(pos);
-    if (pos.row >= int(cells_.size()) || pos.col >= int(cells_[pos.row].size())) {
-        return nullptr;
-    }
-    return cells_[pos.row][pos.col].get();
+    cells_.EvictCold();
+    return FindCell(pos);
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
@@ -47,18 +361,562 @@ CellInterface* Sheet::GetCell(Position pos) {
 }
 
 void Sheet::ClearCell(Position pos) {
+    StopBackgroundWork();
     IsValidPosition(pos);
-    if (IsCellInTable(pos)) {
-        if (auto& cell = cells_[pos.row][pos.col]) {
-            cell->Clear();
-            if (!cell->IsReferenced()) {
-                cell.reset();
+#ifdef SPREADSHEET_TRACING
+    trace::Edit edit("ClearCell", pos);
+#endif
+    {
+        SpillPause pause(*this);
+        if (!FindCell(pos)) {
+            return;
+        }
+        DoClearCell(pos);
+        RecordChange(pos);
+    }
+    cells_.EvictCold();
+}
+
+void Sheet::DoClearCell(Position pos) {
+    if (Cell* cell = cells_.Find(pos)) {
+        bool wasEmpty = cell->IsEmpty();
+        cell->Clear();
+        ReleaseCell(pos);
+        UpdatePrintableArea(pos, wasEmpty, true);
+    }
+}
+
+void Sheet::InsertRows(int row, int count) {
+    ShiftCells(ReferenceShift::Axis::Rows, row, count, /* insert = */ true);
+}
+
+void Sheet::DeleteRows(int row, int count) {
+    ShiftCells(ReferenceShift::Axis::Rows, row, count, /* insert = */ false);
+}
+
+void Sheet::InsertCols(int col, int count) {
+    ShiftCells(ReferenceShift::Axis::Cols, col, count, /* insert = */ true);
+}
+
+void Sheet::DeleteCols(int col, int count) {
+    ShiftCells(ReferenceShift::Axis::Cols, col, count, /* insert = */ false);
+}
+
+void Sheet::ShiftCells(ReferenceShift::Axis axis, int first, int count, bool insert) {
+    StopBackgroundWork();
+    bool rows = axis == ReferenceShift::Axis::Rows;
+    int limit = rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (first < 0 || first >= limit || count < 0 || (!insert && count > limit - first)) {
+        throw InvalidPositionException("Invalid rows or columns");
+    }
+    int extent = rows ? printable_size_.rows : printable_size_.cols;
+    if (insert && extent > first && count > limit - extent) {
+        throw InvalidPositionException("Cells would be shifted off the sheet");
+    }
+    if (count == 0) {
+        return;
+    }
+    ReferenceShift shift{axis, first, insert ? count : -count};
+#ifdef SPREADSHEET_TRACING
+    trace::Edit edit(rows ? (insert ? "InsertRows" : "DeleteRows") : (insert ? "InsertCols" : "DeleteCols"),
+                     rows ? Position{first, 0} : Position{0, first});
+#endif
+    {
+        SpillPause pause(*this);
+        DoShiftCells(shift);
+        RecordShift(shift);
+    }
+    cells_.EvictCold();
+}
+
+void Sheet::DoShiftCells(const ReferenceShift& shift) {
+    bool rows = shift.axis == ReferenceShift::Axis::Rows;
+    // Удаляемые ячейки очищаются: их зависимые переходят в реестр пустых
+    // позиций и получают #REF! вместе с другими ссылками на эти позиции
+    if (shift.delta < 0) {
+        Position topLeft = rows ? Position{shift.first, 0} : Position{0, shift.first};
+        Size size = rows ? Size{-shift.delta, Position::MAX_COLS} : Size{Position::MAX_ROWS, -shift.delta};
+        std::vector<Position> deleted;
+        cells_.ForEachInWindow(topLeft, size, [&deleted](Position pos, const Cell&) {
+            deleted.push_back(pos);
+        });
+        for (Position pos : deleted) {
+            DoClearCell(pos);
+        }
+    }
+
+    // Формулы со ссылками на сдвинутые позиции переписываются, когда ячейки
+    // и реестры уже перенесены, и связываются с общими узлами заново. Узлы
+    // с прежними ссылками живут до переписывания последней формулы, поэтому
+    // их значения сбрасываются.
+    subexpressions_.InvalidateAll();
+    std::unordered_set<Cell*> dependents;
+    RemapRegistries(shift, dependents);
+
+    cells_.Shift(shift, [&dependents](Cell& cell, Position pos) {
+        dependents.insert(cell.GetDependents().begin(), cell.GetDependents().end());
+        cell.Move(pos);
+    });
+    auto& counts = rows ? row_counts_ : col_counts_;
+    std::map<int, int> shifted(counts.begin(), counts.lower_bound(shift.first));
+    for (auto it = counts.lower_bound(shift.first); it != counts.end(); ++it) {
+        shifted.emplace_hint(shifted.end(), it->first + shift.delta, it->second);
+    }
+    counts = std::move(shifted);
+    printable_size_ = {GetExtent(row_counts_), GetExtent(col_counts_)};
+    profiler_.Shift(shift);
+
+    // Формулы этого листа попадают в журнал вместе со сдвигом
+    RewriteReferences(shift, dependents);
+}
+
+template<typename Remap>
+void Sheet::RemapRegistries(const Remap& remap, std::unordered_set<Cell*>& dependents) {
+    std::vector<UnsetRefs::node_type> unset;
+    for (auto it = unset_refs_.begin(); it != unset_refs_.end();) {
+        if (remap.Apply(it->first) == it->first) {
+            ++it;
+            continue;
+        }
+        dependents.insert(it->second.begin(), it->second.end());
+        unset.push_back(unset_refs_.extract(it++));
+    }
+    for (auto& node : unset) {
+        Position moved = remap.Apply(node.key());
+        if (moved.IsValid()) {
+            node.key() = moved;
+            unset_refs_.insert(std::move(node));
+        }
+    }
+
+    auto unlink = [this](Cell* dependent) {
+        if (&dependent->GetSheet() != this && workbook_) {
+            workbook_->ChangeLinks(&dependent->GetSheet(), this, -1);
+        }
+    };
+    std::vector<RangeRefs::node_type> ranges;
+    for (auto it = range_refs_.begin(); it != range_refs_.end();) {
+        if (remap.Apply(it->first) == it->first) {
+            ++it;
+            continue;
+        }
+        dependents.insert(it->second.begin(), it->second.end());
+        ranges.push_back(range_refs_.extract(it++));
+    }
+    for (auto& node : ranges) {
+        Range moved = remap.Apply(node.key());
+        if (!moved.IsValid()) {
+            std::for_each(node.mapped().begin(), node.mapped().end(), unlink);
+            continue;
+        }
+        node.key() = moved;
+        auto result = range_refs_.insert(std::move(node));
+        if (result.inserted) {
+            continue;
+        }
+        // Удаление свело два диапазона к одному: формула, ссылавшаяся на
+        // оба, теперь ссылается на него дважды, а учитывается один раз
+        for (Cell* dependent : result.node.mapped()) {
+            if (!result.position->second.insert(dependent).second) {
+                unlink(dependent);
+            }
+        }
+    }
+    for (auto it = lookup_indexes_.begin(); it != lookup_indexes_.end();) {
+        it = remap.Apply(it->first) == it->first ? std::next(it) : lookup_indexes_.erase(it);
+    }
+}
+
+template<typename Remap>
+std::vector<Position> Sheet::RewriteReferences(const Remap& remap, const std::unordered_set<Cell*>& dependents) {
+    std::vector<Position> rewritten;
+    std::vector<Cell*> elsewhere;
+    for (Cell* dependent : dependents) {
+        if (dependent->ShiftReferences(*this, remap) == ReferenceShift::Effect::None) {
+            continue;
+        }
+        Sheet& owner = dependent->GetSheet();
+        owner.cells_.MarkDirty(dependent->GetPosition());
+        if (&owner == this) {
+            rewritten.push_back(dependent->GetPosition());
+        } else {
+            elsewhere.push_back(dependent);
+        }
+    }
+    // Тексты формул других листов изменились и попадают в их журналы
+    for (Cell* dependent : elsewhere) {
+        dependent->GetSheet().RecordChange(dependent->GetPosition());
+    }
+    return rewritten;
+}
+
+template<typename Remap>
+void Sheet::RelocateCells(const Range& window, const Remap& remap, std::unordered_set<Cell*>& dependents,
+                          CountChanges& counts, std::vector<Position>& changed) {
+    // Ячейки переносятся объектами, поэтому связи графа не меняются.
+    // Сначала извлекаются все ячейки: новые позиции могут быть заняты ещё
+    // не перенесёнными.
+    std::vector<Position> sources;
+    cells_.ForEachInWindow(window.first, window.GetSize(), [&](Position pos, const Cell&) {
+        if (remap.Apply(pos) != pos) {
+            sources.push_back(pos);
+        }
+    });
+    std::vector<std::unique_ptr<Cell>> cells;
+    cells.reserve(sources.size());
+    for (Position pos : sources) {
+        cells.push_back(cells_.Extract(pos));
+    }
+    for (auto& cell : cells) {
+        Position from = cell->GetPosition();
+        Position to = remap.Apply(from);
+        dependents.insert(cell->GetDependents().begin(), cell->GetDependents().end());
+        counts.Add(from, cell->IsEmpty(), true);
+        counts.Add(to, true, cell->IsEmpty());
+        cell->Move(to);
+        cells_.Insert(to, std::move(cell));
+        changed.push_back(from);
+        changed.push_back(to);
+    }
+}
+
+void Sheet::CopyRange(const Range& source, Position dest) {
+    StopBackgroundWork();
+    ValidateBlock(source, dest);
+#ifdef SPREADSHEET_TRACING
+    trace::Edit edit("CopyRange", dest);
+#endif
+    {
+        SpillPause pause(*this);
+        RecordChanges(DoCopyCells(source, dest));
+    }
+    cells_.EvictCold();
+}
+
+void Sheet::MoveRange(const Range& source, Position dest) {
+    StopBackgroundWork();
+    ValidateBlock(source, dest);
+    ReferenceMove move{source, dest.row - source.first.row, dest.col - source.first.col};
+    if (move.rows == 0 && move.cols == 0) {
+        return;
+    }
+#ifdef SPREADSHEET_TRACING
+    trace::Edit edit("MoveRange", dest);
+#endif
+    {
+        SpillPause pause(*this);
+        RecordChanges(DoMoveCells(move));
+    }
+    cells_.EvictCold();
+}
+
+void Sheet::ClearRange(const Range& range) {
+    StopBackgroundWork();
+    if (!range.IsValid()) {
+        throw InvalidPositionException("Invalid range");
+    }
+#ifdef SPREADSHEET_TRACING
+    trace::Edit edit("ClearRange", range.first);
+#endif
+    {
+        SpillPause pause(*this);
+        std::vector<Position> cleared;
+        cells_.ForEachInWindow(range.first, range.GetSize(), [&cleared](Position pos, const Cell&) {
+            cleared.push_back(pos);
+        });
+        if (cleared.empty()) {
+            return;
+        }
+        CountChanges counts;
+        DoClearCells(cleared, range, counts);
+        UpdatePrintableArea(counts);
+        RecordChanges(cleared);
+    }
+    cells_.EvictCold();
+}
+
+void Sheet::SortRange(const Range& range, const std::vector<SortKey>& keys, ThreadPool* pool) {
+    StopBackgroundWork();
+    if (!range.IsValid()) {
+        throw InvalidPositionException("Invalid range");
+    }
+    if (keys.empty()) {
+        throw std::invalid_argument("No sort keys");
+    }
+    for (const auto& key : keys) {
+        if (key.col < range.first.col || key.col > range.last.col) {
+            throw InvalidPositionException("Sort key outside range");
+        }
+    }
+#ifdef SPREADSHEET_TRACING
+    trace::Edit edit("SortRange", range.first);
+#endif
+    {
+        SpillPause pause(*this);
+        ReferencePermutation permutation{range, SortRows(range, keys, pool)};
+        bool sorted = true;
+        for (size_t i = 0; i < permutation.rows.size() && sorted; ++i) {
+            sorted = permutation.rows[i] == static_cast<int>(i);
+        }
+        if (!sorted) {
+            RecordChanges(DoSortCells(permutation));
+        }
+    }
+    cells_.EvictCold();
+}
+
+std::vector<int> Sheet::SortRows(const Range& range, const std::vector<SortKey>& keys, ThreadPool* pool) const {
+    int rows = range.GetSize().rows;
+    size_t width = keys.size();
+    // Ключи строки лежат подряд: сравнение читает один участок памяти, а
+    // пустые ячейки и ошибки ключа не дают
+    std::vector<std::optional<LookupKey>> values(static_cast<size_t>(rows) * width);
+    for (size_t k = 0; k < width; ++k) {
+        cells_.ForEachInWindow({range.first.row, keys[k].col}, {rows, 1}, [&](Position pos, const Cell& cell) {
+            EvaluateInputs(cell);
+            values[static_cast<size_t>(pos.row - range.first.row) * width + k] = MakeLookupKey(cell.GetValue());
+        });
+    }
+    auto less = [&values, &keys, width](int lhs, int rhs) {
+        const auto* a = &values[static_cast<size_t>(lhs) * width];
+        const auto* b = &values[static_cast<size_t>(rhs) * width];
+        for (size_t k = 0; k < width; ++k) {
+            if (a[k] == b[k]) {
+                continue;
+            }
+            if (!a[k] || !b[k]) {
+                return !b[k];
+            }
+            return keys[k].descending ? *b[k] < *a[k] : *a[k] < *b[k];
+        }
+        return false;
+    };
+
+    std::vector<int> order(rows);
+    std::iota(order.begin(), order.end(), 0);
+    size_t parts = pool ? std::min(pool->GetThreadCount(), static_cast<size_t>(rows / MIN_PARALLEL_SORT_ROWS)) : 1;
+    if (parts <= 1) {
+        std::stable_sort(order.begin(), order.end(), less);
+    } else {
+        // Части сортируются потоками пула, затем соседние сливаются попарно;
+        // слияние соседних частей сохраняет порядок равных строк
+        auto bound = [&order, rows, parts](size_t part) {
+            return order.begin() + static_cast<std::ptrdiff_t>(rows * std::min(part, parts) / parts);
+        };
+        std::vector<std::function<void()>> sorts;
+        for (size_t part = 0; part < parts; ++part) {
+            sorts.push_back([&bound, &less, part] {
+                std::stable_sort(bound(part), bound(part + 1), less);
+            });
+        }
+        pool->Run(std::move(sorts));
+        for (size_t step = 1; step < parts; step *= 2) {
+            std::vector<std::function<void()>> merges;
+            for (size_t part = 0; part + step < parts; part += 2 * step) {
+                merges.push_back([&bound, &less, part, step] {
+                    std::inplace_merge(bound(part), bound(part + step), bound(part + 2 * step), less);
+                });
+            }
+            pool->Run(std::move(merges));
+        }
+    }
+
+    std::vector<int> newRows(rows);
+    for (int i = 0; i < rows; ++i) {
+        newRows[order[i]] = i;
+    }
+    return newRows;
+}
+
+std::vector<Position> Sheet::DoSortCells(const ReferencePermutation& permutation) {
+    const Range& block = permutation.block;
+    // Индексы поиска по переставленным ячейкам строятся заново при поиске
+    for (auto it = lookup_indexes_.begin(); it != lookup_indexes_.end();) {
+        it = it->first.Intersects(block) ? lookup_indexes_.erase(it) : std::next(it);
+    }
+    subexpressions_.InvalidateAll();
+    std::unordered_set<Cell*> dependents;
+    RemapRegistries(permutation, dependents);
+
+    CountChanges counts;
+    std::vector<Position> changed;
+    RelocateCells(block, permutation, dependents, counts, changed);
+    UpdatePrintableArea(counts);
+    profiler_.Permute(permutation);
+
+    // Диапазоны внутри одной строки переставлены вместе с ней; остальные
+    // диапазоны, задевающие блок, видят новый порядок строк
+    for (const auto& [range, rangeDependents] : range_refs_) {
+        if (range.first.row > block.last.row) {
+            break;
+        }
+        bool moved = range.first.row == range.last.row && block.Contains(range.first) && block.Contains(range.last);
+        if (!moved && range.Intersects(block)) {
+            for (Cell* dependent : rangeDependents) {
+                dependent->InvalidateCache();
+            }
+        }
+    }
+
+    auto rewritten = RewriteReferences(permutation, dependents);
+    changed.insert(changed.end(), rewritten.begin(), rewritten.end());
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    return changed;
+}
+
+void Sheet::ValidateBlock(const Range& source, Position dest) const {
+    Position last{dest.row + source.last.row - source.first.row, dest.col + source.last.col - source.first.col};
+    if (!source.IsValid() || !dest.IsValid() || !last.IsValid()) {
+        throw InvalidPositionException("Invalid range");
+    }
+}
+
+void Sheet::DoClearCells(const std::vector<Position>& positions, const Range& window, CountChanges& counts) {
+    if (positions.empty()) {
+        return;
+    }
+    for (Position pos : positions) {
+        Cell* cell = cells_.Find(pos);
+        counts.Add(pos, cell->IsEmpty(), true);
+        cell->ClearContent();
+        ReleaseCell(pos);
+        subexpressions_.Invalidate(pos);
+    }
+    // Кэши сбрасываются после всех очисток: зависимые очищенных ячеек
+    // теперь записаны в реестре пустых позиций
+    for (Position pos : positions) {
+        if (auto it = unset_refs_.find(pos); it != unset_refs_.end()) {
+            for (Cell* dependent : it->second) {
+                dependent->InvalidateCache();
+            }
+        }
+    }
+    for (const auto& [range, dependents] : range_refs_) {
+        if (range.first.row > window.last.row) {
+            break;
+        }
+        if (range.Intersects(window)) {
+            for (Cell* dependent : dependents) {
+                dependent->InvalidateCache();
+            }
+        }
+    }
+}
+
+std::vector<Position> Sheet::DoCopyCells(const Range& source, Position dest) {
+    int rows = dest.row - source.first.row;
+    int cols = dest.col - source.first.col;
+    Range target{dest, {source.last.row + rows, source.last.col + cols}};
+    size_t memoryBefore = memory_budget_ == 0 ? 0 : GetBudgetedMemory();
+
+    // Источник копируется до записи, так как блоки могут перекрываться.
+    // Формулы копируются разобранными, текст — как есть.
+    using Content = std::variant<std::string, std::unique_ptr<FormulaInterface>>;
+    std::vector<std::pair<Position, Content>> copies;
+    cells_.ForEachInWindow(source.first, source.GetSize(), [&](Position pos, const Cell& cell) {
+        if (cell.IsEmpty()) {
+            return;
+        }
+        Position to{pos.row + rows, pos.col + cols};
+        if (auto formula = cell.CopyFormula(rows, cols)) {
+            copies.emplace_back(to, std::move(formula));
+        } else {
+            copies.emplace_back(to, cell.GetText());
+        }
+    });
+
+    // Ячейки блока, которым в источнике соответствует пустая позиция,
+    // очищаются. Обе последовательности идут в порядке строк.
+    std::vector<Position> cleared;
+    // Прежние тексты изменённых позиций в порядке правок для отката
+    std::vector<std::pair<Position, std::optional<std::string>>> previous;
+    size_t next = 0;
+    cells_.ForEachInWindow(target.first, target.GetSize(), [&](Position pos, const Cell& cell) {
+        while (next < copies.size() && copies[next].first < pos) {
+            ++next;
+        }
+        if (next == copies.size() || copies[next].first != pos) {
+            cleared.push_back(pos);
+            previous.emplace_back(pos, cell.GetText());
+        }
+    });
+
+    CountChanges counts;
+    DoClearCells(cleared, target, counts);
+    std::vector<Position> changed = cleared;
+    try {
+        for (auto& [pos, content] : copies) {
+            const Cell* cell = cells_.Find(pos);
+            previous.emplace_back(pos, cell ? std::optional(cell->GetText()) : std::nullopt);
+            std::visit([&, pos = pos](auto& value) {
+                DoSetCell(pos, std::move(value), &counts);
+            }, content);
+            changed.push_back(pos);
+        }
+        UpdatePrintableArea(counts);
+        counts = {};
+        size_t memoryAfter = memory_budget_ == 0 ? 0 : GetBudgetedMemory();
+        if (memoryAfter > memory_budget_ && memoryAfter > memoryBefore) {
+            throw MemoryBudgetExceededException("Sheet memory budget exceeded");
+        }
+    } catch (...) {
+        // Правки отменяются в обратном порядке: каждое промежуточное
+        // состояние уже встречалось и не содержит циклов
+        UpdatePrintableArea(counts);
+        for (auto it = previous.rbegin(); it != previous.rend(); ++it) {
+            if (it->second) {
+                DoSetCell(it->first, std::move(*it->second));
+            } else {
+                DoClearCell(it->first);
             }
         }
+        throw;
+    }
+    return changed;
+}
+
+std::vector<Position> Sheet::DoMoveCells(const ReferenceMove& move) {
+    Range target = move.GetTarget();
+    // Затираемые ячейки очищаются: их зависимые переходят в реестр пустых
+    // позиций и получают #REF! вместе с другими ссылками на эти позиции
+    std::vector<Position> overwritten;
+    cells_.ForEachInWindow(target.first, target.GetSize(), [&](Position pos, const Cell&) {
+        if (!move.source.Contains(pos)) {
+            overwritten.push_back(pos);
+        }
+    });
+    CountChanges counts;
+    DoClearCells(overwritten, target, counts);
+
+    // Индексы поиска по изменившимся ячейкам строятся заново при поиске
+    for (auto it = lookup_indexes_.begin(); it != lookup_indexes_.end();) {
+        bool touched = it->first.Intersects(move.source) || it->first.Intersects(target);
+        it = touched ? lookup_indexes_.erase(it) : std::next(it);
     }
-    if (pos.row + 1 == printable_size_.rows || pos.col + 1 == printable_size_.cols) {
-        printable_size_ = CalculatePrintableSize();
+    subexpressions_.InvalidateAll();
+    std::unordered_set<Cell*> dependents;
+    RemapRegistries(move, dependents);
+
+    std::vector<Position> changed = overwritten;
+    RelocateCells(move.source, move, dependents, counts, changed);
+    UpdatePrintableArea(counts);
+    profiler_.Move(move);
+
+    // Диапазоны, перенесённые целиком, видят прежние значения; остальные
+    // диапазоны, задевающие источник или назначение, — новое содержимое
+    for (const auto& [range, rangeDependents] : range_refs_) {
+        bool moved = target.Contains(range.first) && target.Contains(range.last);
+        if (!moved && (range.Intersects(move.source) || range.Intersects(target))) {
+            for (Cell* dependent : rangeDependents) {
+                dependent->InvalidateCache();
+            }
+        }
     }
+
+    auto rewritten = RewriteReferences(move, dependents);
+    changed.insert(changed.end(), rewritten.begin(), rewritten.end());
+    return changed;
 }
 
 Size Sheet::GetPrintableSize() const {
@@ -66,80 +924,629 @@ Size Sheet::GetPrintableSize() const {
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
-    for (int row = 0; row < printable_size_.rows; ++row) {
-        for (int col = 0; col < printable_size_.cols; ++col) {
-            if (col > 0) {
-                output << '\t';
-            }
-            if (col < int(cells_[row].size())) {
-                if (const auto& cell = cells_[row][col]) {
-                    auto out = cell->GetValue();
-                    if (std::holds_alternative<std::string>(out)) {
-                        output << std::get<std::string>(out);
-                    }
-                    if (std::holds_alternative<double>(out)) {
-                        output << std::get<double>(out);
-                    }
-                    if (std::holds_alternative<FormulaError>(out)) {
-                        output << std::get<FormulaError>(out);
-                    }
-                }
+    auto lock = LockForRead();
+    PrintCells(output, [&output](const Cell& cell) {
+        std::visit([&output](const auto& value) {
+            output << value;
+        }, cell.GetValue());
+    });
+}
+
+void Sheet::PrintTexts(std::ostream& output) const {
+    auto lock = LockForRead();
+    PrintCells(output, [&output](const Cell& cell) {
+        output << cell.GetTextView();
+    });
+}
+
+void Sheet::PrintCells(std::ostream& output, const std::function<void(const Cell&)>& print) const {
+    // Обходятся только занятые плитки, а разделители пустых участков
+    // выводятся целыми блоками
+    const std::string tabs(std::max(printable_size_.cols - 1, 0), '\t');
+    int row = 0;
+    int col = 0;
+    auto moveTo = [&](Position pos) {
+        for (; row < pos.row; ++row, col = 0) {
+            output.write(tabs.data(), printable_size_.cols - 1 - col);
+            output << '\n';
+        }
+        output.write(tabs.data(), pos.col - col);
+        col = pos.col;
+    };
+    cells_.ForEachInWindow({0, 0}, printable_size_, [&](Position pos, const Cell& cell) {
+        moveTo(pos);
+        print(cell);
+    });
+    moveTo({printable_size_.rows, 0});
+}
+
+void Sheet::GetValues(Position topLeft, Size window,
+                      const std::function<void(const ValuesWindow&)>& callback) const {
+    IsValidPosition(topLeft);
+    if (window.rows < 0 || window.cols < 0) {
+        throw InvalidPositionException("Invalid window size");
+    }
+    if (window.rows > 0 && window.cols > 0) {
+        IsValidPosition({topLeft.row + window.rows - 1, topLeft.col + window.cols - 1});
+    }
+    auto lock = LockForRead();
+#ifdef SPREADSHEET_TRACING
+    trace::Scope scope("GetValues", topLeft);
+#endif
+
+    viewport_.top_left = topLeft;
+    viewport_.size = window;
+    viewport_.values.assign(static_cast<size_t>(window.rows) * window.cols, CellInterface::Value{});
+    cells_.ForEachInWindow(topLeft, window, [&](Position pos, const Cell& cell) {
+        EvaluateInputs(cell);
+        viewport_.values[static_cast<size_t>(pos.row - topLeft.row) * window.cols + pos.col - topLeft.col] =
+                cell.GetValue();
+    });
+    callback(viewport_);
+}
+
+void Sheet::EvaluateInputs(const Cell& cell) const {
+    if (cell.IsCacheValid()) {
+        return;
+    }
+    // Обход в глубину в обратном порядке: ячейка вычисляется после всех своих
+    // устаревших входов. У ячейки с действительным кэшем входы тоже вычислены.
+    std::unordered_set<const Cell*> visited;
+    std::vector<std::pair<const Cell*, bool>> stack{{&cell, false}};
+    while (!stack.empty()) {
+        auto [current, inputs_done] = stack.back();
+        stack.pop_back();
+        if (inputs_done) {
+            current->GetValue();
+            continue;
+        }
+        if (!visited.insert(current).second) {
+            continue;
+        }
+        stack.push_back({current, true});
+        for (const Cell* input : current->GetInputs()) {
+            if (!input->IsCacheValid() && !visited.count(input)) {
+                stack.push_back({input, false});
             }
         }
-        output << '\n';
     }
 }
 
-void Sheet::PrintTexts(std::ostream& output) const {
-    for (int row = 0; row < printable_size_.rows; ++row) {
-        for (int col = 0; col < printable_size_.cols; ++col) {
-            if (col > 0) {
-                output << '\t';
+const SheetInterface* Sheet::FindSheet(std::string_view name) const {
+    return ResolveSheet(name);
+}
+
+Sheet* Sheet::ResolveSheet(std::string_view name) const {
+    return workbook_ ? workbook_->GetSheet(name) : nullptr;
+}
+
+void Sheet::Recalculate() {
+    auto lock = LockForRead();
+#ifdef SPREADSHEET_TRACING
+    trace::Scope scope("RecalculateSheet");
+#endif
+    SpillPause pause(*this);
+    cells_.ForEach([this](Position, const Cell& cell) {
+        if (!cell.IsCacheValid()) {
+            EvaluateInputs(cell);
+        }
+    });
+    stale_ = false;
+}
+
+RecalcStatus Sheet::RecalculateSlice(std::chrono::steady_clock::duration budget, const CancellationToken& token) {
+    auto lock = LockForRead();
+    return DoRecalculateSlice(std::chrono::steady_clock::now() + budget, token);
+}
+
+RecalcStatus Sheet::DoRecalculateSlice(std::chrono::steady_clock::time_point deadline,
+                                       const CancellationToken& token) {
+#ifdef SPREADSHEET_TRACING
+    trace::Scope scope("RecalculateSlice");
+#endif
+    SpillPause pause(*this);
+    bool evaluated = false;
+    while (true) {
+        if (recalc_cursor_ == Position{0, 0}) {
+            pass_invalidations_ = invalidations_;
+        }
+        RecalcStatus status = RecalcStatus::Paused;
+        auto stop = cells_.ForEachFrom(recalc_cursor_, [&](Position, const Cell& cell) {
+            if (cell.IsCacheValid()) {
+                return true;
+            }
+            if (token.IsCancelled()) {
+                status = RecalcStatus::Cancelled;
+                return false;
             }
-            if (col < int(cells_[row].size())) {
-                if (const auto& cell = cells_[row][col]) {
-                    output << cell->GetText();
+            // Ячейка вычисляется целиком, поэтому квант может превысить бюджет
+            if (evaluated && std::chrono::steady_clock::now() >= deadline) {
+                return false;
+            }
+            EvaluateInputs(cell);
+            evaluated = true;
+            return true;
+        });
+        if (stop) {
+            recalc_cursor_ = *stop;
+            return status;
+        }
+        // Кэш ячеек, пройденных в этом обходе, мог быть сброшен правкой
+        // между квантами: тогда обход повторяется
+        recalc_cursor_ = {0, 0};
+        if (invalidations_ == pass_invalidations_) {
+            stale_ = false;
+            return RecalcStatus::Done;
+        }
+    }
+}
+
+std::future<RecalcStatus> Sheet::RecalculateAsync(CancellationToken token,
+                                                  std::chrono::steady_clock::duration slice) {
+    StopRecalculation();
+    std::promise<RecalcStatus> promise;
+    auto result = promise.get_future();
+    background_token_ = token;
+    ++sync_->running;
+    background_ = std::thread([this, token = std::move(token), slice, promise = std::move(promise)]() mutable {
+        try {
+            RecalcStatus status = RecalcStatus::Paused;
+            while (status == RecalcStatus::Paused) {
+                // Между квантами блокировку получают ждущие её потоки
+                while (sync_->waiting > 0) {
+                    std::this_thread::yield();
                 }
+                std::lock_guard lock(sync_->mutex);
+                status = DoRecalculateSlice(std::chrono::steady_clock::now() + slice, token);
             }
+            --sync_->running;
+            promise.set_value(status);
+        } catch (...) {
+            --sync_->running;
+            promise.set_exception(std::current_exception());
         }
-        output << '\n';
+    });
+    return result;
+}
+
+void Sheet::StopRecalculation() {
+    background_token_.Cancel();
+    if (background_.joinable()) {
+        background_.join();
+    }
+}
+
+std::unique_lock<std::recursive_mutex> Sheet::LockForRead() const {
+    if (sync_->running == 0) {
+        return {};
     }
+    ++sync_->waiting;
+    std::unique_lock lock(sync_->mutex);
+    --sync_->waiting;
+    return lock;
 }
 
-void Sheet::InsertRows(const Position pos) {
-    if (pos.row + 1 > int(cells_.size())) {
-        cells_.resize(pos.row + 1);
-        cells_[pos.row].resize(pos.col + 1);
+void Sheet::StopBackgroundWork() {
+    if (sync_->running == 0) {
+        return;
+    }
+    if (workbook_) {
+        workbook_->StopRecalculation();
     } else {
-        if (pos.col + 1 > int(cells_[pos.row].size())) {
-            for (int row = 0; row < pos.row + 1; ++row) {
-                cells_[pos.row].resize(pos.col + 1);
+        StopRecalculation();
+    }
+}
+
+void Sheet::EnableSpilling(std::string path, size_t residentBytes) {
+    StopBackgroundWork();
+    cells_.EnableSpilling(
+            std::move(path),
+            [this](Position pos, std::string_view text) {
+                // Вытесняются только изолированные ячейки: их текст
+                // восстанавливается без проверок и связей
+                auto cell = std::make_unique<Cell>(*this, pos);
+                cell->Restore(std::string(text));
+                return cell;
+            },
+            [this, residentBytes] {
+                return GetMemoryUsage().Total() > residentBytes;
+            });
+    cells_.EvictCold();
+}
+
+void Sheet::EnableSubexpressionSharing(bool enable) {
+    StopBackgroundWork();
+    if (enable == share_subexpressions_) {
+        return;
+    }
+    share_subexpressions_ = enable;
+    // Вытесненные ячейки изолированы и связываются при подгрузке
+    cells_.ForEach([enable, this](Position, Cell& cell) {
+        cell.ShareSubexpressions(enable ? &subexpressions_ : nullptr);
+    });
+}
+
+const Cell* Sheet::FindCell(Position pos) const {
+    return cells_.Find(pos);
+}
+
+Sheet::SubscriptionId Sheet::Subscribe(ChangeSubscriptionOptions options, std::function<void()> notify) {
+    SubscriptionId id = next_subscription_id_++;
+    if (workbook_) {
+        workbook_->ChangeSubscriptionCount(1);
+    }
+    auto& subscriber = subscribers_[id];
+    subscriber.options = options;
+    subscriber.notify = std::move(notify);
+    return id;
+}
+
+void Sheet::Unsubscribe(SubscriptionId id) {
+    if (subscribers_.erase(id) && workbook_) {
+        workbook_->ChangeSubscriptionCount(-1);
+    }
+}
+
+ChangeBatch Sheet::TakeChanges(SubscriptionId id) {
+    auto lock = LockForRead();
+    auto& subscriber = subscribers_.at(id);
+    ChangeBatch batch;
+    batch.overflow = subscriber.overflow;
+    batch.positions.assign(subscriber.pending.begin(), subscriber.pending.end());
+    std::sort(batch.positions.begin(), batch.positions.end());
+    subscriber.pending.clear();
+    subscriber.overflow = false;
+    subscriber.notified = false;
+
+    if (subscriber.options.with_values) {
+        SpillPause pause(*this);
+        batch.values.reserve(batch.positions.size());
+        for (const auto& pos : batch.positions) {
+            if (const Cell* cell = FindCell(pos)) {
+                EvaluateInputs(*cell);
+                batch.values.push_back(cell->GetValue());
+            } else {
+                batch.values.emplace_back();
             }
         }
     }
+    cells_.EvictCold();
+    return batch;
 }
 
-Size Sheet::CalculatePrintableSize() {
-    Size size;
-    for (size_t row = 0; row < cells_.size(); ++row) {
-        for (int col = cells_[row].size() - 1; col >= 0; --col) {
-            if (const auto& cell = cells_[row][col]) {
-                if (!cell->GetText().empty()) {
-                    size.rows = std::max(size.rows, int(row + 1));
-                    size.cols = std::max(size.cols, int(col + 1));
-                    break;
-                }
+void Sheet::RecordChange(Position pos) {
+    RecordChanges({pos});
+}
+
+void Sheet::RecordChanges(const std::vector<Position>& positions) {
+    for (Position pos : positions) {
+        ++version_;
+        auto [it, inserted] = modified_.try_emplace(pos, version_);
+        if (!inserted) {
+            // Запись до последнего сдвига сделана в прежних позициях и может
+            // относиться к другой ячейке: она остаётся в журнале
+            if (shifts_.empty() || it->second > shifts_.rbegin()->first) {
+                changes_.erase(it->second);
             }
+            it->second = version_;
+        }
+        changes_.emplace_hint(changes_.end(), version_, pos);
+    }
+
+    if (subscribers_.empty() && !(workbook_ && workbook_->HasSubscriptions())) {
+        return;
+    }
+
+    // Кэш сбрасывается только до уже устаревших ячеек, поэтому зависимые
+    // собираются отдельным обходом: их значения могли измениться снова.
+    // Зависимые ячейки других листов книги передаются подписчикам их листов.
+    std::vector<Position> changed = positions;
+    std::map<Sheet*, std::vector<Position>> changedElsewhere;
+    std::vector<const Cell*> stack;
+    for (Position pos : positions) {
+        if (const Cell* cell = FindCell(pos)) {
+            stack.insert(stack.end(), cell->GetDependents().begin(), cell->GetDependents().end());
+        } else if (auto it = unset_refs_.find(pos); it != unset_refs_.end()) {
+            stack.insert(stack.end(), it->second.begin(), it->second.end());
         }
+        ForEachRangeDependent(pos, [&stack](const Cell* dependent) {
+            stack.push_back(dependent);
+        });
+    }
+    std::unordered_set<const Cell*> visited;
+    while (!stack.empty()) {
+        const Cell* current = stack.back();
+        stack.pop_back();
+        if (!visited.insert(current).second) {
+            continue;
+        }
+        Sheet& owner = current->GetSheet();
+        (&owner == this ? changed : changedElsewhere[&owner]).push_back(current->GetPosition());
+        auto push = [&](const Cell* dependent) {
+            if (!visited.count(dependent)) {
+                stack.push_back(dependent);
+            }
+        };
+        for (const Cell* dependent : current->GetDependents()) {
+            push(dependent);
+        }
+        owner.ForEachRangeDependent(current->GetPosition(), push);
+    }
+
+    QueueChanges(changed);
+    for (const auto& [sheet, elsewhere] : changedElsewhere) {
+        sheet->QueueChanges(elsewhere);
     }
-    return size;
 }
 
-bool Sheet::IsCellInTable(const Position pos) {
-    if (cells_.empty()) {
-        return false;
+void Sheet::RecordShift(const ReferenceShift& shift) {
+    ++version_;
+    // Журнал не переписывается: позиции записей переносятся через более
+    // поздние сдвиги при экспорте
+    shifts_.emplace(version_, shift);
+
+    // Сдвиг меняет позиции многих ячеек сразу: подписчики перечитывают лист
+    for (auto& [id, subscriber] : subscribers_) {
+        subscriber.pending.clear();
+        subscriber.overflow = true;
+    }
+    if (batch_depth_ == 0) {
+        NotifySubscribers();
+    }
+}
+
+void Sheet::QueueChanges(const std::vector<Position>& changed) {
+    if (subscribers_.empty()) {
+        return;
+    }
+    for (auto& [id, subscriber] : subscribers_) {
+        if (subscriber.overflow) {
+            continue;
+        }
+        subscriber.pending.insert(changed.begin(), changed.end());
+        if (subscriber.pending.size() > subscriber.options.max_pending) {
+            subscriber.pending.clear();
+            subscriber.overflow = true;
+        }
+    }
+    if (batch_depth_ == 0) {
+        NotifySubscribers();
+    }
+}
+
+void Sheet::NotifySubscribers() {
+    // Колбэки вызываются после обхода: подписчик может отписаться из колбэка
+    std::vector<std::function<void()>> callbacks;
+    for (auto& [id, subscriber] : subscribers_) {
+        bool hasChanges = subscriber.overflow || !subscriber.pending.empty();
+        if (hasChanges && !subscriber.notified) {
+            subscriber.notified = true;
+            if (subscriber.notify) {
+                callbacks.push_back(subscriber.notify);
+            }
+        }
+    }
+    for (const auto& callback : callbacks) {
+        callback();
+    }
+}
+
+void Sheet::ExportChangesSince(uint64_t version, std::ostream& output, bool withValues) const {
+    auto lock = LockForRead();
+    output << DELTA_HEADER << '\t' << version << '\t' << version_ << '\n';
+    for (auto it = shifts_.upper_bound(version); it != shifts_.end(); ++it) {
+        const auto& shift = it->second;
+        output << (shift.delta > 0 ? 'I' : 'D') << '\t'
+               << (shift.axis == ReferenceShift::Axis::Rows ? SHIFT_ROWS : SHIFT_COLS) << '\t'
+               << shift.first << '\t' << std::abs(shift.delta) << '\n';
+    }
+    // Позиции записей в текущих координатах; правки удалённых ячеек
+    // воспроизводит само удаление, а из нескольких записей одной ячейки
+    // остаётся последняя
+    std::map<uint64_t, Position> changed;
+    std::unordered_map<Position, uint64_t, PositionHasher> latest;
+    for (auto it = changes_.upper_bound(version); it != changes_.end(); ++it) {
+        Position pos = it->second;
+        for (auto shift = shifts_.upper_bound(it->first); shift != shifts_.end() && pos.IsValid(); ++shift) {
+            pos = shift->second.Apply(pos);
+        }
+        if (!pos.IsValid()) {
+            continue;
+        }
+        auto [entry, inserted] = latest.try_emplace(pos, it->first);
+        if (!inserted) {
+            changed.erase(entry->second);
+            entry->second = it->first;
+        }
+        changed.emplace(it->first, pos);
+    }
+    for (const auto& [changeVersion, pos] : changed) {
+        cells_.EvictCold();
+        SpillPause pause(*this);
+        const Cell* cell = FindCell(pos);
+        output << (cell ? 'S' : 'C') << '\t' << pos.ToString();
+        if (cell) {
+            output << '\t';
+            WriteEscaped(output, cell->GetTextView());
+            if (withValues) {
+                output << '\t';
+                EvaluateInputs(*cell);
+                std::visit([&](const auto& value) {
+                    std::ostringstream text;
+                    text << value;
+                    WriteEscaped(output, text.str());
+                }, cell->GetValue());
+            }
+        }
+        output << '\n';
+    }
+    cells_.EvictCold();
+}
+
+uint64_t Sheet::ApplyChanges(std::istream& input) {
+    std::string line;
+    if (!std::getline(input, line)) {
+        throw std::invalid_argument("Malformed delta: missing header");
+    }
+    auto header = SplitFields(line);
+    if (header.size() != 3 || header[0] != DELTA_HEADER) {
+        throw std::invalid_argument("Malformed delta: bad header");
+    }
+    uint64_t baseVersion = ParseVersion(header[1]);
+    uint64_t sourceVersion = ParseVersion(header[2]);
+    if (sourceVersion < baseVersion) {
+        throw std::invalid_argument("Malformed delta: bad version");
+    }
+    // Пропущенная или повторная дельта разошлась бы с исходным листом
+    if (baseVersion != applied_version_) {
+        throw std::invalid_argument("Delta does not continue the applied version");
+    }
+
+    std::vector<ReferenceShift> shifts;
+    std::vector<std::pair<Position, std::optional<std::string>>> cells;
+    while (std::getline(input, line)) {
+        auto fields = SplitFields(line);
+        if (fields[0] == "I" || fields[0] == "D") {
+            if (fields.size() != 4 || (fields[1] != SHIFT_ROWS && fields[1] != SHIFT_COLS)) {
+                throw std::invalid_argument("Malformed delta: bad record");
+            }
+            bool rows = fields[1] == SHIFT_ROWS;
+            int limit = rows ? Position::MAX_ROWS : Position::MAX_COLS;
+            int first = ParseIndex(fields[2], limit - 1);
+            int count = ParseIndex(fields[3], limit);
+            shifts.push_back({rows ? ReferenceShift::Axis::Rows : ReferenceShift::Axis::Cols, first,
+                              fields[0] == "I" ? count : -count});
+            continue;
+        }
+        bool set = fields[0] == "S";
+        if ((!set && fields[0] != "C") || fields.size() < (set ? 3u : 2u)) {
+            throw std::invalid_argument("Malformed delta: bad record");
+        }
+        auto pos = Position::FromString(fields[1]);
+        if (!pos.IsValid()) {
+            throw std::invalid_argument("Malformed delta: bad position");
+        }
+        cells.emplace_back(pos, set ? std::optional(Unescape(fields[2])) : std::nullopt);
+    }
+
+    // Сначала очищаются все изменённые ячейки: по отдельности новые тексты
+    // могли бы замкнуть цикл со старыми, а их подмножество поверх
+    // нетронутых ячеек — подграф итогового ациклического графа
+    Batch batch(*this);
+    // Сдвиги предшествуют правкам ячеек, позиции которых записаны после них
+    for (const auto& shift : shifts) {
+        ShiftCells(shift.axis, shift.first, std::abs(shift.delta), shift.delta > 0);
+    }
+    for (const auto& [pos, text] : cells) {
+        ClearCell(pos);
+    }
+    for (auto& [pos, text] : cells) {
+        if (text) {
+            SetCell(pos, std::move(*text));
+        }
+    }
+    applied_version_ = sourceVersion;
+    return sourceVersion;
+}
+
+SheetMemoryUsage Sheet::GetMemoryUsage() const {
+    auto lock = LockForRead();
+    SheetMemoryUsage usage;
+    usage.grid = memory_.Get(MemoryCategory::Grid);
+    usage.cells = memory_.Get(MemoryCategory::Cells);
+    usage.formulas = memory_.Get(MemoryCategory::Formulas);
+    usage.text = memory_.Get(MemoryCategory::Text) + string_pool_.GetMemoryBytes();
+    usage.ast_nodes = memory_.Get(MemoryCategory::AstNodes);
+    usage.reference_lists = memory_.Get(MemoryCategory::ReferenceLists);
+    usage.dependencies = memory_.Get(MemoryCategory::Dependencies);
+    usage.lookup_indexes = memory_.Get(MemoryCategory::LookupIndexes);
+    usage.subexpressions = memory_.Get(MemoryCategory::Subexpressions);
+    usage.formula_cache = memory_.Get(MemoryCategory::FormulaCache);
+    usage.journal = memory_.Get(MemoryCategory::Journal);
+    return usage;
+}
+
+size_t Sheet::GetBudgetedMemory() const {
+    // Кэш разбора ограничен числом записей и переживает откат правки,
+    // поэтому в бюджет не входит
+    return GetMemoryUsage().Total() - memory_.Get(MemoryCategory::FormulaCache);
+}
+
+SheetProfile Sheet::GetProfile(size_t top) const {
+    auto lock = LockForRead();
+    SheetProfile profile;
+    auto cells = profiler_.GetCells();
+    for (const auto& cell : cells) {
+        auto& totals = profile.totals;
+        totals.evaluations += cell.evaluations;
+        totals.cache_hits += cell.cache_hits;
+        totals.invalidations += cell.invalidations;
+        totals.invalidated_cells += cell.invalidated_cells;
+        totals.cycle_checks += cell.cycle_checks;
+        totals.cycle_check_visits += cell.cycle_check_visits;
+        totals.cycle_check_seconds += cell.cycle_check_seconds;
+        totals.self_seconds += cell.self_seconds;
+    }
+    profile.totals.total_seconds = profile.totals.self_seconds;
+
+    auto by_self_time = [](const CellProfile& lhs, const CellProfile& rhs) {
+        return lhs.self_seconds > rhs.self_seconds;
+    };
+    size_t hottest = std::min(top, cells.size());
+    std::partial_sort(cells.begin(), cells.begin() + hottest, cells.end(), by_self_time);
+    cells.resize(hottest);
+    profile.hottest_cells = std::move(cells);
+
+    // Длина самой длинной цепочки, начинающейся в ячейке, и следующая
+    // ячейка этой цепочки. Граф ацикличен; обход ведётся без рекурсии.
+    std::unordered_map<const Cell*, std::pair<size_t, const Cell*>> depth;
+    std::vector<const Cell*> chain_heads;
+    cells_.ForEach([&](Position, const Cell& cell) {
+        if (depth.count(&cell)) {
+            return;
+        }
+        if (!cell.HasDependents()) {
+            chain_heads.push_back(&cell);
+        }
+        std::vector<std::pair<const Cell*, bool>> stack{{&cell, false}};
+        while (!stack.empty()) {
+            auto [current, inputs_done] = stack.back();
+            stack.pop_back();
+            if (!inputs_done) {
+                if (depth.count(current)) {
+                    continue;
+                }
+                stack.push_back({current, true});
+                for (const Cell* input : current->GetInputs()) {
+                    if (!depth.count(input)) {
+                        stack.push_back({input, false});
+                    }
+                }
+                continue;
+            }
+            std::pair<size_t, const Cell*> best{1, nullptr};
+            for (const Cell* input : current->GetInputs()) {
+                if (depth[input].first + 1 > best.first) {
+                    best = {depth[input].first + 1, input};
+                }
+            }
+            depth[current] = best;
+        }
+    });
+
+    auto by_depth = [&](const Cell* lhs, const Cell* rhs) {
+        return depth[lhs].first > depth[rhs].first;
+    };
+    size_t longest = std::min(top, chain_heads.size());
+    std::partial_sort(chain_heads.begin(), chain_heads.begin() + longest, chain_heads.end(), by_depth);
+    for (size_t i = 0; i < longest; ++i) {
+        std::vector<Position> chain;
+        for (const Cell* cell = chain_heads[i]; cell; cell = depth[cell].second) {
+            chain.push_back(cell->GetPosition());
+        }
+        profile.longest_chains.push_back(std::move(chain));
     }
-    return int(cells_.size()) > pos.row && int(cells_[pos.row].size()) > pos.col;
+    return profile;
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
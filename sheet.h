@@ -1,13 +1,146 @@
 #pragma once
 
 #include "cell.h"
+#include "cell_storage.h"
 #include "common.h"
+#include "formula_cache.h"
+#include "lookup_index.h"
+#include "memory.h"
+#include "profiler.h"
+#include "range_map.h"
+#include "string_pool.h"
+#include "subexpressions.h"
 
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
+// Значения прямоугольного окна листа, записанные по строкам в один буфер
+struct ValuesWindow {
+    Position top_left;
+    Size size;
+    std::vector<CellInterface::Value> values;
+
+    const CellInterface::Value& At(int row, int col) const {
+        return values[static_cast<size_t>(row) * size.cols + col];
+    }
+};
+
+struct ChangeSubscriptionOptions {
+    // Предел накопленных позиций; при превышении набор заменяется флагом
+    // overflow, и клиент перечитывает лист целиком
+    size_t max_pending = 10'000;
+    // Вычислять ли новые значения изменившихся ячеек
+    bool with_values = false;
+};
+
+// Изменения, накопленные подпиской с прошлого TakeChanges
+struct ChangeBatch {
+    // Позиции без повторов, по возрастанию
+    std::vector<Position> positions;
+    // Значения в порядке positions, если подписка их запрашивала
+    std::vector<CellInterface::Value> values;
+    bool overflow = false;
+};
+
+// Токен отмены пересчёта; копии разделяют один флаг
+class CancellationToken {
+public:
+    CancellationToken()
+            : cancelled_(std::make_shared<std::atomic<bool>>(false)) {
+    }
+
+    void Cancel() const {
+        cancelled_->store(true);
+    }
+
+    bool IsCancelled() const {
+        return cancelled_->load(std::memory_order_relaxed);
+    }
+
+private:
+    std::shared_ptr<std::atomic<bool>> cancelled_;
+};
+
+// Чем закончился квант пересчёта
+enum class RecalcStatus {
+    Done,       // устаревших ячеек не осталось
+    Paused,     // истёк бюджет кванта, следующий квант продолжит
+    Cancelled,  // пересчёт отменён токеном либо правкой
+};
+
+// Синхронизация фонового пересчёта с чтением листа. У листов книги она
+// общая: формулы одного листа вычисляют ячейки других.
+struct RecalcSync {
+    std::recursive_mutex mutex;
+    // Число идущих фоновых пересчётов; без них чтение не блокируется
+    std::atomic<int> running{0};
+    // Потоки, ждущие блокировку: фоновый пересчёт уступает им между квантами
+    std::atomic<int> waiting{0};
+};
+
+// Ключ сортировки строк: столбец листа и направление
+struct SortKey {
+    int col = 0;
+    bool descending = false;
+};
+
+class ThreadPool;
+class Workbook;
+
 class Sheet : public SheetInterface {
 public:
+    using SubscriptionId = uint32_t;
+
+    // Откладывает уведомления подписчиков до конца области: правки внутри
+    // неё доставляются одним набором. Области могут быть вложенными.
+    class Batch {
+    public:
+        explicit Batch(Sheet& sheet)
+                : sheet_(sheet) {
+            ++sheet_.batch_depth_;
+        }
+
+        Batch(const Batch&) = delete;
+
+        Batch& operator=(const Batch&) = delete;
+
+        ~Batch() {
+            if (--sheet_.batch_depth_ == 0) {
+                sheet_.NotifySubscribers();
+            }
+        }
+
+    private:
+        Sheet& sheet_;
+    };
+
+    // Откладывает вытеснение плиток на диск до конца области: указатели на
+    // ячейки, полученные внутри неё, остаются действительными
+    class SpillPause {
+    public:
+        explicit SpillPause(const Sheet& sheet)
+                : pause_(sheet.cells_) {
+        }
+
+    private:
+        CellStorage::Pause pause_;
+    };
+
+    Sheet() = default;
+
+    // Лист книги workbook с именем name
+    Sheet(Workbook& workbook, std::string name);
+
     ~Sheet();
 
     void SetCell(Position pos, std::string text) override;
@@ -24,13 +157,392 @@ public:
 
     void PrintTexts(std::ostream& output) const override;
 
+    const SheetInterface* FindSheet(std::string_view name) const override;
+
+    // Поиск по индексу диапазона: индекс строится при первом поиске в
+    // диапазоне и дальше обновляется при правках его ячеек
+    std::optional<int> Lookup(const Range& range, const CellInterface::Value& key,
+                              LookupMode mode) const override;
+
+    // Лист книги с именем name, на который ссылаются формулы этого листа
+    Sheet* ResolveSheet(std::string_view name) const;
+
+    Workbook* GetWorkbook() const {
+        return workbook_;
+    }
+
+    std::string_view GetName() const {
+        return name_;
+    }
+
+    // Есть ли на листе ячейки, кэш которых сброшен после прошлого пересчёта
+    bool IsStale() const {
+        return stale_;
+    }
+
+    void MarkStale() {
+        stale_ = true;
+        ++invalidations_;
+    }
+
+    // Вычисляет все устаревшие ячейки листа вместе с их входами
+    void Recalculate();
+
+    // Вычисляет устаревшие ячейки, пока не истечёт budget или не будет
+    // отменён token; хотя бы одна ячейка вычисляется всегда. Следующий вызов
+    // продолжает обход с места остановки, а правки между вызовами
+    // допустимы: так цикл событий чередует пересчёт с другой работой.
+    RecalcStatus RecalculateSlice(std::chrono::steady_clock::duration budget,
+                                  const CancellationToken& token = {});
+
+    // Пересчитывает лист в фоновом потоке квантами slice и возвращает Done
+    // либо Cancelled; предыдущий фоновый пересчёт листа отменяется. Пока он
+    // идёт, чтение листа и значений ячеек ждёт конца текущего кванта, поэтому
+    // видит каждую ячейку либо с прежним, либо с новым значением, но не
+    // посреди вычисления. Правка любого листа книги отменяет фоновые
+    // пересчёты и дожидается их остановки, поэтому новая правка вытесняет
+    // пересчёт после старой. Во время пересчёта лист читается и правится
+    // из одного потока, а колбэки чтения не правят лист.
+    std::future<RecalcStatus> RecalculateAsync(CancellationToken token = {},
+                                               std::chrono::steady_clock::duration slice =
+                                                       std::chrono::milliseconds(10));
+
+    // Отменяет фоновый пересчёт листа и дожидается остановки его потока
+    void StopRecalculation();
+
+    // Блокировка чтения на время фонового пересчёта; без него пуста
+    std::unique_lock<std::recursive_mutex> LockForRead() const;
+
+    // Вычисляет только ячейки окна размера window с левым верхним углом
+    // topLeft и их устаревшие входы, не трогая остальную таблицу, и передаёт
+    // значения в callback. Входы вычисляются снизу вверх без рекурсии, поэтому
+    // окно над длинной устаревшей цепочкой не упирается в глубину стека.
+    // Буфер окна переиспользуется и действителен только внутри callback.
+    void GetValues(Position topLeft, Size window,
+                   const std::function<void(const ValuesWindow&)>& callback) const;
+
+    // Вставляет count пустых строк перед строкой row. Ячейки ниже переносятся
+    // вместе со связями, ссылки на них во всех формулах книги переписываются
+    // без повторного разбора, а диапазон, внутри которого вставлены строки,
+    // расширяется. Если ячейки ушли бы за пределы листа, бросается
+    // InvalidPositionException.
+    void InsertRows(int row, int count = 1);
+
+    // Удаляет count строк начиная с row. Ячейки ниже поднимаются, ссылки на
+    // удалённые ячейки становятся #REF!, диапазоны сужаются.
+    void DeleteRows(int row, int count = 1);
+
+    // То же для столбцов
+    void InsertCols(int col, int count = 1);
+
+    void DeleteCols(int col, int count = 1);
+
+    // Копирует ячейки диапазона source в блок того же размера с левым
+    // верхним углом dest. Формулы копируются без повторного разбора, а их
+    // ссылки смещаются вместе с ячейкой; ссылки, ушедшие за пределы листа,
+    // становятся #REF!. Пустые позиции источника очищают позиции блока.
+    // Если копия замкнула бы цикл или превысила бюджет памяти, лист не
+    // меняется и бросается то же исключение, что и у SetCell.
+    void CopyRange(const Range& source, Position dest);
+
+    // Переносит ячейки диапазона source в блок с левым верхним углом dest
+    // вместе со связями, позиции источника вне блока пустеют. Ссылки на
+    // перенесённые ячейки во всех формулах книги следуют за ними, ссылки на
+    // затёртые ячейки блока становятся #REF!, а формулы самих ячеек
+    // переписываются без повторного разбора.
+    void MoveRange(const Range& source, Position dest);
+
+    // Очищает все ячейки диапазона. Кэши зависимых формул сбрасываются, а
+    // печатная область обновляется один раз для всего диапазона.
+    void ClearRange(const Range& range);
+
+    // Устойчиво сортирует строки диапазона по вычисленным значениям столбцов
+    // keys: сначала числа, затем текст без учёта регистра; пустые ячейки и
+    // ошибки идут последними при любом направлении. Ячейки переставляются
+    // объектами вместе со связями, ссылки на них во всех формулах книги
+    // следуют за своими строками, а диапазоны, задевающие несколько строк,
+    // видят новый порядок. Если задан pool, части строк сортируются его
+    // потоками и затем сливаются. Столбец ключа вне диапазона вызывает
+    // InvalidPositionException, пустой список ключей — std::invalid_argument.
+    void SortRange(const Range& range, const std::vector<SortKey>& keys, ThreadPool* pool = nullptr);
+
+    // Подписка на изменения значений. Каждая правка добавляет в набор
+    // подписки позицию правки и все ячейки, транзитивно зависящие от неё.
+    // notify вызывается, когда в пустом наборе появляются изменения; до
+    // TakeChanges повторных уведомлений нет, а новые изменения объединяются
+    // с накопленными. notify не должен бросать исключения и менять лист.
+    SubscriptionId Subscribe(ChangeSubscriptionOptions options = {},
+                             std::function<void()> notify = {});
+
+    void Unsubscribe(SubscriptionId id);
+
+    // Забирает накопленные изменения подписки
+    ChangeBatch TakeChanges(SubscriptionId id);
+
+    // Номер последней правки листа; растёт с каждой успешной правкой
+    uint64_t GetVersion() const {
+        return version_;
+    }
+
+    // Пишет в output TSV-дельту ячеек, изменённых после правки version:
+    // строку заголовка с диапазоном версий, затем по строке на каждую
+    // вставку и удаление строк и столбцов, затем по строке на ячейку — текст
+    // либо отметку очистки, а при withValues ещё и значение. Позиции ячеек
+    // указываются после всех сдвигов. Время работы зависит только от числа
+    // изменённых ячеек и сдвигов.
+    void ExportChangesSince(uint64_t version, std::ostream& output, bool withValues = false) const;
+
+    // Применяет дельту ExportChangesSince: после применения всех дельт по
+    // порядку тексты ячеек совпадают с исходным листом. Дельта должна
+    // начинаться с версии, до которой дошла предыдущая применённая (первая —
+    // с нулевой). Возвращает версию исходного листа, до которой дошла
+    // дельта. Некорректная дельта или дельта не по порядку вызывает
+    // std::invalid_argument и не меняет лист.
+    uint64_t ApplyChanges(std::istream& input);
+
+    // Версия исходного листа, до которой дошли применённые дельты
+    uint64_t GetAppliedVersion() const {
+        return applied_version_;
+    }
+
+    // Регистрирует ссылку ячейки dependent на позицию, в которой нет ячейки
+    void AddUnsetRef(Position pos, Cell* dependent);
+
+    void RemoveUnsetRef(Position pos, Cell* dependent);
+
+    // Регистрирует ссылку формулы dependent на диапазон range этого листа
+    void AddRangeRef(const Range& range, Cell* dependent);
+
+    // Возвращает false, если ссылка не была зарегистрирована
+    bool RemoveRangeRef(const Range& range, Cell* dependent);
+
+    // Вызывает f для каждой формулы, ссылающейся на диапазон с позицией pos
+    template<typename F>
+    void ForEachRangeDependent(Position pos, F f) const;
+
+    // Обновляет индексы поиска, в диапазон которых входит cell: вызывается
+    // до изменения содержимого ячейки с inserted = false и после — с true
+    void UpdateLookupIndexes(const Cell& cell, bool inserted);
+
+    // Значение формулы в позиции pos устарело: индексы с ней строятся заново
+    void InvalidateLookupIndexes(Position pos);
+
+    // Вычисляет устаревшие входы cell и затем её саму снизу вверх без
+    // рекурсии, поэтому длинная цепочка не упирается в глубину стека
+    void EvaluateInputs(const Cell& cell) const;
+
+    StringPool& GetStringPool() {
+        return string_pool_;
+    }
+
+    const StringPool& GetStringPool() const {
+        return string_pool_;
+    }
+
+    Profiler& GetProfiler() {
+        return profiler_;
+    }
+
+    // Кэш разбора формул листа; его ёмкость задаётся через SetCapacity
+    FormulaCache& GetFormulaCache() {
+        return formula_cache_;
+    }
+
+    const FormulaCache& GetFormulaCache() const {
+        return formula_cache_;
+    }
+
+    // Общие подвыражения формул листа; nullptr, если разделение выключено
+    SubexpressionTable* GetSubexpressions() {
+        return share_subexpressions_ ? &subexpressions_ : nullptr;
+    }
+
+    SubexpressionTable::Stats GetSubexpressionStats() const {
+        auto lock = LockForRead();
+        return subexpressions_.GetStats();
+    }
+
+    MemoryCounter& GetMemoryCounter() {
+        return memory_;
+    }
+
+    CountingAllocator<Cell*> GetDependencyAllocator() {
+        return {memory_, MemoryCategory::Dependencies};
+    }
+
+    // Память листа по категориям; вычисляется за O(1)
+    SheetMemoryUsage GetMemoryUsage() const;
+
+    // Ограничивает память листа: правка, после которой память выросла и
+    // превысила бюджет, отменяется с исключением MemoryBudgetExceededException.
+    // Память кэша разбора формул в бюджет не входит. Ноль снимает ограничение.
+    void SetMemoryBudget(size_t bytes) {
+        memory_budget_ = bytes;
+    }
+
+    // Включает работу с листом больше памяти: когда память листа превышает
+    // residentBytes, холодные плитки ячеек, не связанных с графом
+    // зависимостей, записываются в файл path и выгружаются, а при обращении
+    // подгружаются обратно. Память проверяется после правок, при чтении
+    // ячеек и между полосами печати. Указатель, полученный от GetCell,
+    // действителен до следующего обращения к листу, если ячейка не связана
+    // с другими или вызов сделан внутри SpillPause.
+    void EnableSpilling(std::string path, size_t residentBytes);
+
+    // Включает разделение подвыражений: одинаковые арифметические
+    // подвыражения формул листа над его ячейками вычисляются один раз за
+    // пересчёт (см. SubexpressionTable). Формулы листа связываются с общими
+    // узлами сразу, новые — при разборе; выключение отвязывает формулы и
+    // освобождает узлы.
+    void EnableSubexpressionSharing(bool enable = true);
+
+    SpillStats GetSpillStats() const {
+        auto lock = LockForRead();
+        return cells_.GetSpillStats();
+    }
+
+    // Отчёт профилировщика: top самых дорогих ячеек и top самых длинных
+    // цепочек зависимостей
+    SheetProfile GetProfile(size_t top = 10) const;
+
 private:
-    std::vector<std::vector<std::unique_ptr<Cell>>> cells_;
+    struct Subscriber {
+        ChangeSubscriptionOptions options;
+        std::function<void()> notify;
+        std::unordered_set<Position, PositionHasher> pending;
+        bool overflow = false;
+        bool notified = false;
+    };
+
+    using UnsetRefs = std::unordered_map<Position, CellSet, PositionHasher, std::equal_to<Position>,
+                                         CountingAllocator<std::pair<const Position, CellSet>>>;
+    // Диапазоны с позицией находятся без обхода всех диапазонов листа
+    using RangeRefs = RangeMap<CellSet>;
+    using LookupIndexes = RangeMap<LookupIndex>;
+    using Changes = std::map<uint64_t, Position, std::less<uint64_t>,
+                             CountingAllocator<std::pair<const uint64_t, Position>>>;
+    using Modified = std::unordered_map<Position, uint64_t, PositionHasher, std::equal_to<Position>,
+                                        CountingAllocator<std::pair<const Position, uint64_t>>>;
+    using Shifts = std::map<uint64_t, ReferenceShift, std::less<uint64_t>,
+                            CountingAllocator<std::pair<const uint64_t, ReferenceShift>>>;
+
+    Workbook* workbook_ = nullptr;
+    std::string name_;
+    // Сбрасывается фоновым пересчётом
+    std::atomic<bool> stale_{false};
+    // Число сбросов кэша: пересчёт повторяет обход, если кэш сбросили за
+    // время обхода
+    uint64_t invalidations_ = 0;
+    RecalcSync own_sync_;
+    RecalcSync* sync_ = &own_sync_;
+    // Позиция, с которой продолжается обход пересчёта квантами, и число
+    // сбросов кэша на начало обхода
+    Position recalc_cursor_;
+    uint64_t pass_invalidations_ = 0;
+    std::thread background_;
+    CancellationToken background_token_;
+    // Объявлены раньше ячеек, чтобы пережить их при разрушении листа. Учёт
+    // памяти меняется и при чтении: подгрузка плиток, построение индексов.
+    mutable MemoryCounter memory_;
+    size_t memory_budget_ = 0;
+    StringPool string_pool_;
+    Profiler profiler_;
+    SubexpressionTable subexpressions_{memory_};
+    FormulaCache formula_cache_{memory_};
+    bool share_subexpressions_ = false;
+    // Чтение ячейки может подгрузить её плитку с диска
+    mutable CellStorage cells_{memory_};
+    // Зависимости от позиций, в которых ещё нет ячеек
+    UnsetRefs unset_refs_ = UnsetRefs(UnsetRefs::allocator_type(memory_, MemoryCategory::Dependencies));
+    // Зависимости формул от диапазонов и индексы диапазонов для поиска
+    RangeRefs range_refs_ = RangeRefs(RangeRefs::allocator_type(memory_, MemoryCategory::Dependencies));
+    mutable LookupIndexes lookup_indexes_ =
+            LookupIndexes(LookupIndexes::allocator_type(memory_, MemoryCategory::LookupIndexes));
+    // Количество непустых ячеек в каждой строке и каждом столбце:
+    // печатная область определяется наибольшими занятыми индексами
+    std::map<int, int> row_counts_;
+    std::map<int, int> col_counts_;
     Size printable_size_;
+    mutable ValuesWindow viewport_;
+    // Журнал правок: версия последнего изменения каждой позиции и позиции
+    // по версиям, чтобы дельта не просматривала нетронутые ячейки. Записи,
+    // сделанные до сдвига строк или столбцов, хранят прежние позиции.
+    uint64_t version_ = 0;
+    Changes changes_ = Changes(Changes::allocator_type(memory_, MemoryCategory::Journal));
+    Modified modified_ = Modified(Modified::allocator_type(memory_, MemoryCategory::Journal));
+    // Вставки и удаления строк и столбцов по версиям
+    Shifts shifts_ = Shifts(Shifts::allocator_type(memory_, MemoryCategory::Journal));
+    // Версия исходного листа после последней применённой дельты
+    uint64_t applied_version_ = 0;
+    std::map<SubscriptionId, Subscriber> subscribers_;
+    SubscriptionId next_subscription_id_ = 0;
+    int batch_depth_ = 0;
+
+    // Изменения счётчиков печатной области, накопленные групповой правкой:
+    // каждая строка и каждый столбец обновляются один раз
+    struct CountChanges {
+        std::map<int, int> rows;
+        std::map<int, int> cols;
 
-    void InsertRows(const Position pos);
-    Size CalculatePrintableSize();
-    bool IsCellInTable(const Position pos);
+        void Add(Position pos, bool wasEmpty, bool isEmpty);
+    };
+
+    // content — текст либо разобранная формула. Если задан counts, печатная
+    // область не обновляется, а изменение накапливается в нём.
+    template<typename Content>
+    void DoSetCell(Position pos, Content content, CountChanges* counts = nullptr);
+    void DoSetCellWithinBudget(Position pos, std::string text);
+    // Память листа, которую ограничивает бюджет
+    size_t GetBudgetedMemory() const;
+    void DoClearCell(Position pos);
+    // Очищает ячейки positions из окна window и затем разом сбрасывает кэши
+    // их зависимых
+    void DoClearCells(const std::vector<Position>& positions, const Range& window, CountChanges& counts);
+    void ShiftCells(ReferenceShift::Axis axis, int first, int count, bool insert);
+    void DoShiftCells(const ReferenceShift& shift);
+    // Групповые правки возвращают изменённые позиции для журнала
+    std::vector<Position> DoCopyCells(const Range& source, Position dest);
+    std::vector<Position> DoMoveCells(const ReferenceMove& move);
+    std::vector<Position> DoSortCells(const ReferencePermutation& permutation);
+    // Новые строки диапазона range в порядке сортировки по keys
+    std::vector<int> SortRows(const Range& range, const std::vector<SortKey>& keys, ThreadPool* pool) const;
+    // Переставляет объектами ячейки окна window, которые remap переносит,
+    // и собирает их зависимых, изменения печатной области и позиции
+    template<typename Remap>
+    void RelocateCells(const Range& window, const Remap& remap, std::unordered_set<Cell*>& dependents,
+                       CountChanges& counts, std::vector<Position>& changed);
+    // Переносит ключи реестров пустых позиций, диапазонов и индексов поиска
+    // по remap (ReferenceShift, ReferenceMove или ReferencePermutation) и
+    // собирает формулы, чьи
+    // ссылки нужно переписать
+    template<typename Remap>
+    void RemapRegistries(const Remap& remap, std::unordered_set<Cell*>& dependents);
+    // Переписывает ссылки dependents на этот лист; формулы других листов
+    // попадают в их журналы, а позиции формул этого листа возвращаются
+    template<typename Remap>
+    std::vector<Position> RewriteReferences(const Remap& remap, const std::unordered_set<Cell*>& dependents);
     void IsValidPosition(const Position& pos) const;
-    void ResizePrintableArea(const Position& pos);
-};
\ No newline at end of file
+    void ValidateBlock(const Range& source, Position dest) const;
+    void UpdatePrintableArea(Position pos, bool wasEmpty, bool isEmpty);
+    void UpdatePrintableArea(const CountChanges& counts);
+    void ReleaseCell(Position pos);
+    RecalcStatus DoRecalculateSlice(std::chrono::steady_clock::time_point deadline, const CancellationToken& token);
+    // Вызывается перед правкой: останавливает фоновые пересчёты книги
+    void StopBackgroundWork();
+    void PrintCells(std::ostream& output, const std::function<void(const Cell&)>& print) const;
+    const Cell* FindCell(Position pos) const;
+    void RecordChange(Position pos);
+    void RecordChanges(const std::vector<Position>& positions);
+    void RecordShift(const ReferenceShift& shift);
+    void QueueChanges(const std::vector<Position>& changed);
+    void NotifySubscribers();
+};
+
+template<typename F>
+void Sheet::ForEachRangeDependent(Position pos, F f) const {
+    range_refs_.ForEachContaining(pos, [&f](RangeRefs::const_iterator ref) {
+        for (Cell* dependent : ref->second) {
+            f(dependent);
+        }
+    });
+}
@@ -0,0 +1,41 @@
+#include "spill_file.h"
+
+#include <cstdio>
+#include <stdexcept>
+
+SpillFile::SpillFile(std::string path)
+        : path_(std::move(path)),
+          file_(path_, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc) {
+    if (!file_) {
+        throw std::runtime_error("Cannot open spill file " + path_);
+    }
+}
+
+SpillFile::~SpillFile() {
+    file_.close();
+    std::remove(path_.c_str());
+}
+
+void SpillFile::Write(Extent& extent, std::string_view data) {
+    if (data.size() > extent.capacity) {
+        extent.offset = size_;
+        extent.capacity = static_cast<uint32_t>(data.size());
+        size_ += data.size();
+    }
+    extent.size = static_cast<uint32_t>(data.size());
+    file_.seekp(static_cast<std::streamoff>(extent.offset));
+    file_.write(data.data(), static_cast<std::streamsize>(data.size()));
+    if (!file_) {
+        throw std::runtime_error("Cannot write spill file " + path_);
+    }
+}
+
+std::string SpillFile::Read(const Extent& extent) {
+    std::string data(extent.size, '\0');
+    file_.seekg(static_cast<std::streamoff>(extent.offset));
+    file_.read(data.data(), static_cast<std::streamsize>(data.size()));
+    if (!file_) {
+        throw std::runtime_error("Cannot read spill file " + path_);
+    }
+    return data;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <string_view>
+
+// Файл, в который лист вытесняет холодные плитки ячеек. Каждая плитка
+// занимает свой участок; при повторном вытеснении запись ложится на прежнее
+// место, если помещается в него. Файл удаляется при разрушении объекта.
+// Ошибки ввода-вывода вызывают std::runtime_error.
+class SpillFile {
+public:
+    struct Extent {
+        uint64_t offset = 0;
+        uint32_t capacity = 0;
+        uint32_t size = 0;
+    };
+
+    explicit SpillFile(std::string path);
+
+    SpillFile(const SpillFile&) = delete;
+
+    SpillFile& operator=(const SpillFile&) = delete;
+
+    ~SpillFile();
+
+    // Записывает data в участок extent, при необходимости выделяя новый
+    void Write(Extent& extent, std::string_view data);
+
+    std::string Read(const Extent& extent);
+
+    uint64_t GetSize() const {
+        return size_;
+    }
+
+private:
+    std::string path_;
+    std::fstream file_;
+    uint64_t size_ = 0;
+};
@@ -0,0 +1,60 @@
+#include "string_pool.h"
+#include "memory.h"
+
+StringPool::Id StringPool::Intern(std::string_view text) {
+    if (auto it = index_.find(text); it != index_.end()) {
+        ++entries_[it->second].refs;
+        return it->second;
+    }
+
+    Id id;
+    if (!free_ids_.empty()) {
+        id = free_ids_.back();
+        free_ids_.pop_back();
+    } else {
+        id = static_cast<Id>(entries_.size());
+        entries_.emplace_back();
+    }
+    auto& entry = entries_[id];
+    entry.text = text;
+    entry.refs = 1;
+    text_heap_bytes_ += StringHeapBytes(entry.text);
+    index_.emplace(entry.text, id);
+    return id;
+}
+
+void StringPool::Release(Id id) {
+    auto& entry = entries_[id];
+    if (--entry.refs > 0) {
+        return;
+    }
+    index_.erase(entry.text);
+    text_heap_bytes_ -= StringHeapBytes(entry.text);
+    std::string().swap(entry.text);
+    free_ids_.push_back(id);
+}
+
+StringPool::Stats StringPool::GetStats() const {
+    Stats stats;
+    for (const auto& entry : entries_) {
+        if (entry.refs == 0) {
+            continue;
+        }
+        ++stats.unique_strings;
+        stats.references += entry.refs;
+        stats.stored_bytes += entry.text.size();
+        stats.referenced_bytes += entry.text.size() * entry.refs;
+    }
+    return stats;
+}
+
+size_t StringPool::GetMemoryBytes() const {
+    // Узел индекса хранит пару, указатель на следующий узел и хеш ключа
+    constexpr size_t index_node_bytes = sizeof(std::pair<const std::string_view, Id>)
+                                        + sizeof(void*) + sizeof(size_t);
+    return entries_.size() * sizeof(Entry)
+           + text_heap_bytes_
+           + free_ids_.capacity() * sizeof(Id)
+           + index_.size() * index_node_bytes
+           + index_.bucket_count() * sizeof(void*);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Пул строк листа: одинаковые тексты ячеек хранятся один раз и
+// сравниваются по идентификатору. Строка удаляется из пула, когда
+// освобождается последняя ссылка на неё.
+class StringPool {
+public:
+    using Id = uint32_t;
+
+    struct Stats {
+        size_t unique_strings = 0;
+        size_t references = 0;
+        // Байты текста, хранящиеся в пуле
+        size_t stored_bytes = 0;
+        // Байты, которые заняли бы тексты, будь у каждой ссылки своя копия
+        size_t referenced_bytes = 0;
+    };
+
+    Id Intern(std::string_view text);
+
+    void Release(Id id);
+
+    std::string_view Get(Id id) const {
+        return entries_[id].text;
+    }
+
+    Stats GetStats() const;
+
+    // Память, занятая пулом, в байтах; размер узлов индекса оценивается
+    size_t GetMemoryBytes() const;
+
+private:
+    struct Entry {
+        std::string text;
+        uint32_t refs = 0;
+    };
+
+    // deque не перемещает элементы при росте, поэтому ключи индекса
+    // могут ссылаться на строки внутри записей
+    std::deque<Entry> entries_;
+    std::vector<Id> free_ids_;
+    std::unordered_map<std::string_view, Id> index_;
+    // Байты текстов, вынесенных строками в кучу
+    size_t text_heap_bytes_ = 0;
+};
+
+// Владеющая ссылка на строку пула
+class PooledString {
+public:
+    PooledString(StringPool& pool, std::string_view text)
+            : pool_(&pool), id_(pool.Intern(text)) {
+    }
+
+    PooledString(PooledString&& other) noexcept
+            : pool_(other.pool_), id_(other.id_) {
+        other.pool_ = nullptr;
+    }
+
+    PooledString& operator=(PooledString&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            pool_ = other.pool_;
+            id_ = other.id_;
+            other.pool_ = nullptr;
+        }
+        return *this;
+    }
+
+    PooledString(const PooledString&) = delete;
+
+    PooledString& operator=(const PooledString&) = delete;
+
+    ~PooledString() {
+        Reset();
+    }
+
+    std::string_view Get() const {
+        return pool_->Get(id_);
+    }
+
+    StringPool::Id GetId() const {
+        return id_;
+    }
+
+    bool operator==(const PooledString& rhs) const {
+        return pool_ == rhs.pool_ && id_ == rhs.id_;
+    }
+
+private:
+    void Reset() {
+        if (pool_) {
+            pool_->Release(id_);
+            pool_ = nullptr;
+        }
+    }
+
+    StringPool* pool_;
+    StringPool::Id id_;
+};
@@ -1,80 +1,109 @@
 #include "common.h"
 
-#include <cctype>
-#include <sstream>
 #include <algorithm>
+#include <tuple>
 
-const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
-const int MAX_POS_LETTER_COUNT = 3;
-
-const Position Position::NONE = {-1, -1};
+bool Position::operator<(const Position rhs) const {
+    return std::tie(row, col) < std::tie(rhs.row, rhs.col);
+}
 
-bool Position::operator==(const Position rhs) const {
-    return row == rhs.row && col == rhs.col;
+std::string Position::ToString() const {
+    char buffer[MAX_STRING_LENGTH];
+    return {buffer, ToChars(buffer)};
 }
 
-bool Position::operator<(const Position rhs) const {
-    return std::tie(row, col) < std::tie(rhs.row, rhs.col);
+bool Size::operator==(Size rhs) const {
+    return cols == rhs.cols && rows == rhs.rows;
 }
 
-bool Position::IsValid() const {
-    return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
+bool ExternalCell::operator<(const ExternalCell& rhs) const {
+    return std::tie(sheet, pos) < std::tie(rhs.sheet, rhs.pos);
 }
 
-std::string Position::ToString() const {
-    if (!IsValid()) {
-        return "";
-    }
+std::string ExternalCell::ToString() const {
+    return sheet + '!' + pos.ToString();
+}
 
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
-    int c = col;
-    while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
-        c = c / LETTERS - 1;
-    }
+bool Range::operator<(const Range& rhs) const {
+    return std::tie(first, last) < std::tie(rhs.first, rhs.last);
+}
 
-    result += std::to_string(row + 1);
+std::string Range::ToString() const {
+    return first.ToString() + ':' + last.ToString();
+}
 
-    return result;
+bool RangeRef::operator<(const RangeRef& rhs) const {
+    return std::tie(sheet, range) < std::tie(rhs.sheet, rhs.range);
 }
 
-Position Position::FromString(std::string_view str) {
-    auto it = std::find_if(str.begin(), str.end(), [](const char c) {
-        return !(std::isalpha(c) && std::isupper(c));
-    });
-    auto letters = str.substr(0, it - str.begin());
-    auto digits = str.substr(it - str.begin());
+std::string RangeRef::ToString() const {
+    return sheet.empty() ? range.ToString() : sheet + '!' + range.ToString();
+}
 
-    if (letters.empty() || digits.empty()) {
-        return Position::NONE;
+Position ReferenceShift::Apply(Position pos) const {
+    int& index = axis == Axis::Rows ? pos.row : pos.col;
+    if (index < first) {
+        return pos;
     }
-    if (letters.size() > MAX_POS_LETTER_COUNT) {
+    if (index < GetMovedFrom()) {
         return Position::NONE;
     }
+    index += delta;
+    return pos.IsValid() ? pos : Position::NONE;
+}
 
-    if (!std::isdigit(digits[0])) {
-        return Position::NONE;
+Range ReferenceShift::Apply(Range range) const {
+    bool rows = axis == Axis::Rows;
+    int& low = rows ? range.first.row : range.first.col;
+    int& high = rows ? range.last.row : range.last.col;
+    int limit = (rows ? Position::MAX_ROWS : Position::MAX_COLS) - 1;
+    if (delta > 0) {
+        // Вставка перед диапазоном сдвигает его, внутри — расширяет; край,
+        // ушедший за пределы листа, прижимается к границе
+        low += low >= first ? delta : 0;
+        high = high >= first ? std::min(high + delta, limit) : high;
+    } else {
+        int movedFrom = GetMovedFrom();
+        low = low < first ? low : low >= movedFrom ? low + delta : first;
+        high = high < first ? high : high >= movedFrom ? high + delta : first - 1;
     }
+    return range.IsValid() ? range : Range{Position::NONE, Position::NONE};
+}
 
-    int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
-        return Position::NONE;
+Range ReferenceMove::GetTarget() const {
+    return {{source.first.row + rows, source.first.col + cols}, {source.last.row + rows, source.last.col + cols}};
+}
+
+Position ReferenceMove::Apply(Position pos) const {
+    if (source.Contains(pos)) {
+        return {pos.row + rows, pos.col + cols};
     }
+    return GetTarget().Contains(pos) ? Position::NONE : pos;
+}
 
-    int col = 0;
-    for (char ch : letters) {
-        col *= LETTERS;
-        col += ch - 'A' + 1;
+Range ReferenceMove::Apply(Range range) const {
+    if (source.Contains(range.first) && source.Contains(range.last)) {
+        return {Apply(range.first), Apply(range.last)};
+    }
+    Range target = GetTarget();
+    if (target.Contains(range.first) && target.Contains(range.last)) {
+        return {Position::NONE, Position::NONE};
     }
+    return range;
+}
 
-    return {row - 1, col - 1};
+Position ReferencePermutation::Apply(Position pos) const {
+    if (!block.Contains(pos)) {
+        return pos;
+    }
+    return {block.first.row + rows[pos.row - block.first.row], pos.col};
 }
 
-bool Size::operator==(Size rhs) const {
-    return cols == rhs.cols && rows == rhs.rows;
+Range ReferencePermutation::Apply(Range range) const {
+    if (range.first.row != range.last.row || !block.Contains(range.first) || !block.Contains(range.last)) {
+        return range;
+    }
+    return {Apply(range.first), Apply(range.last)};
 }
 
 /*Size& Size::operator=(const Size& other) {
@@ -0,0 +1,138 @@
+#include "subexpressions.h"
+
+#include <algorithm>
+#include <functional>
+
+namespace {
+    size_t HashOperand(const SubexpressionTable::Operand& operand) {
+        size_t hash = operand.index();
+        if (const auto* number = std::get_if<double>(&operand)) {
+            return hash ^ std::hash<double>()(*number);
+        }
+        if (const auto* pos = std::get_if<Position>(&operand)) {
+            return hash ^ PositionHasher()(*pos);
+        }
+        return hash ^ std::hash<const void*>()(std::get<SubexpressionTable::Node*>(operand));
+    }
+
+    SubexpressionTable::Node* GetNode(const SubexpressionTable::Operand& operand) {
+        const auto* node = std::get_if<SubexpressionTable::Node*>(&operand);
+        return node ? *node : nullptr;
+    }
+}
+
+bool SubexpressionTable::Key::operator==(const Key& other) const {
+    return op == other.op && unary == other.unary && lhs == other.lhs && rhs == other.rhs;
+}
+
+size_t SubexpressionTable::KeyHasher::operator()(const Key& key) const {
+    size_t hash = static_cast<size_t>(key.op) * 2 + key.unary;
+    hash = hash * 1'000'003 + HashOperand(key.lhs);
+    return hash * 1'000'003 + HashOperand(key.rhs);
+}
+
+SubexpressionTable::SubexpressionTable(MemoryCounter& memory)
+        : memory_(memory),
+          nodes_(Nodes::allocator_type(memory, MemoryCategory::Subexpressions)),
+          cell_nodes_(CellNodes::allocator_type(memory, MemoryCategory::Subexpressions)) {
+}
+
+SubexpressionTable::Node* SubexpressionTable::Acquire(char op, const Operand& lhs,
+                                                      const std::optional<Operand>& rhs) {
+    auto [it, inserted] = nodes_.try_emplace(Key{op, !rhs, lhs, rhs.value_or(Operand())});
+    Node& node = it->second;
+    ++node.refs;
+    if (!inserted) {
+        return &node;
+    }
+
+    node.table = this;
+    node.key = &it->first;
+    node.cells = decltype(node.cells)({memory_, MemoryCategory::Subexpressions});
+    // Узел держит узлы операндов и зависит от всех ячеек их поддеревьев,
+    // поэтому сброс значения по ячейке не обходит родителей
+    std::vector<Position> cells;
+    for (const Operand* operand : {&node.key->lhs, &node.key->rhs}) {
+        if (const auto* pos = std::get_if<Position>(operand)) {
+            cells.push_back(*pos);
+        } else if (Node* child = GetNode(*operand)) {
+            ++child->refs;
+            for (const auto& cell : child->cells) {
+                cells.push_back(cell.first);
+            }
+        }
+    }
+    std::sort(cells.begin(), cells.end());
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+    node.cells.reserve(cells.size());
+    for (Position pos : cells) {
+        auto& list = cell_nodes_.try_emplace(pos, NodeList::allocator_type(memory_, MemoryCategory::Subexpressions))
+                .first->second;
+        node.cells.emplace_back(pos, static_cast<uint32_t>(list.size()));
+        list.push_back(&node);
+    }
+    return &node;
+}
+
+void SubexpressionTable::Release(Node* node) {
+    if (--node->refs > 0) {
+        return;
+    }
+    // Узел удаляется из списков своих ячеек перестановкой с последним
+    for (const auto& [pos, slot] : node->cells) {
+        auto it = cell_nodes_.find(pos);
+        auto& list = it->second;
+        Node* last = list.back();
+        list[slot] = last;
+        list.pop_back();
+        if (last != node) {
+            for (auto& cell : last->cells) {
+                if (cell.first == pos) {
+                    cell.second = slot;
+                    break;
+                }
+            }
+        }
+        if (list.empty()) {
+            cell_nodes_.erase(it);
+        }
+    }
+    Key key = *node->key;
+    nodes_.erase(key);
+    for (const Operand* operand : {&key.lhs, &key.rhs}) {
+        if (Node* child = GetNode(*operand)) {
+            Release(child);
+        }
+    }
+}
+
+void SubexpressionTable::Invalidate(Position pos) {
+    if (cell_nodes_.empty()) {
+        return;
+    }
+    if (auto it = cell_nodes_.find(pos); it != cell_nodes_.end()) {
+        for (Node* node : it->second) {
+            node->value.reset();
+        }
+    }
+}
+
+void SubexpressionTable::InvalidateAll() {
+    for (auto& [key, node] : nodes_) {
+        node.value.reset();
+    }
+}
+
+SubexpressionTable::Stats SubexpressionTable::GetStats() const {
+    Stats stats;
+    stats.nodes = nodes_.size();
+    for (const auto& [key, node] : nodes_) {
+        stats.references += node.refs;
+        if (node.refs > 1) {
+            ++stats.shared_nodes;
+        }
+    }
+    stats.evaluations = evaluations_;
+    stats.hits = hits_;
+    return stats;
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "common.h"
+#include "memory.h"
+
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Общие подвыражения формул листа. Арифметические узлы деревьев разбора с
+// одной операцией над одними операндами — числами, ячейками листа и
+// такими же узлами — ссылаются на один узел таблицы, который запоминает
+// значение: подвыражение, повторённое в сотнях формул, вычисляется один
+// раз за пересчёт. Узлы ссылаются на узлы своих операндов и образуют DAG;
+// узел удаляется вместе с последней ссылкой на него.
+//
+// Значения сбрасываются по тем же связям, что и кэши ячеек: лист вызывает
+// Invalidate для каждой ячейки, кэш которой сброшен или которая очищена, а
+// при переносе ячеек сбрасывает все значения.
+//
+// Узел таблицы занимает больше памяти, чем узел дерева, поэтому таблица
+// окупается на листах с повторяющимися подвыражениями, и лист связывает с
+// ней формулы только по запросу.
+class SubexpressionTable {
+public:
+    struct Node;
+
+    // Операнд узла: число, ячейка листа или другой узел
+    using Operand = std::variant<double, Position, Node*>;
+    using Value = std::variant<double, FormulaError>;
+
+    struct Key {
+        char op = 0;
+        bool unary = false;
+        Operand lhs;
+        Operand rhs;
+
+        bool operator==(const Key& other) const;
+    };
+
+    struct Node {
+        SubexpressionTable* table = nullptr;
+        const Key* key = nullptr;
+        std::optional<Value> value;
+        uint32_t refs = 0;
+        // Ячейки поддерева без повторов и место узла в списке узлов каждой
+        // из них
+        std::vector<std::pair<Position, uint32_t>, CountingAllocator<std::pair<Position, uint32_t>>> cells;
+    };
+
+    struct Stats {
+        size_t nodes = 0;
+        // Узлы, на которые ссылается больше одного дерева или узла
+        size_t shared_nodes = 0;
+        // Ссылки деревьев и узлов-родителей на узлы
+        size_t references = 0;
+        // Вычисления узлов и обращения к запомненным значениям
+        uint64_t evaluations = 0;
+        uint64_t hits = 0;
+    };
+
+    explicit SubexpressionTable(MemoryCounter& memory);
+
+    SubexpressionTable(const SubexpressionTable&) = delete;
+
+    SubexpressionTable& operator=(const SubexpressionTable&) = delete;
+
+    // Находит либо добавляет узел операции op над lhs и rhs; у унарной
+    // операции rhs нет. Ссылка на узел держится до Release.
+    Node* Acquire(char op, const Operand& lhs, const std::optional<Operand>& rhs = std::nullopt);
+
+    void Release(Node* node);
+
+    // Запомненное значение узла либо результат compute, который
+    // запоминается; запомненная ошибка бросается снова
+    template<typename F>
+    double Evaluate(Node& node, F compute);
+
+    // Сбрасывает значения узлов, в поддеревьях которых есть ячейка pos
+    void Invalidate(Position pos);
+
+    void InvalidateAll();
+
+    Stats GetStats() const;
+
+private:
+    struct KeyHasher {
+        size_t operator()(const Key& key) const;
+    };
+
+    using Nodes = std::unordered_map<Key, Node, KeyHasher, std::equal_to<Key>,
+                                     CountingAllocator<std::pair<const Key, Node>>>;
+    using NodeList = std::vector<Node*, CountingAllocator<Node*>>;
+    using CellNodes = std::unordered_map<Position, NodeList, PositionHasher, std::equal_to<Position>,
+                                         CountingAllocator<std::pair<const Position, NodeList>>>;
+
+    MemoryCounter& memory_;
+    Nodes nodes_;
+    // Узлы, в поддеревьях которых есть ячейка
+    CellNodes cell_nodes_;
+    uint64_t evaluations_ = 0;
+    uint64_t hits_ = 0;
+};
+
+template<typename F>
+double SubexpressionTable::Evaluate(Node& node, F compute) {
+    if (node.value) {
+        ++hits_;
+        if (const auto* error = std::get_if<FormulaError>(&*node.value)) {
+            throw *error;
+        }
+        return std::get<double>(*node.value);
+    }
+    ++evaluations_;
+    try {
+        double result = compute();
+        node.value = result;
+        return result;
+    } catch (const FormulaError& error) {
+        node.value = error;
+        throw;
+    }
+}
+
+// Владеющая ссылка узла дерева разбора на узел таблицы
+class SubexpressionRef {
+public:
+    SubexpressionRef() = default;
+
+    explicit SubexpressionRef(SubexpressionTable::Node* node)
+            : node_(node) {
+    }
+
+    SubexpressionRef(SubexpressionRef&& other) noexcept
+            : node_(other.node_) {
+        other.node_ = nullptr;
+    }
+
+    SubexpressionRef& operator=(SubexpressionRef&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            node_ = other.node_;
+            other.node_ = nullptr;
+        }
+        return *this;
+    }
+
+    SubexpressionRef(const SubexpressionRef&) = delete;
+
+    SubexpressionRef& operator=(const SubexpressionRef&) = delete;
+
+    ~SubexpressionRef() {
+        Reset();
+    }
+
+    SubexpressionTable::Node* Get() const {
+        return node_;
+    }
+
+    // Значение узла таблицы либо, без узла, просто результат compute
+    template<typename F>
+    double Evaluate(F compute) const {
+        return node_ ? node_->table->Evaluate(*node_, compute) : compute();
+    }
+
+    void Reset() {
+        if (node_) {
+            node_->table->Release(node_);
+            node_ = nullptr;
+        }
+    }
+
+private:
+    // Таблица хранится в узле, поэтому ссылка занимает один указатель
+    SubexpressionTable::Node* node_ = nullptr;
+};
@@ -0,0 +1,67 @@
+#include "thread_pool.h"
+
+#include <utility>
+
+ThreadPool::ThreadPool(size_t threads) {
+    workers_.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+        workers_.emplace_back([this] { Work(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    task_ready_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+void ThreadPool::Run(std::vector<std::function<void()>> tasks) {
+    if (workers_.empty() || tasks.size() < 2) {
+        for (auto& task : tasks) {
+            task();
+        }
+        return;
+    }
+
+    std::unique_lock lock(mutex_);
+    unfinished_ += tasks.size();
+    for (auto& task : tasks) {
+        tasks_.push_back(std::move(task));
+    }
+    task_ready_.notify_all();
+    batch_done_.wait(lock, [this] { return unfinished_ == 0; });
+    if (auto error = std::exchange(error_, nullptr)) {
+        std::rethrow_exception(error);
+    }
+}
+
+void ThreadPool::Work() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        task_ready_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+        if (tasks_.empty()) {
+            return;
+        }
+        auto task = std::move(tasks_.front());
+        tasks_.pop_front();
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+            task();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+        if (error && !error_) {
+            error_ = error;
+        }
+        if (--unfinished_ == 0) {
+            batch_done_.notify_all();
+        }
+    }
+}
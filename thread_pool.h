@@ -0,0 +1,44 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков фиксированного размера. Run раздаёт пакет задач рабочим
+// потокам и ждёт их завершения; пул без потоков выполняет задачи в
+// вызывающем потоке.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads);
+
+    ThreadPool(const ThreadPool&) = delete;
+
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool();
+
+    size_t GetThreadCount() const {
+        return workers_.size();
+    }
+
+    // Выполняет задачи и возвращает управление, когда все они завершены.
+    // Пакеты выполняются по одному: Run не вызывается из нескольких потоков.
+    // Исключение первой упавшей задачи пробрасывается вызывающему.
+    void Run(std::vector<std::function<void()>> tasks);
+
+private:
+    void Work();
+
+    std::mutex mutex_;
+    std::condition_variable task_ready_;
+    std::condition_variable batch_done_;
+    std::deque<std::function<void()>> tasks_;
+    size_t unfinished_ = 0;
+    std::exception_ptr error_;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+};
@@ -0,0 +1,188 @@
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace trace {
+
+    namespace {
+        struct Event {
+            const char* name = nullptr;
+            // 'X' — событие с длительностью, 's' и 't' — начало и шаг стрелки
+            char phase = 'X';
+            uint64_t start_ns = 0;
+            uint64_t duration_ns = 0;
+            Position pos = Position::NONE;
+            uint64_t edit = 0;
+            int64_t count = -1;
+        };
+
+        struct ThreadBuffer {
+            explicit ThreadBuffer(uint32_t tid) : tid(tid), events(BUFFER_CAPACITY) {
+            }
+
+            uint32_t tid;
+            std::vector<Event> events;
+            // Пишет только поток-владелец; читатели видят события до written
+            std::atomic<uint64_t> written{0};
+        };
+
+        std::atomic<bool> enabled{false};
+        std::atomic<uint64_t> next_edit{1};
+
+        // Буферы живут в реестре и после завершения своих потоков, чтобы
+        // их события попали в вывод. Мьютекс берётся только при
+        // регистрации потока, очистке и выводе.
+        std::mutex registry_mutex;
+        std::vector<std::shared_ptr<ThreadBuffer>> registry;
+
+        thread_local uint64_t current_edit = 0;
+
+        ThreadBuffer& GetThreadBuffer() {
+            thread_local std::shared_ptr<ThreadBuffer> buffer = [] {
+                std::lock_guard guard(registry_mutex);
+                auto created = std::make_shared<ThreadBuffer>(static_cast<uint32_t>(registry.size() + 1));
+                registry.push_back(created);
+                return created;
+            }();
+            return *buffer;
+        }
+
+        uint64_t Now() {
+            static const auto epoch = std::chrono::steady_clock::now();
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - epoch).count();
+        }
+
+        void Push(const Event& event) {
+            auto& buffer = GetThreadBuffer();
+            uint64_t written = buffer.written.load(std::memory_order_relaxed);
+            buffer.events[written % BUFFER_CAPACITY] = event;
+            buffer.written.store(written + 1, std::memory_order_release);
+        }
+
+        void WriteEvent(std::ostream& out, const Event& event, uint32_t tid) {
+            out << "{\"name\":\"" << event.name << "\",\"ph\":\"" << event.phase
+                << "\",\"pid\":1,\"tid\":" << tid
+                << ",\"ts\":" << event.start_ns / 1000 << '.' << event.start_ns % 1000 / 100;
+            if (event.phase == 'X') {
+                out << ",\"dur\":" << event.duration_ns / 1000 << '.' << event.duration_ns % 1000 / 100
+                    << ",\"args\":{\"edit\":" << event.edit;
+                if (event.pos.IsValid()) {
+                    out << ",\"cell\":\"" << event.pos.ToString() << '"';
+                }
+                if (event.count >= 0) {
+                    out << ",\"count\":" << event.count;
+                }
+                out << '}';
+            } else {
+                out << ",\"cat\":\"edit\",\"id\":" << event.edit;
+                if (event.phase == 't') {
+                    out << ",\"bp\":\"e\"";
+                }
+            }
+            out << '}';
+        }
+    }  // namespace
+
+    void Start() {
+        enabled.store(true, std::memory_order_relaxed);
+    }
+
+    void Stop() {
+        enabled.store(false, std::memory_order_relaxed);
+    }
+
+    bool IsEnabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    void Clear() {
+        std::lock_guard guard(registry_mutex);
+        for (auto& buffer : registry) {
+            buffer->written.store(0, std::memory_order_release);
+        }
+    }
+
+    void WriteChromeTrace(std::ostream& out) {
+        std::lock_guard guard(registry_mutex);
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        bool first = true;
+        for (const auto& buffer : registry) {
+            uint64_t written = buffer->written.load(std::memory_order_acquire);
+            uint64_t begin = written > BUFFER_CAPACITY ? written - BUFFER_CAPACITY : 0;
+            for (uint64_t i = begin; i < written; ++i) {
+                out << (first ? "\n" : ",\n");
+                first = false;
+                WriteEvent(out, buffer->events[i % BUFFER_CAPACITY], buffer->tid);
+            }
+        }
+        out << "\n]}\n";
+    }
+
+    uint64_t CurrentEdit() {
+        return current_edit;
+    }
+
+    Scope::Scope(const char* name, Position pos, uint64_t edit)
+            : name_(name), pos_(pos), edit_(edit ? edit : current_edit), linked_(edit != 0) {
+        if (IsEnabled()) {
+            start_ = Now();
+        } else {
+            name_ = nullptr;
+        }
+    }
+
+    Scope::~Scope() {
+        if (!name_) {
+            return;
+        }
+        Event event;
+        event.name = name_;
+        event.start_ns = start_;
+        event.duration_ns = Now() - start_;
+        event.pos = pos_;
+        event.edit = edit_;
+        event.count = count_;
+        Push(event);
+        if (linked_) {
+            Event step;
+            step.name = "edit";
+            step.phase = 't';
+            step.start_ns = start_;
+            step.edit = edit_;
+            Push(step);
+        }
+    }
+
+    namespace {
+        // Выдаёт номер новой правки и возвращает номер предыдущей
+        uint64_t BeginEdit() {
+            uint64_t previous = current_edit;
+            if (IsEnabled()) {
+                current_edit = next_edit.fetch_add(1, std::memory_order_relaxed);
+            }
+            return previous;
+        }
+    }  // namespace
+
+    Edit::Edit(const char* name, Position pos) : previous_(BeginEdit()), scope_(name, pos) {
+        if (current_edit != previous_) {
+            Event event;
+            event.name = "edit";
+            event.phase = 's';
+            event.start_ns = Now();
+            event.edit = current_edit;
+            Push(event);
+        }
+    }
+
+    Edit::~Edit() {
+        current_edit = previous_;
+    }
+
+}  // namespace trace
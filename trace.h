@@ -0,0 +1,85 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <iosfwd>
+
+// Трассировка операций листа во временную шкалу формата Chrome trace
+// events, которую можно открыть в Perfetto или chrome://tracing.
+// Точки трассировки компилируются только при определённом
+// SPREADSHEET_TRACING и до вызова trace::Start() обходятся одной
+// проверкой флага.
+//
+// События пишутся в кольцевой буфер своего потока без блокировок; при
+// переполнении старые события затираются. Каждое изменение ячейки
+// получает номер правки: события внутри правки помечаются им, а
+// вычисления формул, кэш которых сбросила правка, связываются с ней
+// стрелками (flow events).
+namespace trace {
+
+    // Число событий, которое хранит буфер одного потока
+    inline constexpr size_t BUFFER_CAPACITY = 1 << 16;
+
+    void Start();
+
+    void Stop();
+
+    bool IsEnabled();
+
+    // Удаляет записанные события всех потоков
+    void Clear();
+
+    // Выводит события всех потоков в формате JSON. Вызывать после Stop(),
+    // иначе события, записываемые в этот момент, могут оказаться
+    // испорченными.
+    void WriteChromeTrace(std::ostream& out);
+
+    // Номер текущей правки потока или 0 вне правки
+    uint64_t CurrentEdit();
+
+    // Событие с длительностью от создания до разрушения объекта. Если
+    // edit не задан, событие относится к текущей правке; иначе событие
+    // связывается стрелкой с указанной правкой.
+    class Scope {
+    public:
+        explicit Scope(const char* name, Position pos = Position::NONE, uint64_t edit = 0);
+
+        Scope(const Scope&) = delete;
+
+        Scope& operator=(const Scope&) = delete;
+
+        ~Scope();
+
+        // Числовой аргумент события, например число затронутых ячеек
+        void SetCount(int64_t count) {
+            count_ = count;
+        }
+
+    private:
+        const char* name_;
+        Position pos_;
+        uint64_t edit_;
+        bool linked_;
+        int64_t count_ = -1;
+        uint64_t start_ = 0;
+    };
+
+    // Правка листа: событие, которое получает новый номер правки и делает
+    // его текущим для потока на время своего существования
+    class Edit {
+    public:
+        Edit(const char* name, Position pos);
+
+        Edit(const Edit&) = delete;
+
+        Edit& operator=(const Edit&) = delete;
+
+        ~Edit();
+
+    private:
+        uint64_t previous_;
+        Scope scope_;
+    };
+
+}  // namespace trace
@@ -0,0 +1,160 @@
+#include "workbook.h"
+#include "trace.h"
+
+#include <cctype>
+#include <deque>
+#include <stdexcept>
+
+namespace {
+    bool IsValidSheetName(std::string_view name) {
+        if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0]))) {
+            return false;
+        }
+        for (char c : name) {
+            bool latin = (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+            if (!latin && !std::isdigit(static_cast<unsigned char>(c)) && c != '_') {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t GetDefaultThreadCount() {
+        // Один поток не даёт параллельности: пересчёт идёт в вызывающем потоке
+        size_t cores = std::thread::hardware_concurrency();
+        return cores > 1 ? cores : 0;
+    }
+}
+
+Workbook::Workbook(size_t threads)
+        : pool_(threads > 0 ? threads : GetDefaultThreadCount()) {
+}
+
+Workbook::~Workbook() {
+    // Фоновый пересчёт листа читает другие листы: все потоки
+    // останавливаются до удаления первого листа
+    StopRecalculation();
+}
+
+Sheet& Workbook::AddSheet(std::string name) {
+    if (!IsValidSheetName(name)) {
+        throw std::invalid_argument("Invalid sheet name: " + name);
+    }
+    if (sheets_by_name_.count(name)) {
+        throw std::invalid_argument("Duplicate sheet name: " + name);
+    }
+    StopRecalculation();
+    Sheet& sheet = *sheets_.emplace_back(std::make_unique<Sheet>(*this, std::move(name)));
+    sheets_by_name_.emplace(sheet.GetName(), &sheet);
+
+    // Формулы, ссылавшиеся на отсутствовавший лист, задаются заново и
+    // подключаются к его ячейкам
+    if (auto it = missing_refs_.find(std::string(sheet.GetName())); it != missing_refs_.end()) {
+        std::vector<Cell*> dependents(it->second.begin(), it->second.end());
+        for (Cell* cell : dependents) {
+            cell->GetSheet().SetCell(cell->GetPosition(), cell->GetText());
+        }
+    }
+    return sheet;
+}
+
+Sheet* Workbook::GetSheet(std::string_view name) {
+    auto it = sheets_by_name_.find(name);
+    return it == sheets_by_name_.end() ? nullptr : it->second;
+}
+
+const Sheet* Workbook::GetSheet(std::string_view name) const {
+    return const_cast<Workbook&>(*this).GetSheet(name);
+}
+
+std::vector<std::string_view> Workbook::GetSheetNames() const {
+    std::vector<std::string_view> names;
+    names.reserve(sheets_.size());
+    for (const auto& sheet : sheets_) {
+        names.push_back(sheet->GetName());
+    }
+    return names;
+}
+
+void Workbook::StopRecalculation() {
+    for (const auto& sheet : sheets_) {
+        sheet->StopRecalculation();
+    }
+}
+
+void Workbook::AddMissingRef(const std::string& sheet, Cell* dependent) {
+    missing_refs_[sheet].insert(dependent);
+}
+
+void Workbook::RemoveMissingRef(const std::string& sheet, Cell* dependent) {
+    auto it = missing_refs_.find(sheet);
+    if (it == missing_refs_.end()) {
+        return;
+    }
+    it->second.erase(dependent);
+    if (it->second.empty()) {
+        missing_refs_.erase(it);
+    }
+}
+
+void Workbook::ChangeLinks(const Sheet* from, const Sheet* to, int delta) {
+    auto& count = links_[{from, to}];
+    count += delta;
+    if (count == 0) {
+        links_.erase({from, to});
+    }
+}
+
+void Workbook::Recalculate() {
+#ifdef SPREADSHEET_TRACING
+    trace::Scope scope("Recalculate");
+#endif
+    StopRecalculation();
+    std::vector<Sheet*> stale;
+    for (const auto& sheet : sheets_) {
+        if (sheet->IsStale()) {
+            stale.push_back(sheet.get());
+        }
+    }
+    if (stale.empty()) {
+        return;
+    }
+
+    // Листы, связанные ссылками хотя бы косвенно, объединяются в группы:
+    // вычисление ячейки одного листа может дойти до ячеек другого
+    std::unordered_map<const Sheet*, const Sheet*> parent;
+    auto find = [&parent](const Sheet* sheet) {
+        for (auto it = parent.find(sheet); it != parent.end(); it = parent.find(sheet)) {
+            sheet = it->second;
+        }
+        return sheet;
+    };
+    for (const auto& [link, count] : links_) {
+        const Sheet* lhs = find(link.first);
+        const Sheet* rhs = find(link.second);
+        if (lhs != rhs) {
+            parent[lhs] = rhs;
+        }
+    }
+
+    std::unordered_map<const Sheet*, std::vector<Sheet*>> groups;
+    for (Sheet* sheet : stale) {
+        groups[find(sheet)].push_back(sheet);
+    }
+    std::vector<std::function<void()>> tasks;
+    tasks.reserve(groups.size());
+    for (auto& [root, sheets] : groups) {
+        tasks.push_back([sheets = std::move(sheets)] {
+            for (Sheet* sheet : sheets) {
+                sheet->Recalculate();
+            }
+        });
+    }
+    // Вытеснение плиток на диск меняет хранилище листа, поэтому на время
+    // параллельного пересчёта оно откладывается
+    std::deque<Sheet::SpillPause> pauses;
+    for (const auto& sheet : sheets_) {
+        pauses.emplace_back(*sheet);
+    }
+    pool_.Run(std::move(tasks));
+}
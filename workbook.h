@@ -0,0 +1,85 @@
+#pragma once
+
+#include "sheet.h"
+#include "thread_pool.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Книга из именованных листов с общим графом зависимостей: формула может
+// ссылаться на ячейку другого листа как Sheet2!A1. Пересчёт затрагивает
+// только листы, в которых есть устаревшие ячейки, а независимые группы
+// листов пересчитываются параллельно.
+class Workbook {
+public:
+    // threads — число рабочих потоков пересчёта; 0 выбирает его по числу ядер
+    explicit Workbook(size_t threads = 0);
+
+    Workbook(const Workbook&) = delete;
+
+    Workbook& operator=(const Workbook&) = delete;
+
+    ~Workbook();
+
+    // Добавляет пустой лист. Имя должно состоять из латинских букв, цифр и
+    // знаков подчёркивания и не начинаться с цифры; иначе, как и при повторе
+    // имени, бросается std::invalid_argument. Формулы, которые уже ссылались
+    // на лист с этим именем, связываются с новым листом.
+    Sheet& AddSheet(std::string name);
+
+    Sheet* GetSheet(std::string_view name);
+
+    const Sheet* GetSheet(std::string_view name) const;
+
+    // Имена листов в порядке добавления
+    std::vector<std::string_view> GetSheetNames() const;
+
+    // Вычисляет устаревшие ячейки листов, изменённых с прошлого пересчёта.
+    // Листы, связанные ссылками, попадают в одну группу и считаются одним
+    // потоком; группы считаются параллельно. Правки листов во время пересчёта
+    // не допускаются.
+    void Recalculate();
+
+    // Отменяет фоновые пересчёты всех листов (Sheet::RecalculateAsync) и
+    // дожидается их остановки
+    void StopRecalculation();
+
+    // Следующие методы вызываются листами и ячейками книги.
+
+    // Ссылки на листы, которых пока нет в книге
+    void AddMissingRef(const std::string& sheet, Cell* dependent);
+
+    void RemoveMissingRef(const std::string& sheet, Cell* dependent);
+
+    // Учитывает delta ссылок ячеек листа from на ячейки листа to
+    void ChangeLinks(const Sheet* from, const Sheet* to, int delta);
+
+    void ChangeSubscriptionCount(int delta) {
+        subscription_count_ += delta;
+    }
+
+    bool HasSubscriptions() const {
+        return subscription_count_ > 0;
+    }
+
+    RecalcSync& GetRecalcSync() {
+        return recalc_sync_;
+    }
+
+private:
+    // Объявлена раньше листов, чтобы пережить их фоновые пересчёты
+    RecalcSync recalc_sync_;
+    std::vector<std::unique_ptr<Sheet>> sheets_;
+    std::unordered_map<std::string_view, Sheet*> sheets_by_name_;
+    std::unordered_map<std::string, std::unordered_set<Cell*>> missing_refs_;
+    // Число ссылок между парами листов; по ним листы делятся на группы
+    std::map<std::pair<const Sheet*, const Sheet*>, size_t> links_;
+    int subscription_count_ = 0;
+    // Объявлен последним, чтобы потоки завершились раньше удаления листов
+    ThreadPool pool_;
+};